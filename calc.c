@@ -70,10 +70,12 @@ void init_seqnt_map(int *seqnt_map) {
 
 void set_prob_matrix(double *matrix, const read_t *read, const double *is_match, const double *no_match, const int *seqnt_map, const int bisulfite) {
     int i, b; // array[row * width + col] = value
+    int is_top = (!read_is_read2(read) && !read_is_reverse(read)) || (read_is_read2(read) && read_is_reverse(read)); // read from forward strand, top strand
     for (b = 0; b < read->length; b++) {
+        char base = read_base(read, b);
         for (i = 0; i < NT_CODES; i++) matrix[read->length * i + b] = no_match[b];
-        matrix[read->length * seqnt_map[read->qseq[b] - 'A'] + b] = is_match[b];
-        switch (read->qseq[b]) {
+        matrix[read->length * seqnt_map[base - 'A'] + b] = is_match[b];
+        switch (base) {
         case 'A':
             matrix[read->length * seqnt_map['M' - 'A'] + b] = is_match[b];
             matrix[read->length * seqnt_map['R' - 'A'] + b] = is_match[b];
@@ -112,7 +114,7 @@ void set_prob_matrix(double *matrix, const read_t *read, const double *is_match,
             break;
         }
         if (bisulfite > 0) {
-            switch (read->qseq[b]) {
+            switch (base) {
             case 'A':
                 matrix[read->length * seqnt_map['a' - 'A'] + b] = is_match[b]; // unmethylated reverse strand
                 break;
@@ -126,29 +128,36 @@ void set_prob_matrix(double *matrix, const read_t *read, const double *is_match,
                 matrix[read->length * seqnt_map['g' - 'A'] + b] = is_match[b]; // methylated reverse strand
                 break;
             }
-            if ((bisulfite == 1) && (read->qseq[b] == 'T') && ((!read->is_read2 && !read->is_reverse) || (read->is_read2 && read->is_reverse))) matrix[read->length * seqnt_map['C' - 'A'] + b] = is_match[b]; // unmethylated forward strand, top strand
-            else if ((bisulfite == 2) && (read->qseq[b] == 'A') && ((!read->is_read2 && read->is_reverse) || (read->is_read2 && !read->is_reverse))) matrix[read->length * seqnt_map['G' - 'A'] + b] = is_match[b]; // unmethylated reverse strand, bottom strand
-            else if ((bisulfite >= 3) && (read->qseq[b] == 'T') && ((!read->is_read2 && !read->is_reverse) || (read->is_read2 && read->is_reverse))) matrix[read->length * seqnt_map['C' - 'A'] + b] = is_match[b]; // unmethylated forward strand, top strand
-            else if ((bisulfite >= 3) && (read->qseq[b] == 'A') && ((!read->is_read2 && read->is_reverse) || (read->is_read2 && !read->is_reverse))) matrix[read->length * seqnt_map['G' - 'A'] + b] = is_match[b]; // unmethylated reverse strand, bottom strand
+            if ((bisulfite == 1) && (base == 'T') && is_top) matrix[read->length * seqnt_map['C' - 'A'] + b] = is_match[b]; // unmethylated forward strand, top strand
+            else if ((bisulfite == 2) && (base == 'A') && !is_top) matrix[read->length * seqnt_map['G' - 'A'] + b] = is_match[b]; // unmethylated reverse strand, bottom strand
+            else if ((bisulfite >= 3) && (base == 'T') && is_top) matrix[read->length * seqnt_map['C' - 'A'] + b] = is_match[b]; // unmethylated forward strand, top strand
+            else if ((bisulfite >= 3) && (base == 'A') && !is_top) matrix[read->length * seqnt_map['G' - 'A'] + b] = is_match[b]; // unmethylated reverse strand, bottom strand
         }
     }
 }
 
-double calc_read_prob(const double *matrix, int read_length, const char *seq, int seq_length, int pos, int *seqnt_map) {
+int encode_seqnt(uint8_t *code, const char *seq, int length, const int *seqnt_map) {
+    /* Bases as their row of the read probability matrix, checked once here instead of in every kernel, code may be seq itself; 
+       position of the first base outside the alphabet, -1 if none */
+    int i;
+    for (i = 0; i < length; i++) {
+        int c = seq[i] - 'A';
+        if (c < 0 || c > 57 || (c > 25 && c < 32)) return i;
+        code[i] = seqnt_map[c];
+    }
+    return -1;
+}
+
+double calc_read_prob(const double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos) {
     int i; // array[width * row + col] = value
     int end = (pos + read_length < seq_length) ? pos + read_length : seq_length;
 
     double probability[end - pos];
-    for (i = pos;  i < end; i++) {
-        int c = seq[i] - 'A';
-        if (c < 0 || c > 57 || (c > 25 && c < 32)) { exit_err("Character %c at pos %d (%d) not in valid alphabet\n", seq[i], i, seq_length); }
-
-        probability[i - pos] = matrix[read_length * seqnt_map[c] + (i - pos)];
-    }
+    for (i = pos;  i < end; i++) probability[i - pos] = matrix[read_length * seq[i] + (i - pos)];
     return sum_d(probability, end - pos);
 }
 
-double calc_prob_region(const double *matrix, int read_length, const char *seq, int seq_length, int pos, int start, int end, int *seqnt_map) {
+double calc_prob_region(const double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int start, int end) {
     if (start < 0) start = 0;
     else if (start >= seq_length) start = seq_length - 1;
     if (end < 0) end = 0;
@@ -157,12 +166,12 @@ double calc_prob_region(const double *matrix, int read_length, const char *seq,
     int i;
     double p[end - start];
     for (i = start; i < end; i++) {
-        p[i - start] = calc_read_prob(matrix, read_length, seq, seq_length, i, seqnt_map);
+        p[i - start] = calc_read_prob(matrix, read_length, seq, seq_length, i);
     }
     return log_sum_exp(p, end - start);
 }
 
-double calc_prob(const double *matrix, int read_length, const char *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice, int *seqnt_map) {
+double calc_prob(const double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice) {
     /* Get the sequence g in G and its neighborhood (half a read length flanking regions) */
     int start = pos - (read_length / 2);
     int end = pos + (read_length / 2);
@@ -170,7 +179,7 @@ double calc_prob(const double *matrix, int read_length, const char *seq, int seq
     int i, j;
     double probability = 0;
     if (n_splice == 0) {
-        probability = calc_prob_region(matrix, read_length, seq, seq_length, pos, start, end, seqnt_map);
+        probability = calc_prob_region(matrix, read_length, seq, seq_length, pos, start, end);
     }
     else { // calculate the probability for each splice section separately
         int r_pos = 0;
@@ -183,7 +192,7 @@ double calc_prob(const double *matrix, int read_length, const char *seq, int seq
 
             double *submatrix = malloc(NT_CODES * r_len * sizeof (double));
             for (j = 0; j < NT_CODES; j++) memcpy(&submatrix[r_len * j], &matrix[read_length * j + r_pos], r_len * sizeof (double));
-            probability += calc_prob_region(submatrix, r_len, seq, seq_length, g_pos, start, end, seqnt_map);
+            probability += calc_prob_region(submatrix, r_len, seq, seq_length, g_pos, start, end);
             free(submatrix); submatrix = NULL;
 
             g_pos += r_len + splice_offset[i];
@@ -193,7 +202,7 @@ double calc_prob(const double *matrix, int read_length, const char *seq, int seq
     return probability;
 }
 
-double x_drop(const double *matrix, int read_length, const char *seq, int seq_length, int start, int end, int gap_op, int gap_ex, int *seqnt_map) { /* short in long version */
+double x_drop(const double *matrix, int read_length, const uint8_t *seq, int seq_length, int start, int end, int gap_op, int gap_ex) { /* short in long version */
     //double S[read_length + 1][end - start + 2]; // M = read length; N = end - start + 1
     //double A[read_length + 1][end - start + 2];
     //double B[read_length + 1][end - start + 2];
@@ -233,10 +242,7 @@ double x_drop(const double *matrix, int read_length, const char *seq, int seq_le
                 //printf(">");
                 if (j > 0) {
                     //printf(">");
-                    int x = j - 1 + start;
-                    int c = seq[x] - 'A';
-                    if (c < 0 || c > 57 || (c > 25 && c < 32)) { exit_err("Character %c at pos %d (%d) not in valid alphabet\n", seq[x], x, seq_length); }
-                    upleft = S[upleft_i] + matrix[read_length * seqnt_map[c] + (i - 1)];
+                    upleft = S[upleft_i] + matrix[read_length * seq[j - 1 + start] + (i - 1)];
                 }
             }
 
@@ -283,7 +289,7 @@ double x_drop(const double *matrix, int read_length, const char *seq, int seq_le
     return max_score;
 }
 
-double smith_waterman_gotoh(const double *matrix, int read_length, const char *seq, int seq_length, int start, int end, int gap_op, int gap_ex, int *seqnt_map) { /* short in long version */
+double smith_waterman_gotoh(const double *matrix, int read_length, const uint8_t *seq, int seq_length, int start, int end, int gap_op, int gap_ex) { /* short in long version */
     int i, j;
 
     int n = read_length + 1;
@@ -304,11 +310,9 @@ double smith_waterman_gotoh(const double *matrix, int read_length, const char *s
         curr[0] = 0;
         a_gap_curr[0] = 0;
         b_gap_curr[0] = 0;
+        const double *row = matrix + read_length * seq[i]; // probabilities of the read against this base
         for (j = 1; j <= read_length; j++) {
-            int c = seq[i] - 'A';
-            if (c < 0 || c > 57 || (c > 25 && c < 32)) { exit_err("Character %c at pos %d (%d) not in valid alphabet\n", seq[i], i, seq_length); }
-
-            upleft = prev[j - 1] + matrix[read_length * seqnt_map[c] + (j - 1)];
+            upleft = prev[j - 1] + row[j - 1];
 
             open = curr[j - 1] - gap_op;
             extend = a_gap_curr[j - 1] - gap_ex;
@@ -336,17 +340,17 @@ double smith_waterman_gotoh(const double *matrix, int read_length, const char *s
     return max_score;
 }
 
-double calc_prob_region_dp(const double *matrix, int read_length, const char *seq, int seq_length, int pos, int start, int end, int gap_op, int gap_ex, int *seqnt_map) {
+double calc_prob_region_dp(const double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int start, int end, int gap_op, int gap_ex) {
     if (start < 0) start = 0;
     else if (start >= seq_length) start = seq_length - 1;
     end += read_length;
     if (end < 0) end = 0;
     else if (end >= seq_length) end = seq_length - 1;
-    return smith_waterman_gotoh(matrix, read_length, seq, seq_length, start, end, gap_op, gap_ex, seqnt_map);
-    //return x_drop(matrix, read_length, seq, seq_length, start, end, gap_op, gap_ex, seqnt_map);
+    return smith_waterman_gotoh(matrix, read_length, seq, seq_length, start, end, gap_op, gap_ex);
+    //return x_drop(matrix, read_length, seq, seq_length, start, end, gap_op, gap_ex);
 }
 
-double calc_prob_dp(const double *matrix, int read_length, const char *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice, int gap_op, int gap_ex, int *seqnt_map) {
+double calc_prob_dp(const double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice, int gap_op, int gap_ex) {
     /* Get the sequence g in G and its neighborhood (half a read length flanking regions) */
     int start = pos - (read_length / 2);
     int end = pos + (read_length / 2);
@@ -354,7 +358,7 @@ double calc_prob_dp(const double *matrix, int read_length, const char *seq, int
     int i, j;
     double probability = 0;
     if (n_splice == 0) {
-        probability = calc_prob_region_dp(matrix, read_length, seq, seq_length, pos, start, end, gap_op, gap_ex, seqnt_map);
+        probability = calc_prob_region_dp(matrix, read_length, seq, seq_length, pos, start, end, gap_op, gap_ex);
     }
     else { // calculate the probability for each splice section separately
         int r_pos = 0;
@@ -367,7 +371,7 @@ double calc_prob_dp(const double *matrix, int read_length, const char *seq, int
 
             double *submatrix = malloc(NT_CODES * r_len * sizeof (double));
             for (j = 0; j < NT_CODES; j++) memcpy(&submatrix[r_len * j], &matrix[read_length * j + r_pos], r_len * sizeof (double));
-            probability += calc_prob_region_dp(submatrix, r_len, seq, seq_length, g_pos, start, end, gap_op, gap_ex, seqnt_map);
+            probability += calc_prob_region_dp(submatrix, r_len, seq, seq_length, g_pos, start, end, gap_op, gap_ex);
             free(submatrix); submatrix = NULL;
 
             g_pos += r_len + splice_offset[i];
@@ -377,7 +381,8 @@ double calc_prob_dp(const double *matrix, int read_length, const char *seq, int
     return probability;
 }
 
-void calc_prob_snps_region(double *prgu, double *prgv, vector_int_t *combo, variant_t **var_data, double *matrix, int read_length, const char *seq, int seq_length, int pos, int start, int end, int *seqnt_map) {
+void calc_prob_snps_region(double *prgu, double *prgv, vector_int_t *combo, variant_t **var_data, double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int start, int end, int *seqnt_map) {
+    /* seqnt_map for the variant alleles, seq is already coded */
     if (start < 0) start = 0;
     else if (start >= seq_length) start = seq_length;
     if (end < 0) end = 0;
@@ -390,7 +395,7 @@ void calc_prob_snps_region(double *prgu, double *prgv, vector_int_t *combo, vari
     //ALIGN_destroy(a);
     for (i = start; i < end; i++) {
         int n = i - start;
-        prgu_i[n] = calc_read_prob(matrix, read_length, seq, seq_length, i, seqnt_map); // reference probability per position i
+        prgu_i[n] = calc_read_prob(matrix, read_length, seq, seq_length, i); // reference probability per position i
         prgv_i[n] = prgu_i[n]; // alternative probability per position i
 
         int offset = 0;
@@ -410,22 +415,25 @@ void calc_prob_snps_region(double *prgu, double *prgv, vector_int_t *combo, vari
                 if (r_pos >= read_length || g_pos >= seq_length) break;
 
                 int x;
-                if (m >= ref_len) x = seq[g_pos] - 'A';
-                else x = v->ref[m] - 'A';
+                if (m >= ref_len) x = seq[g_pos];
+                else {
+                    x = v->ref[m] - 'A';
+                    if (x < 0 || x > 57 || (x > 25 && x < 32)) { exit_err("Ref character %c at rpos %d for %s;%d;%s;%s not in valid alphabet\n", v->ref[m], m, v->chr, v->pos, v->ref, v->alt); }
+                    x = seqnt_map[x];
+                }
 
                 int y;
                 if (m >= alt_len) {
                     if (g_pos + ref_len - alt_len >= seq_length) break;
-                    y = seq[g_pos + ref_len - alt_len] - 'A';
+                    y = seq[g_pos + ref_len - alt_len];
                 }
                 else {
                     y = v->alt[m] - 'A';
+                    if (y < 0 || y > 57 || (y > 25 && y < 32)) { exit_err("Alt character %c at rpos %d for %s;%d;%s;%s not in valid alphabet\n", v->alt[m], m, v->chr, v->pos, v->ref, v->alt); }
+                    y = seqnt_map[y];
                 }
 
-                if (x < 0 || x > 57 || (x > 25 && x < 32)) { exit_err("Ref character %c at gpos %d (%d) not in valid alphabet\n", seq[g_pos], g_pos, seq_length); }
-                if (y < 0 || y > 57 || (y > 25 && y < 32)) { exit_err("Alt character %c at rpos %d for %s;%d;%s;%s not in valid alphabet\n", v->alt[m], m, v->chr, v->pos, v->ref, v->alt); }
-
-                prgv_i[n] = prgv_i[n] - matrix[read_length * seqnt_map[x] + r_pos] + matrix[read_length * seqnt_map[y] + r_pos]; // update alternative array
+                prgv_i[n] = prgv_i[n] - matrix[read_length * x + r_pos] + matrix[read_length * y + r_pos]; // update alternative array
             }
             offset += alt_len - ref_len;
         }
@@ -434,7 +442,7 @@ void calc_prob_snps_region(double *prgu, double *prgv, vector_int_t *combo, vari
     *prgv += log_sum_exp(prgv_i, end - start);
 }
 
-void calc_prob_snps(double *prgu, double *prgv, vector_int_t *combo, variant_t **var_data, double *matrix, int read_length, const char *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice, int *seqnt_map) {
+void calc_prob_snps(double *prgu, double *prgv, vector_int_t *combo, variant_t **var_data, double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice, int *seqnt_map) {
     /* Get the sequence g in G and its neighborhood (half a read length flanking regions) */
     int start = pos - (read_length / 2);
     int end = pos + (read_length / 2);
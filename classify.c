@@ -0,0 +1,141 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Given the sequencing data and candidate variant, explicitly test 
+the alternative hypothesis against the reference hypothesis
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#include <stdlib.h>
+#include "classify.h"
+#include "util.h"
+
+static const char *class_name[] = {"REF", "ALT", "RLA", "MUL", "UNK"};
+static const char *class_suffix[NCLASS_BAM] = {"ref", "alt", "mul", "unk"};
+
+void classify_var_add(vector_t *var_list, const char *var) {
+    /* Variant of a read's favoured hypothesis, as chr,pos,ref,alt, kept once */
+    size_t i;
+    for (i = 0; i < var_list->len; i++) {
+        if (strcmp(var, (char *)var_list->data[i]) == 0) return;
+    }
+    vector_add(var_list, strdup(var));
+}
+
+int classify_read(read_t *r, int (*in_output)(const char *var, void *data), void *data) {
+    /* Class of a read from its summed likelihoods and the variants of its favoured hypotheses, in_output tells if a 
+       variant is in the EAGLE output, i.e. in the best hypothesis of its set */
+    size_t i;
+    char **v = (r->var_list != NULL) ? (char **)r->var_list->data : NULL;
+    size_t nvariants = (r->var_list != NULL) ? r->var_list->len : 0;
+
+    int multiallele;
+    if (nvariants > 1) { // check if only multi-allelic variants at the same position & no hope of differentiating ref vs alt
+        multiallele = 1;
+        int prev_pos = -1;
+        for (i = 0; i < nvariants; i++) {
+            int pos;
+            int t = sscanf(v[i], "%*[^,],%d,%*[^,],%*[^,],", &pos);
+            if (t < 1) { exit_err("bad fields in %s\n", v[i]); }
+            if (prev_pos != -1 && pos - prev_pos != 0) {
+                multiallele = 0;
+                break;
+            }
+            prev_pos = pos;
+        }
+        if (multiallele) {
+            r->index = CLASS_MUL;
+            return r->index;
+        }
+    }
+
+    // if any variant in list is not in EAGLE output, it suggests variants are from a different phase if alt wins
+    multiallele = 0;
+    for (i = 0; i < nvariants; i++) {
+        if (in_output(v[i], data)) multiallele = 1;
+    }
+
+    if (r->prgu > r->prgv && r->prgu - r->prgv >= 0.69) { // ref wins
+        r->index = CLASS_REF;
+    }
+    else if (r->prgv > r->prgu && r->prgv - r->prgu >= 0.69) { // alt wins
+        // EAGLE outputs the set with highest likelihood ratio, i.e. most different from reference, leaving the "reference-like-allele"
+        r->index = multiallele ? CLASS_RLA : CLASS_ALT;
+    }
+    else { // unknown
+        r->index = CLASS_UNK;
+    }
+    return r->index;
+}
+
+void classify_print(FILE *fh, const read_t *r) {
+    /* One line of the classified read list */
+    size_t i;
+    fprintf(fh, "%s\t%s\t%s\t%d\t%f\t%f\t%f\t%s\t", r->name, class_name[r->index], r->chr, r->pos, r->prgu, r->prgv, r->pout, r->flag);
+    if (r->var_list != NULL) {
+        for (i = 0; i < r->var_list->len; i++) { fprintf(fh, "%s;", (char *)r->var_list->data[i]); }
+    }
+    fprintf(fh, "\n");
+}
+
+void classify_bam_open(samFile **out, const char *prefix, const bam_hdr_t *bam_header, htsThreadPool *tpool) {
+    /* prefix.ref.bam, prefix.alt.bam, prefix.mul.bam, prefix.unk.bam */
+    int i;
+    for (i = 0; i < NCLASS_BAM; i++) {
+        int n = snprintf(NULL, 0, "%s.%s.bam", prefix, class_suffix[i]) + 1;
+        char out_fn[n];
+        snprintf(out_fn, n, "%s.%s.bam", prefix, class_suffix[i]);
+        out[i] = sam_open(out_fn, "wb"); // write bam
+        if (out[i] == NULL) { exit_err("failed to open BAM file %s\n", out_fn); }
+        if (tpool != NULL && tpool->pool != NULL) hts_set_thread_pool(out[i], tpool); // shared bgzf threads
+        if (sam_hdr_write(out[i], bam_header) != 0) { exit_err("bad header write %s\n", out_fn); } // write bam header
+    }
+}
+
+samFile *classify_bam_select(samFile **out, int index, int reverse, int refonly) {
+    /* Output of a read by its class, reverse swaps ref and alt for reads aligned to the second reference */
+    if (index == CLASS_REF && !reverse) return out[0];
+    else if (index == CLASS_ALT && reverse) return out[0]; // reverse, ALT writes to ref.bam
+    else if (!refonly && index == CLASS_ALT && !reverse) return out[1];
+    else if (!refonly && index == CLASS_REF && reverse) return out[1]; // reverse, REF writes to alt.bam
+    else if (!refonly && index == CLASS_RLA) return out[0];
+    else if (!refonly && index == CLASS_MUL) return out[2];
+    else if (index == CLASS_UNK) return out[3];
+    return NULL;
+}
+
+samFile *classify_tagged_open(const char *prefix, const bam_hdr_t *bam_header, htsThreadPool *tpool) {
+    /* prefix.tagged.bam, every read of the input with the classified ones tagged */
+    int n = snprintf(NULL, 0, "%s.tagged.bam", prefix) + 1;
+    char out_fn[n];
+    snprintf(out_fn, n, "%s.tagged.bam", prefix);
+    samFile *out = sam_open(out_fn, "wb"); // write bam
+    if (out == NULL) { exit_err("failed to open BAM file %s\n", out_fn); }
+    if (tpool != NULL && tpool->pool != NULL) hts_set_thread_pool(out, tpool); // shared bgzf threads
+    if (sam_hdr_write(out, bam_header) != 0) { exit_err("bad header write %s\n", out_fn); } // write bam header
+    return out;
+}
+
+void classify_tag(bam1_t *aln, const read_t *r, int reverse, int refonly) {
+    /* ec: class, eu, ev, eo: log likelihoods of the reference, alternative and outside paralog
+     * reverse and refonly as in classify_bam_select, so the tags match the split BAM the read would go to */
+    int index = r->index;
+    if (reverse && index == CLASS_REF) index = CLASS_ALT;
+    else if (reverse && index == CLASS_ALT) index = CLASS_REF;
+    if (refonly && index != CLASS_REF && index != CLASS_UNK) return; // not written with refonly, leave untagged
+    float prgu = reverse ? r->prgv : r->prgu;
+    float prgv = reverse ? r->prgu : r->prgv;
+    if (bam_aux_update_str(aln, "ec", -1, class_name[index]) != 0 ||
+        bam_aux_update_float(aln, "eu", prgu) != 0 ||
+        bam_aux_update_float(aln, "ev", prgv) != 0 ||
+        bam_aux_update_float(aln, "eo", r->pout) != 0) { exit_err("failed to tag read %s\n", bam_get_qname(aln)); }
+}
+
+void classify_bam_close(samFile **out) {
+    int i;
+    for (i = 0; i < NCLASS_BAM; i++) {
+        if (out[i] != NULL && sam_close(out[i]) != 0) { exit_err("failed to close split BAM file\n"); }
+        out[i] = NULL;
+    }
+}
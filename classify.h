@@ -0,0 +1,37 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Given the sequencing data and candidate variant, explicitly test 
+the alternative hypothesis against the reference hypothesis
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#ifndef _classify_h_
+#define _classify_h_
+
+#include <stdio.h>
+#include "htslib/sam.h"
+#include "htslib/thread_pool.h"
+#include "vector.h"
+
+/* Read classes, set in read->index */
+#define CLASS_REF 0 // reference
+#define CLASS_ALT 1 // alternative
+#define CLASS_RLA 2 // reference-like-allele, multi-allelic, closer to the reference
+#define CLASS_MUL 3 // multi-allelic that are undifferentiateable
+#define CLASS_UNK 4 // unknown, ambiguous with equal likelihoods for reference and alternative
+#define NCLASS_BAM 4 // split bam files: ref, alt, mul, unk
+
+void classify_var_add(vector_t *var_list, const char *var);
+int classify_read(read_t *r, int (*in_output)(const char *var, void *data), void *data);
+void classify_print(FILE *fh, const read_t *r);
+
+void classify_bam_open(samFile **out, const char *prefix, const bam_hdr_t *bam_header, htsThreadPool *tpool);
+samFile *classify_bam_select(samFile **out, int index, int reverse, int refonly);
+void classify_bam_close(samFile **out);
+
+samFile *classify_tagged_open(const char *prefix, const bam_hdr_t *bam_header, htsThreadPool *tpool);
+void classify_tag(bam1_t *aln, const read_t *r, int reverse, int refonly);
+
+#endif
@@ -0,0 +1,282 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Utility program that converts a BAM file into a read store, for EAGLE runs with --readstore
+
+The reads are stored as memory mapped columns with a position index, so that repeated runs 
+against the same BAM, with other VCFs or parameters, read them without BGZF decompression or parsing
+
+ex) eagle-index --iothread=4 align.bam
+    eagle -t 2 -v var.vcf -a align.bam -r ref.fa --readstore > out.txt
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "htslib/sam.h"
+#include "htslib/kstring.h"
+#include "htslib/thread_pool.h"
+#include "vector.h"
+#include "util.h"
+#include "store.h"
+
+#define VERSION "1.1.3"
+
+/* Command line arguments */
+static char *bam_file;
+static char *fa_file;
+static char *out_file;
+static int iothread;
+static htsThreadPool tpool = {NULL, 0};
+
+/* Time info */
+static time_t now; 
+static struct tm *time_info; 
+#define print_status(M, ...) time(&now); time_info = localtime(&now); fprintf(stderr, M, ##__VA_ARGS__);
+
+typedef struct {
+    FILE *fh[STORE_NCOL]; // anonymous temporary file per column, concatenated at the end
+    uint64_t length[STORE_NCOL];
+} column_t;
+
+static void column_put(column_t *c, int col, const void *data, size_t n) {
+    if (n > 0 && fwrite(data, 1, n, c->fh[col]) != n) { exit_err("failed to write temporary column %d\n", col); }
+    c->length[col] += n;
+}
+
+static uint64_t column_str(column_t *c, const char *str) {
+    /* Offset of a nul terminated string in the string column */
+    if (str == NULL) return STORE_NONE;
+    uint64_t offset = c->length[STORE_STR];
+    column_put(c, STORE_STR, str, strlen(str) + 1);
+    return offset;
+}
+
+static void column_u64(column_t *c, int col, uint64_t value) {
+    column_put(c, col, &value, sizeof (value));
+}
+
+static void store_build(void) {
+    int i;
+    struct stat st;
+    if (stat(bam_file, &st) != 0) { exit_err("failed to stat BAM file %s\n", bam_file); }
+
+    samFile *sam_in = sam_open(bam_file, "r"); // open bam file
+    if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_file); }
+    if (tpool.pool != NULL) hts_set_thread_pool(sam_in, &tpool); // shared bgzf threads
+    if (fa_file != NULL && sam_in->format.format == cram && hts_set_fai_filename(sam_in, fa_file) != 0) { exit_err("failed to set CRAM reference %s\n", fa_file); }
+    bam_hdr_t *bam_header = sam_hdr_read(sam_in); // bam header
+    if (bam_header == 0) { exit_err("bad header %s\n", bam_file); }
+
+    column_t c;
+    for (i = 0; i < STORE_NCOL; i++) {
+        c.fh[i] = tmpfile();
+        if (c.fh[i] == NULL) { exit_err("failed to create temporary file\n"); }
+        c.length[i] = 0;
+    }
+
+    int n_targets = bam_header->n_targets;
+    uint64_t *tid_first = calloc(n_targets + 1, sizeof (uint64_t));
+    uint64_t *win_off = calloc(n_targets + 1, sizeof (uint64_t));
+    uint64_t nwin = 0; // windows filled for the current contig, see store_query
+
+    uint64_t n_reads = 0;
+    int prev_tid = -1, prev_pos = -1;
+    kstring_t str = {0, 0, NULL};
+    bam1_t *aln = bam_init1(); // initialize an alignment
+    while (sam_read1(sam_in, bam_header, aln) >= 0) {
+        int32_t tid = aln->core.tid;
+        if (tid < 0) continue; // not mapped, never fetched by position
+        if (tid < prev_tid || (tid == prev_tid && aln->core.pos < prev_pos)) { exit_err("BAM file %s is not sorted by coordinates\n", bam_file); }
+        if (tid != prev_tid) { // contigs started, including those without reads
+            int t;
+            for (t = prev_tid + 1; t <= tid; t++) {
+                tid_first[t] = n_reads;
+                win_off[t] = c.length[STORE_WIN] / sizeof (uint64_t);
+            }
+            nwin = 0;
+            prev_tid = tid;
+        }
+        prev_pos = aln->core.pos;
+
+        /* Spans and splice blocks as read_fetch computes them, before the soft clip options */
+        int32_t pos = aln->core.pos;
+        int32_t ref_end = bam_endpos(aln);
+        int32_t end = pos;
+        int32_t s_clip = 0, e_clip = 0;
+        int start_align = 0;
+        int32_t splice_pos = 0;
+        uint64_t nsplice = 0;
+        uint32_t *cigar = bam_get_cigar(aln);
+        str.l = 0;
+        for (i = 0; i < aln->core.n_cigar; i++) {
+            int op = bam_cigar_op(cigar[i]);
+            int32_t oplen = bam_cigar_oplen(cigar[i]);
+            if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) start_align = 1;
+            else if (start_align == 0 && op == BAM_CSOFT_CLIP) s_clip = oplen;
+            else if (start_align == 1 && op == BAM_CSOFT_CLIP) e_clip = oplen;
+
+            if (op == BAM_CREF_SKIP) {
+                int32_t block[2] = {splice_pos, oplen};
+                column_put(&c, STORE_SPLICE, block, sizeof (block));
+                nsplice++;
+            }
+            else if (op != BAM_CDEL) {
+                splice_pos += oplen;
+            }
+            if (op != BAM_CINS) end += oplen;
+            ksprintf(&str, "%d%c", oplen, bam_cigar_opchr(cigar[i]));
+        }
+        int32_t lqseq = aln->core.l_qseq;
+        int32_t qlen = bam_cigar2qlen(aln->core.n_cigar, cigar);
+        int32_t n_cigar = aln->core.n_cigar;
+        int32_t nh = 1;
+        uint8_t *tag = bam_aux_get(aln, "NH");
+        if (tag != NULL) nh = bam_aux2i(tag);
+        uint16_t flag = aln->core.flag;
+        uint8_t mapq = aln->core.qual;
+
+        column_put(&c, STORE_TID, &tid, sizeof (tid));
+        column_put(&c, STORE_POS, &pos, sizeof (pos));
+        column_put(&c, STORE_REF_END, &ref_end, sizeof (ref_end));
+        column_put(&c, STORE_END, &end, sizeof (end));
+        column_put(&c, STORE_S_CLIP, &s_clip, sizeof (s_clip));
+        column_put(&c, STORE_E_CLIP, &e_clip, sizeof (e_clip));
+        column_put(&c, STORE_LQSEQ, &lqseq, sizeof (lqseq));
+        column_put(&c, STORE_QLEN, &qlen, sizeof (qlen));
+        column_put(&c, STORE_NCIGAR, &n_cigar, sizeof (n_cigar));
+        column_put(&c, STORE_NH, &nh, sizeof (nh));
+        column_put(&c, STORE_FLAG, &flag, sizeof (flag));
+        column_put(&c, STORE_MAPQ, &mapq, sizeof (mapq));
+
+        column_u64(&c, STORE_SEQ_OFF, c.length[STORE_SEQ]);
+        column_put(&c, STORE_SEQ, bam_get_seq(aln), (lqseq + 1) / 2);
+        column_u64(&c, STORE_QUAL_OFF, c.length[STORE_QUAL]);
+        column_put(&c, STORE_QUAL, bam_get_qual(aln), lqseq);
+        column_u64(&c, STORE_SPLICE_OFF, c.length[STORE_SPLICE] / (2 * sizeof (int32_t)) - nsplice);
+
+        column_u64(&c, STORE_NAME_OFF, column_str(&c, bam_get_qname(aln)));
+        column_u64(&c, STORE_CIGAR_OFF, column_str(&c, (str.l > 0) ? str.s : "*"));
+        tag = bam_aux_get(aln, "XA");
+        column_u64(&c, STORE_XA_OFF, column_str(&c, (tag != NULL) ? bam_aux2Z(tag) : NULL));
+        tag = bam_aux_get(aln, "RG");
+        column_u64(&c, STORE_RG_OFF, column_str(&c, (tag != NULL) ? bam_aux2Z(tag) : NULL));
+
+        for (; ref_end > 0 && nwin <= (uint64_t)(ref_end - 1) >> STORE_WINDOW_SHIFT; nwin++) column_u64(&c, STORE_WIN, n_reads); // first read overlapping each window
+        n_reads++;
+    }
+    for (i = prev_tid + 1; i <= n_targets; i++) {
+        tid_first[i] = n_reads;
+        win_off[i] = c.length[STORE_WIN] / sizeof (uint64_t);
+    }
+    column_u64(&c, STORE_SPLICE_OFF, c.length[STORE_SPLICE] / (2 * sizeof (int32_t)));
+    for (i = 0; i < n_targets; i++) column_u64(&c, STORE_TARGET_OFF, column_str(&c, bam_header->target_name[i]));
+    for (i = 0; i <= n_targets; i++) column_u64(&c, STORE_TID_FIRST, tid_first[i]);
+    for (i = 0; i <= n_targets; i++) column_u64(&c, STORE_WIN_OFF, win_off[i]);
+    free(str.s); str.s = NULL;
+    free(tid_first); tid_first = NULL;
+    free(win_off); win_off = NULL;
+    bam_destroy1(aln);
+    bam_hdr_destroy(bam_header);
+    sam_close(sam_in);
+    print_status("# Read BAM: %s\t%llu reads\t%s", bam_file, (unsigned long long)n_reads, asctime(time_info));
+
+    /* Header, then the columns at 8 byte aligned offsets */
+    store_header_t header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, STORE_MAGIC, 8);
+    header.bam_size = st.st_size;
+    header.bam_mtime = st.st_mtime;
+    header.n_targets = n_targets;
+    header.n_reads = n_reads;
+
+    FILE *out = fopen(out_file, "wb");
+    if (out == NULL) { exit_err("failed to open read store %s\n", out_file); }
+    if (fwrite(&header, sizeof (header), 1, out) != 1) { exit_err("failed to write read store %s\n", out_file); }
+    uint64_t offset = sizeof (header);
+    char buf[1 << 16];
+    for (i = 0; i < STORE_NCOL; i++) {
+        static const char pad[8] = {0};
+        size_t npad = (8 - offset % 8) % 8;
+        if (npad > 0 && fwrite(pad, 1, npad, out) != npad) { exit_err("failed to write read store %s\n", out_file); }
+        offset += npad;
+        header.offset[i] = offset;
+        header.length[i] = c.length[i];
+
+        rewind(c.fh[i]);
+        size_t n;
+        while ((n = fread(buf, 1, sizeof (buf), c.fh[i])) > 0) {
+            if (fwrite(buf, 1, n, out) != n) { exit_err("failed to write read store %s\n", out_file); }
+        }
+        fclose(c.fh[i]); c.fh[i] = NULL;
+        offset += c.length[i];
+    }
+    rewind(out);
+    if (fwrite(&header, sizeof (header), 1, out) != 1) { exit_err("failed to write read store %s\n", out_file); }
+    if (fclose(out) != 0) { exit_err("failed to write read store %s\n", out_file); }
+    print_status("# Wrote read store: %s\t%llu bytes\t%s", out_file, (unsigned long long)offset, asctime(time_info));
+}
+
+static void print_usage() {
+    printf("\nUsage: eagle-index [options] alignment.bam\n\n");
+    printf("Converts a coordinate sorted BAM or CRAM file into a read store, alignment.bam.ers, used by eagle --readstore.\n");
+    printf("Options:\n");
+    printf("  -o --out        FILE   Output read store. [alignment.bam.ers]\n");
+    printf("  -r --ref        FILE   Reference sequence fasta file, only needed to decode CRAM input.\n");
+    printf("     --iothread   INT    Number of threads for BGZF decompression. [0]\n");
+    printf("     --version           Display version.\n");
+}
+
+int main(int argc, char **argv) {
+    /* Command line parameters defaults */
+    bam_file = NULL;
+    fa_file = NULL;
+    out_file = NULL;
+    iothread = 0;
+
+    static struct option long_options[] = {
+        {"ref", optional_argument, NULL, 'r'},
+        {"out", optional_argument, NULL, 'o'},
+        {"iothread", optional_argument, NULL, 994},
+        {"version", optional_argument, NULL, 999},
+        {0, 0, 0, 0}
+    };
+
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "r:o:", long_options, &opt)) != -1) {
+        switch (opt) {
+            case 0: break;
+            case 'r': fa_file = optarg; break;
+            case 'o': out_file = optarg; break;
+            case 994: iothread = parse_int(optarg); break;
+            case 999: printf("EAGLE-INDEX %s\n", VERSION); exit(0);
+            default: exit_usage("Bad options");
+        }
+    }
+    if (optind >= argc) { exit_usage("Missing BAM file!"); }
+    bam_file = argv[optind];
+
+    int n = strlen(bam_file) + 5;
+    char default_out[n];
+    snprintf(default_out, n, "%s.ers", bam_file);
+    if (out_file == NULL) out_file = default_out;
+
+    if (iothread > 0) { // pool for bgzf decompression
+        tpool.pool = hts_tpool_init(iothread);
+        if (tpool.pool == NULL) { exit_err("failed to create htslib thread pool with %d threads\n", iothread); }
+    }
+
+    print_status("# Start: \t%s", asctime(time_info));
+    clock_t tic = clock();
+    store_build();
+    if (tpool.pool != NULL) { hts_tpool_destroy(tpool.pool); tpool.pool = NULL; }
+
+    clock_t toc = clock();
+    print_status("# CPU time (hr):\t%f\n", (double)(toc - tic) / CLOCKS_PER_SEC / 3600);
+    return 0;
+}
@@ -20,9 +20,11 @@ This program is distributed under the terms of the GNU General Public License
 #include "htslib/sam.h"
 #include "htslib/faidx.h"
 #include "htslib/khash.h"
+#include "htslib/thread_pool.h"
 #include "vector.h"
 #include "util.h"
 #include "calc.h"
+#include "refmap.h"
 
 /* Constants */
 #define ALPHA 1.3     // Factor to account for longer read lengths lowering the probability a sequence matching an outside paralogous source
@@ -42,6 +44,9 @@ static char *bam_file;
 static char *fa_file;
 static char *out_file;
 static int nthread;
+static int iothread;
+static htsThreadPool tpool = {NULL, 0};
+static bam_hts_t *bam_shared; // opened first, its cram reference is shared with every per-thread handle
 static int pao;
 static int isc;
 static int nodup;
@@ -64,6 +69,7 @@ static char NT[4] = "ATGC";
 KHASH_MAP_INIT_STR(rsh, vector_t)   // hashmap: string key, vector value
 static khash_t(rsh) *refseq_hash; // pointer to hashmap
 static pthread_mutex_t refseq_lock; 
+static refmap_t *refmap; // reference mapped from eagle-ref, NULL when read from the fasta
 
 vector_t *bed_read(FILE *file) {
     vector_t *reg_list = vector_create(64, REGION_T);
@@ -89,31 +95,19 @@ vector_t *bed_read(FILE *file) {
     return reg_list;
 }
 
-static vector_t *bam_fetch(const char *bam_file, const char *chr, const int pos1, const int pos2) {
+static vector_t *bam_fetch(bam_hts_t *h, const char *chr, const int pos1, const int pos2) {
     /* Reads in region coordinates */
     vector_t *read_list = vector_create(64, READ_T);
 
-    samFile *sam_in = sam_open(bam_file, "r"); // open bam file
-    if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_file); }
-    bam_hdr_t *bam_header = sam_hdr_read(sam_in); // bam header
-    if (bam_header == 0) { exit_err("bad header %s\n", bam_file); }
-    hts_idx_t *bam_idx = sam_index_load(sam_in, bam_file); // bam index
-    if (bam_idx == NULL) { exit_err("failed to open BAM index %s\n", bam_file); }
-
-    int tid = bam_name2id(bam_header, chr);
-    hts_itr_t *iter = sam_itr_queryi(bam_idx, tid, pos1-1, pos2); // read iterator
+    int tid = bam_name2id(h->bam_header, chr);
+    hts_itr_t *iter = sam_itr_queryi(h->bam_idx, tid, pos1-1, pos2); // read iterator
     if (iter != NULL) {
-        bam1_t *aln = bam_init1(); // initialize an alignment
-        while (sam_itr_next(sam_in, iter, aln) >= 0) {
-            read_t *read = read_fetch(bam_header, aln, pao, isc, nodup, splice, phred64, const_qual);
+        while (sam_itr_next(h->sam_in, iter, h->aln) >= 0) {
+            read_t *read = read_fetch(h->bam_header, h->aln, pao, isc, nodup, splice, phred64, const_qual, verbose || debug > 1);
             if (read != NULL) vector_add(read_list, read);
         }
-        bam_destroy1(aln);
     }
     hts_itr_destroy(iter);
-    hts_idx_destroy(bam_idx);
-    bam_hdr_destroy(bam_header);
-    sam_close(sam_in);
     return read_list;
 }
 
@@ -133,31 +127,41 @@ static fasta_t *refseq_fetch(char *name, const char *fa_file) {
         exit_err("failed to find %s in hash key %d\n", name, k);
     }
 
-    faidx_t *fai = fai_load(fa_file);
-    if (fai == NULL) { 
-        errno = fai_build(fa_file);
-        if (errno == 0) { fai = fai_load(fa_file); }
-        else { exit_err("failed to build and open FA index %s\n", fa_file); }
+    fasta_t *f;
+    if (refmap != NULL) { /* Already coded in the map */
+        int id = refmap_name2id(refmap, name);
+        if (id < 0) { exit_err("failed to find %s in reference %s\n", name, fa_file); }
+        f = refmap_fasta(refmap, id);
+    }
+    else {
+        faidx_t *fai = fai_load(fa_file);
+        if (fai == NULL) { 
+            errno = fai_build(fa_file);
+            if (errno == 0) { fai = fai_load(fa_file); }
+            else { exit_err("failed to build and open FA index %s\n", fa_file); }
+        }
+        if (!faidx_has_seq(fai, name)) { exit_err("failed to find %s in reference %s\n", name, fa_file); }
+
+        f = fasta_create(name);
+        //f->seq = fai_fetch(fai, name, &f->seq_length);
+        f->seq = faidx_fetch_seq(fai, f->name, 0, faidx_seq_len(fai, f->name) - 1, &f->seq_length);
+        char *s;
+        for (s = f->seq; *s != '\0'; s++) *s = toupper(*s);
+        int i = encode_seqnt((uint8_t *)f->seq, f->seq, f->seq_length, seqnt_map); // seqnt_map codes from here on
+        if (i >= 0) { exit_err("Character %c at %s:%d not in valid alphabet\n", f->seq[i], name, i + 1); }
+        fai_destroy(fai);
     }
-    if (!faidx_has_seq(fai, name)) { exit_err("failed to find %s in reference %s\n", name, fa_file); }
-
-    fasta_t *f = fasta_create(name);
-    //f->seq = fai_fetch(fai, name, &f->seq_length);
-    f->seq = faidx_fetch_seq(fai, f->name, 0, faidx_seq_len(fai, f->name) - 1, &f->seq_length);
-    char *s;
-    for (s = f->seq; *s != '\0'; s++) *s = toupper(*s);
 
     int absent;
     k = kh_put(rsh, refseq_hash, f->name, &absent);
     vector_t *node = &kh_val(refseq_hash, k);
     if (absent) vector_init(node, 8, FASTA_T);
     vector_add(node, f);
-    fai_destroy(fai);
     pthread_mutex_unlock(&refseq_lock);
     return f;
 }
 
-static inline void calc_prob_snps_mut_region(double *prgu, double *prgv, int g_pos, const double *matrix, int read_length, const char *seq, int seq_length, int pos, int start, int end, int *seqnt_map) {
+static inline void calc_prob_snps_mut_region(double *prgu, double *prgv, int g_pos, const double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int start, int end, int *seqnt_map) {
     if (start < 0) start = 0;
     if (end >= seq_length) end = seq_length;
 
@@ -165,31 +169,30 @@ static inline void calc_prob_snps_mut_region(double *prgu, double *prgv, int g_p
     double prgu_i[end - start], prgv_i[end - start];
     for (i = start; i < end; i++) {
         int n = i - start;
-        prgu_i[n] = calc_read_prob(matrix, read_length, seq, seq_length, i, seqnt_map); // reference probability per position i
+        prgu_i[n] = calc_read_prob(matrix, read_length, seq, seq_length, i); // reference probability per position i
         prgv_i[n] = prgu_i[n]; // alternative probability per position i
 
         int r_pos = g_pos - pos;
         if (r_pos >= 0 && r_pos < read_length) {
-            int x = seq[g_pos] - 'A';
-            if (x < 0 || x >= 26) { exit_err("Ref character %c at pos %d (%d) not in valid alphabet\n", seq[g_pos], g_pos, seq_length); }
+            int x = seq[g_pos];
 
             double probability = 0;
             for (k = 0; k < 4; k++) {
-                if (NT[k] != seq[g_pos]) {
+                if (seqnt_map[NT[k] - 'A'] != x) {
                     double p = matrix[read_length * seqnt_map[NT[k] - 'A'] + r_pos];
                     probability = (probability == 0) ? p : log_add_exp(probability, p);
                     //printf("%c %f\t", NT[k], p);
                 }
             }
-            prgv_i[n] = prgv_i[n] - matrix[read_length * seqnt_map[x] + r_pos] + probability; // update alternative array
-            //printf("%d\t%d\t%c\t%d\t%f\t%f\t%f\t%f\n", i, g_pos, seq[g_pos], r_pos, prgu_i[n], prgv_i[n], (double)matrix[read_length * seqnt_map[x] + r_pos], probability);
+            prgv_i[n] = prgv_i[n] - matrix[read_length * x + r_pos] + probability; // update alternative array
+            //printf("%d\t%d\t%d\t%d\t%f\t%f\t%f\t%f\n", i, g_pos, seq[g_pos], r_pos, prgu_i[n], prgv_i[n], (double)matrix[read_length * x + r_pos], probability);
         }
     }
     *prgu += log_sum_exp(prgu_i, end - start);
     *prgv += log_sum_exp(prgv_i, end - start);
 }
 
-static inline void calc_prob_snps_mut(double *prgu, double *prgv, int g_pos, const double *matrix, int read_length, const char *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice, int *seqnt_map) {
+static inline void calc_prob_snps_mut(double *prgu, double *prgv, int g_pos, const double *matrix, int read_length, const uint8_t *seq, int seq_length, int pos, int *splice_pos, int *splice_offset, int n_splice, int *seqnt_map) {
     /* Get the sequence g in G and its neighborhood (half a read length flanking regions) */
     int start = pos; // - (read_length / 2);
     int end = pos + 1; //(read_length / 2);
@@ -220,17 +223,17 @@ static inline void calc_prob_snps_mut(double *prgu, double *prgv, int g_pos, con
     }
 }
 
-static char *evaluate_nomutation(const region_t *g) {
+static char *evaluate_nomutation(const region_t *g, bam_hts_t *h) {
     int i, readi;
 
     /* Reference sequence */
     fasta_t *f = refseq_fetch(g->chr, fa_file);
     if (f == NULL) return NULL;
-    char *refseq = f->seq;
+    const uint8_t *refseq = (const uint8_t *)f->seq; // seqnt_map codes
     int refseq_length = f->seq_length;
 
     /* Reads in region coordinates */
-    vector_t *read_list = bam_fetch(bam_file, g->chr, g->pos1, g->pos2);
+    vector_t *read_list = bam_fetch(h, g->chr, g->pos1, g->pos2);
     if (read_list->len == 0) {
         free(read_list); read_list = NULL;
         return NULL;
@@ -277,18 +280,18 @@ static char *evaluate_nomutation(const region_t *g) {
                     if (strcmp(xa_chr, read_data[readi]->chr) != 0 && abs(xa_pos - read_data[readi]->pos) < read_data[readi]->length) { // if secondary alignment does not overlap primary aligment
                         fasta_t *f = refseq_fetch(xa_chr, fa_file);
                         if (f == NULL) continue;
-                        char *xa_refseq = f->seq;
+                        const uint8_t *xa_refseq = (const uint8_t *)f->seq;
                         int xa_refseq_length = f->seq_length;
 
                         double *p_readprobmatrix = readprobmatrix;
                         double *newreadprobmatrix = NULL;
-                        if ((xa_pos < 0 && !read_data[readi]->is_reverse) || (xa_pos > 0 && read_data[readi]->is_reverse)) { // opposite of primary alignment strand
+                        if ((xa_pos < 0 && !read_is_reverse(read_data[readi])) || (xa_pos > 0 && read_is_reverse(read_data[readi]))) { // opposite of primary alignment strand
                             newreadprobmatrix = reverse(readprobmatrix, read_data[readi]->length * NT_CODES);
                             p_readprobmatrix = newreadprobmatrix;
                         }
 
                         xa_pos = abs(xa_pos);
-                        double readprobability = calc_prob(p_readprobmatrix, read_data[readi]->length, xa_refseq, xa_refseq_length, xa_pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, seqnt_map);
+                        double readprobability = calc_prob(p_readprobmatrix, read_data[readi]->length, xa_refseq, xa_refseq_length, xa_pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice);
                         prgu = log_add_exp(prgu, readprobability);
                         prgv = log_add_exp(prgv, readprobability);
                         free(newreadprobmatrix); newreadprobmatrix = NULL;
@@ -320,7 +323,7 @@ static char *evaluate_nomutation(const region_t *g) {
 
             if (debug > 1) {
                 fprintf(stderr, "::\t%d\t%s\t%d\t%f\t%f\t%f\t%d\t%d\t", g_pos, read_data[readi]->name, read_data[readi]->pos, prgu, prgv, prgu-prgv, r_count, a_count);
-                for (i = 0; i < read_data[readi]->n_cigar; i++) fprintf(stderr, "%d%c ", read_data[readi]->cigar_oplen[i], read_data[readi]->cigar_opchr[i]);
+                fprintf(stderr, "%s ", read_data[readi]->cigar);
                 fprintf(stderr, "\n");
             }
         }
@@ -355,19 +358,22 @@ static void *pool(void *work) {
     vector_t *queue = (vector_t *)w->queue;
     vector_t *results = (vector_t *)w->results;
 
+    bam_hts_t *h = bam_hts_create(bam_file, fa_file, &tpool, bam_shared); // per thread bam handle, reused for every region
+
     while (1) { //pthread_t ptid = pthread_self(); uint64_t threadid = 0; memcpy(&threadid, &ptid, min(sizeof (threadid), sizeof (ptid)));
         pthread_mutex_lock(&w->q_lock);
         region_t *g = (region_t *)vector_pop(queue);
         pthread_mutex_unlock(&w->q_lock);
         if (g == NULL) break;
         
-        char *outstr = evaluate_nomutation(g);
+        char *outstr = evaluate_nomutation(g, h);
         if (outstr == NULL) continue;
 
         pthread_mutex_lock(&w->r_lock);
         vector_add(results, outstr);
         pthread_mutex_unlock(&w->r_lock);
     }
+    bam_hts_destroy(h); free(h); h = NULL;
     return NULL;
 }
 
@@ -378,7 +384,7 @@ static void process(const vector_t *reg_list, FILE *out_fh) {
     int nregions = reg_list->len;
 
     print_status("# Options: pao=%d isc=%d nodup=%d splice=%d bs=%d phred64=%d cq=%d\n", pao, isc, nodup, splice, bisulfite, phred64, const_qual);
-    print_status("# Start: %d threads \t%s\t%s", nthread, bam_file, asctime(time_info));
+    print_status("# Start: %d threads, %d io threads \t%s\t%s", nthread, iothread, bam_file, asctime(time_info));
 
     vector_t *queue = vector_create(nregions, VOID_T);
     vector_t *results = vector_create(nregions, VOID_T);
@@ -413,11 +419,12 @@ static void print_usage() {
     printf("\nUsage: eagle [options] -v regions.bed -a alignment.bam -r reference.fasta\n\n");
     printf("Required:\n");
     printf("  -v --bed        FILE   Genome regions, BED file. [stdin]\n");
-    printf("  -a --bam        FILE   Alignment data bam files, ref-coord sorted with bai index file.\n");
+    printf("  -a --bam        FILE   Alignment data bam or cram files, ref-coord sorted with bai or crai index file.\n");
     printf("  -r --ref        FILE   Reference sequence, fasta file with fai index file.\n");
     printf("Options:\n");
     printf("  -o --out        FILE   Output file. [stdout]\n");
     printf("  -t --nthread    INT    Number of threads. [1]\n");
+    printf("     --iothread   INT    Number of additional threads shared by all BAM handles for BGZF decompression. [0]\n");
     printf("     --pao               Primary alignments only.\n");
     printf("     --isc               Ignore soft-clipped bases.\n");
     printf("     --nodup             Ignore marked duplicate reads (based on SAM flag).\n");
@@ -436,6 +443,7 @@ int main(int argc, char **argv) {
     fa_file = NULL;
     out_file = NULL;
     nthread = 1;
+    iothread = 0;
     pao = 0;
     isc = 0;
     nodup = 0;
@@ -453,6 +461,7 @@ int main(int argc, char **argv) {
         {"ref", required_argument, NULL, 'r'},
         {"out", optional_argument, NULL, 'o'},
         {"nthread", optional_argument, NULL, 't'},
+        {"iothread", optional_argument, NULL, 994},
         {"pao", no_argument, &pao, 1},
         {"isc", no_argument, &isc, 1},
         {"nodup", no_argument, &nodup, 1},
@@ -481,6 +490,7 @@ int main(int argc, char **argv) {
             case 990: mut_prior = parse_double(optarg); break;
             case 992: bisulfite = parse_int(optarg); break;
             case 993: const_qual = parse_int(optarg); break;
+            case 994: iothread = parse_int(optarg); break;
             default: exit_usage("Bad options");
         }
     }
@@ -497,6 +507,7 @@ int main(int argc, char **argv) {
     if (bam_file == NULL) { exit_usage("Missing alignments given as BAM file!"); } 
     if (fa_file == NULL) { exit_usage("Missing reference genome given as Fasta file!"); }
     if (nthread < 1) nthread = 1;
+    if (iothread < 0) iothread = 0;
     if (mut_prior < 0 || mut_prior > 1) mut_prior = 0.001;
     nomut_prior = 1 - mut_prior;
 
@@ -511,13 +522,20 @@ int main(int argc, char **argv) {
     mut_prior = log(mut_prior);
     nomut_prior = log(nomut_prior);
     init_q2p_table(p_match, p_mismatch, 50);
-    
+    if (iothread > 0) { // shared pool for bgzf decompression and compression by every open handle
+        tpool.pool = hts_tpool_init(iothread);
+        if (tpool.pool == NULL) { exit_err("failed to create htslib thread pool with %d threads\n", iothread); }
+    }
+    bam_shared = bam_hts_create(bam_file, fa_file, &tpool, NULL);
+
     /* Start processing data */
     clock_t tic = clock();
     vector_t *reg_list = bed_read(bed_fh);
     print_status("# Read BED: %s\t%i entries\t%s", bed_file, (int)reg_list->len, asctime(time_info));
 
     refseq_hash = kh_init(rsh);
+    refmap = refmap_open(fa_file);
+    if (refmap != NULL) { print_status("# Reference map: %s%s\t%s", fa_file, REFMAP_SUFFIX, asctime(time_info)); }
 
     pthread_mutex_init(&refseq_lock, NULL);
     process(reg_list, out_fh);
@@ -525,13 +543,21 @@ int main(int argc, char **argv) {
     else fflush(stdout);
     pthread_mutex_destroy(&refseq_lock);
 
+    size_t i;
     khiter_t k;
     for (k = kh_begin(refseq_hash); k != kh_end(refseq_hash); k++) {
-        if (kh_exist(refseq_hash, k)) vector_destroy(&kh_val(refseq_hash, k));
+        if (!kh_exist(refseq_hash, k)) continue;
+        vector_t *node = &kh_val(refseq_hash, k);
+        for (i = 0; i < node->len && refmap != NULL; i++) ((fasta_t *)node->data[i])->seq = NULL; // in the map
+        vector_destroy(node);
     }
     kh_destroy(rsh, refseq_hash);
+    if (refmap != NULL) { refmap_close(refmap); free(refmap); refmap = NULL; }
     vector_destroy(reg_list); free(reg_list); reg_list = NULL;
 
+    bam_hts_destroy(bam_shared); free(bam_shared); bam_shared = NULL;
+    if (tpool.pool != NULL) { hts_tpool_destroy(tpool.pool); tpool.pool = NULL; }
+
     clock_t toc = clock();
     print_status("# CPU time (hr):\t%f\n", (double)(toc - tic) / CLOCKS_PER_SEC / 3600);
 
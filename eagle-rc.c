@@ -9,6 +9,7 @@ Run EAGLE with --rc which sets: --omega=1e-40 --mvh --verbose --isc
 Other program options are situational
 
 ex) eagle -t 2 -v var.vcf -a align.bam -r ref.fa --rc 1> out.txt 2> readinfo.txt
+ or eagle -t 2 -v var.vcf -a align.bam -r ref.fa --rc --readinfo=readinfo.bin.gz > out.txt
 
 Copyright 2016 Tony Kuo
 This program is distributed under the terms of the GNU General Public License
@@ -24,9 +25,13 @@ This program is distributed under the terms of the GNU General Public License
 #include "htslib/sam.h"
 #include "htslib/faidx.h"
 #include "htslib/khash.h"
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 #include "util.h"
 #include "calc.h"
 #include "vector.h"
+#include "classify.h"
+#include "refmap.h"
 
 /* Constants */
 #define VERSION "1.1.1"
@@ -39,6 +44,7 @@ static int listonly;
 static int readlist;
 static int reclassify;
 static int refonly;
+static int tagged;
 static int paired, already_paired;
 static int pao;
 static int isc;
@@ -48,6 +54,8 @@ static int ngi;
 static int phred64;
 static int bisulfite;
 static int const_qual;
+static int iothread;
+static htsThreadPool tpool = {NULL, 0};
 static double omega, lgomega;
 
 /* Time info */
@@ -66,6 +74,17 @@ static khash_t(vh) *var_hash;  // pointer to hashmap, variant
 
 KHASH_MAP_INIT_STR(rsh, fasta_t *)   // hashmap: string key, fasta_t * value
 static khash_t(rsh) *refseq_hash; // pointer to hashmap
+static refmap_t *refmap; // reference mapped from eagle-ref, NULL when read from the fasta
+
+KHASH_SET_INIT_STR(ch) // hashset: string key
+static khash_t(ch) *chr_hash; // pointer to hashset, interned chromosome names shared by all reads
+
+static char *chr_intern(const char *chr) {
+    int absent;
+    khiter_t k = kh_put(ch, chr_hash, chr, &absent);
+    if (absent) kh_key(chr_hash, k) = strdup(chr);
+    return (char *)kh_key(chr_hash, k);
+}
 
 static void add2var_list(vector_t *var_list, char *set) {
     char var[strlen(set)];
@@ -73,13 +92,7 @@ static void add2var_list(vector_t *var_list, char *set) {
     int n;
     char *s;
     for (s = set + 1; sscanf(s, "%[^;];%n", var, &n) == 1; s += n) { // scan variant set
-        char *v = strdup(var);
-        size_t i;
-        for (i = 0; i < var_list->len; i++) {
-            if (strcmp(v, (char *)var_list->data[i]) == 0) break;
-        }
-        if (i == var_list->len) { vector_add(var_list, v); }
-        else { free(v); v = NULL; } // if already exists then skip
+        classify_var_add(var_list, var);
         if (*(s + n) == ']') break;
     }
 }
@@ -119,7 +132,111 @@ static int var_read(const char* filename) {
     return nvars;
 }
 
+static int readinfo_add(const char *name, int is_read2, const char *chr, int pos, double prgu, double prgv, double pout, const char *flag, char *var) {
+    /* Likelihoods of a read, summed with those from other sets the read was seen in */
+    if (prgu == prgv) return 0; // if ref and alt probabilities are equal, it didn't "align" and was in a splice zone
+
+    char key[strlen(name) + 3];
+    snprintf(key, strlen(name) + 3, "%s\t%d", name, is_read2);
+
+    int absent;
+    khiter_t k = kh_put(rh, read_hash, key, &absent);
+    if (absent) {
+        read_t *r = read_create((char *)name, 0, chr_intern(chr), pos);
+        r->prgu = (float)prgu;
+        r->prgv = (float)prgv;
+        r->pout = (float)pout;
+        r->flag = strdup(flag);
+        r->var_list = vector_create(1, VOID_T);
+        add2var_list(r->var_list, var);
+        kh_key(read_hash, k) = strdup(key);
+        kh_val(read_hash, k) = r;
+        return 1;
+    }
+    read_t *r = kh_val(read_hash, k);
+    r->prgu = (float)log_add_exp((double)r->prgu, prgu);
+    r->prgv = (float)log_add_exp((double)r->prgv, prgv);
+    add2var_list(r->var_list, var);
+    return 0;
+}
+
+static int readinfo_read_binary(BGZF *fp, const char *filename) {
+    /* Length prefixed records of eagle --readinfo: C contig id and name, S set table id and variants, R read */
+    int nreads = 0;
+    char **contig = NULL, **set = NULL;
+    size_t ncontig = 0, nset = 0;
+    size_t m = 256;
+    char *buf = malloc(m);
+
+    uint32_t n;
+    ssize_t r;
+    while ((r = bgzf_read(fp, &n, sizeof (n))) == sizeof (n)) {
+        if (n < 1) { exit_err("bad record in EAGLE read info file %s\n", filename); }
+        if (n + 1 > m) {
+            m = n + 1;
+            buf = realloc(buf, m);
+        }
+        if (bgzf_read(fp, buf, n) != n) { exit_err("truncated EAGLE read info file %s\n", filename); }
+        buf[n] = '\0';
+
+        char type = buf[0];
+        const char *data = buf + 1;
+        if (type == 'C' || type == 'S') {
+            uint32_t id;
+            if (n < 1 + sizeof (id)) { exit_err("bad record in EAGLE read info file %s\n", filename); }
+            memcpy(&id, data, sizeof (id));
+            const char *str = data + sizeof (id);
+            char ***table = (type == 'C') ? &contig : &set;
+            size_t *len = (type == 'C') ? &ncontig : &nset;
+            if (id >= *len) {
+                size_t l = (id + 1 > *len * 2) ? id + 1 : *len * 2;
+                *table = realloc(*table, l * sizeof (char *));
+                memset(*table + *len, 0, (l - *len) * sizeof (char *));
+                *len = l;
+            }
+            if (type == 'C') contig[id] = chr_intern(str);
+            else { free(set[id]); set[id] = strdup(str); }
+        }
+        else if (type == 'R') {
+            struct __attribute__((packed)) {
+                int32_t tid, pos;
+                float prgu, prgv, pout;
+                uint16_t sam_flag;
+                uint32_t set;
+            } rec;
+            if (n < 1 + sizeof (rec)) { exit_err("bad record in EAGLE read info file %s\n", filename); }
+            memcpy(&rec, data, sizeof (rec));
+            const char *name = data + sizeof (rec);
+            if (rec.tid < 0 || (size_t)rec.tid >= ncontig || contig[rec.tid] == NULL || rec.set >= nset || set[rec.set] == NULL) { exit_err("undefined contig or set for read %s in EAGLE read info file %s\n", name, filename); }
+            char *flag = bam_flag2str(rec.sam_flag);
+            nreads += readinfo_add(name, (rec.sam_flag & BAM_FREAD2) != 0, contig[rec.tid], rec.pos, rec.prgu, rec.prgv, rec.pout, flag, set[rec.set]);
+            free(flag); flag = NULL;
+        }
+        // other record types are skipped, for later additions
+    }
+    if (r != 0) { exit_err("truncated EAGLE read info file %s\n", filename); }
+
+    size_t i;
+    for (i = 0; i < nset; i++) free(set[i]);
+    free(set); set = NULL;
+    free(contig); contig = NULL; // names interned
+    free(buf); buf = NULL;
+    return nreads;
+}
+
 static int readinfo_read(const char* filename) {
+    /* Binary stream of eagle --readinfo, plain or bgzf compressed, else the text of --verbose */
+    BGZF *fp = bgzf_open(filename, "r");
+    if (fp == NULL) { exit_err("failed to open file %s\n", filename); }
+    if (tpool.pool != NULL) bgzf_thread_pool(fp, tpool.pool, 0);
+    char magic[8];
+    if (bgzf_read(fp, magic, sizeof (magic)) == sizeof (magic) && memcmp(magic, READINFO_MAGIC, sizeof (magic)) == 0) {
+        int nreads = readinfo_read_binary(fp, filename);
+        bgzf_close(fp);
+        return nreads;
+    }
+    bgzf_close(fp);
+
     FILE *file = fopen(filename, "r");
     if (file == NULL) { exit_err("failed to open file %s\n", filename); }
 
@@ -141,8 +258,6 @@ static int readinfo_read(const char* filename) {
             flag[0] = '\0';
         }
 
-        if (prgu == prgv) continue; // if ref and alt probabilities are equal, it didn't "align" and was in a splice zone
-
         int is_read2 = 0;
         int n;
         char *s, token[strlen(flag) + 1];
@@ -150,110 +265,32 @@ static int readinfo_read(const char* filename) {
             if (strcmp("READ2", token) == 0) is_read2 = 1;
             if (*(s + n) != ',') break;
         }
-
-        char key[strlen(name) + 3];
-        snprintf(key, strlen(name) + 3, "%s\t%d", name, is_read2);
-
-        int absent;
-        khiter_t k = kh_put(rh, read_hash, key, &absent);
-        if (absent) {
-            read_t *r = read_create(name, 0, chr, pos);
-            r->prgu = (float)prgu;
-            r->prgv = (float)prgv;
-            r->pout = (float)pout;
-            r->flag = strdup(flag);
-            r->qseq = strdup(key);
-            add2var_list(r->var_list, var);
-            kh_key(read_hash, k) = r->qseq;
-            kh_val(read_hash, k) = r;
-            nreads++;
-        }
-        else {
-            read_t *r = kh_val(read_hash, k);
-            r->prgu = (float)log_add_exp((double)r->prgu, prgu);
-            r->prgv = (float)log_add_exp((double)r->prgv, prgv);
-            add2var_list(r->var_list, var);
-        }
+        nreads += readinfo_add(name, is_read2, chr, pos, prgu, prgv, pout, flag, var);
     }
     free(line); line = NULL;
     fclose(file);
     return nreads;
 }
 
-static void readinfo_classify() {
-    /* read->index set to classification:
-    reference = 0
-    alternative = 1
-    reference-like-allele, multi-allelic, closer to the reference = 2;
-    multi-allelic that are undifferentiateable = 3
-    unknown, ambiguous with equal likelihoods for reference and alternative = 4
-    */
+static int var_in_output(const char *var, void *data) {
+    return kh_get(vh, var_hash, var) != kh_end(var_hash);
+}
 
-    size_t i;
+static void readinfo_classify() {
+    /* read->index set to classification, see classify.h */
     khiter_t k;
     for (k = kh_begin(read_hash); k != kh_end(read_hash); k++) {
 		if (kh_exist(read_hash, k)) {
             read_t *r = kh_val(read_hash, k);
-            char **v = (char **)r->var_list->data;
-            size_t nvariants = r->var_list->len;
-
-            int multiallele;
-            if (nvariants > 1) { // check if only multi-allelic variants at the same position & no hope of differentiating ref vs alt
-                multiallele = 1;
-                int prev_pos = -1;
-                for (i = 0; i < nvariants; i++) {
-                    int pos;
-                    int t = sscanf(v[i], "%*[^,],%d,%*[^,],%*[^,],", &pos);
-                    if (t < 1) { exit_err("bad fields in %s\n", v[i]); }
-                    if (prev_pos != -1 && pos - prev_pos != 0) {
-                        multiallele = 0;
-                        break;
-                    }
-                    prev_pos = pos;
-                }
-                if (multiallele) {
-                    r->index = 3;
-                    fprintf(stdout, "%s\tMUL\t%s\t%d\t%f\t%f\t%f\t%s\t", r->name, r->chr, r->pos, r->prgu, r->prgv, r->pout, r->flag);
-                    for (i = 0; i < nvariants; i++) { fprintf(stdout, "%s;", v[i]); } fprintf(stdout, "\n");
-                    continue;
-                }
-            }
-
-            // if any variant in list is not in EAGLE output, it suggests variants are from a different phase if alt wins
-            multiallele = 0;
-            for (i = 0; i < nvariants; i++) {
-                khiter_t k = kh_get(vh, var_hash, v[i]);
-                if (k != kh_end(var_hash)) multiallele = 1;
-            }
-
-            fprintf(stdout, "%s\t", r->name);
-            if (r->prgu > r->prgv && r->prgu - r->prgv >= 0.69) { // ref wins
-                r->index = 0;
-                fprintf(stdout, "REF\t");
-            }
-            else if (r->prgv > r->prgu && r->prgv - r->prgu >= 0.69) { // alt wins
-                if (multiallele) { // EAGLE outputs the set with highest likelihood ratio, i.e. most different from reference, leaving the "reference-like-allele"
-                    r->index = 2;
-                    fprintf(stdout, "RLA\t");
-                }
-                else {
-                    r->index = 1;
-                    fprintf(stdout, "ALT\t");
-                }
-            }
-            else { // unknown
-                r->index = 4;
-                fprintf(stdout, "UNK\t");
-            }
-            fprintf(stdout, "%s\t%d\t%f\t%f\t%f\t%s\t", r->chr, r->pos, r->prgu, r->prgv, r->pout, r->flag);
-            for (i = 0; i < nvariants; i++) { fprintf(stdout, "%s;", v[i]); } fprintf(stdout, "\n");
+            classify_read(r, var_in_output, NULL);
+            classify_print(stdout, r);
         }
     }
     fflush(stdout);
     print_status("# Reads Classified:\t%s", asctime(time_info));
 }
 
-static void bam_write(const char *bam_file, const char *output_prefix, char *other_bam, int reverse) {
+static void bam_write(const char *bam_file, const char *fa_file, const char *output_prefix, char *other_bam, int reverse) {
     khiter_t k;
     other_read_hash = kh_init(orh);
     if (other_bam != NULL) {
@@ -262,28 +299,20 @@ static void bam_write(const char *bam_file, const char *output_prefix, char *oth
         for (f = other_bam; sscanf(f, "%[^,]%n", fn, &n) == 1; f += n + 1) {
             samFile *sam_in = sam_open(fn, "r"); // open bam file
             if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", fn); }
+            if (tpool.pool != NULL) hts_set_thread_pool(sam_in, &tpool); // shared bgzf threads
+            if (fa_file != NULL && sam_in->format.format == cram && hts_set_fai_filename(sam_in, fa_file) != 0) { exit_err("failed to set CRAM reference %s\n", fa_file); }
             bam_hdr_t *bam_header = sam_hdr_read(sam_in); // bam header
             if (bam_header == 0) { exit_err("bad header %s\n", fn); }
 
             bam1_t *aln = bam_init1(); // initialize an alignment
             while (sam_read1(sam_in, bam_header, aln) >= 0) {
                 if (aln->core.tid < 0) continue; // not mapped
-                int is_secondary = 0;
-                char *flag = bam_flag2str(aln->core.flag);
-
-                int n2;
-                char *s, token[strlen(flag) + 1];
-                for (s = flag; sscanf(s, "%[^,]%n", token, &n2) == 1; s += n2 + 1) {
-                    if (strcmp("SECONDARY", token) == 0 || strcmp("SUPPLEMENTARY", token) == 0) is_secondary = 1;
-                    if (*(s + n2) != ',') break;
-                }
-                free(flag); flag = NULL;
-                if (pao && is_secondary) continue;
+                if (pao && (aln->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) continue;
 
                 int absent;
                 k = kh_put(orh, other_read_hash, (char *)aln->data, &absent);
                 if (absent) {
-                    read_t *r = read_create((char *)aln->data, aln->core.tid, bam_header->target_name[aln->core.tid], aln->core.pos);
+                    read_t *r = read_create((char *)aln->data, aln->core.tid, chr_intern(bam_header->target_name[aln->core.tid]), aln->core.pos);
                     kh_key(other_read_hash, k) = r->name;
                     kh_val(other_read_hash, k) = r;
                 }
@@ -298,53 +327,26 @@ static void bam_write(const char *bam_file, const char *output_prefix, char *oth
 
     samFile *sam_in = sam_open(bam_file, "r"); // open bam file
     if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_file); }
+    if (tpool.pool != NULL) hts_set_thread_pool(sam_in, &tpool); // shared bgzf threads
+    if (fa_file != NULL && sam_in->format.format == cram && hts_set_fai_filename(sam_in, fa_file) != 0) { exit_err("failed to set CRAM reference %s\n", fa_file); }
     bam_hdr_t *bam_header = sam_hdr_read(sam_in); // bam header
     if (bam_header == 0) { exit_err("bad header %s\n", bam_file); }
     print_status("# Open input bam:\t%s\t%s", bam_file, asctime(time_info));
 
-    /* Split input bam files into respective categories' output bam files */
+    /* Split input bam files into respective categories' output bam files, or tag the reads in a single one */
     samFile *out;
-    char out_fn[256];
-
-    snprintf(out_fn, 256, "%s.ref.bam", output_prefix);
-    samFile *ref_out = sam_open(out_fn, "wb"); // write bam
-    if (ref_out == NULL) { exit_err("failed to open BAM file %s\n", out_fn); }
-    if (sam_hdr_write(ref_out, bam_header) != 0) { exit_err("bad header write %s\n", out_fn); } // write bam header
-
-    snprintf(out_fn, 256, "%s.alt.bam", output_prefix);
-    samFile *alt_out = sam_open(out_fn, "wb"); // write bam
-    if (alt_out == NULL) { exit_err("failed to open BAM file %s\n", out_fn); }
-    if (sam_hdr_write(alt_out, bam_header) != 0) { exit_err("bad header write %s\n", out_fn); } // write bam header
-
-    snprintf(out_fn, 256, "%s.mul.bam", output_prefix);
-    samFile *mul_out = sam_open(out_fn, "wb"); // write bam
-    if (mul_out == NULL) { exit_err("failed to open BAM file %s\n", out_fn); }
-    if (sam_hdr_write(mul_out, bam_header) != 0) { exit_err("bad header write %s\n", out_fn); } // write bam header
-
-    snprintf(out_fn, 256, "%s.unk.bam", output_prefix);
-    samFile *unk_out = sam_open(out_fn, "wb"); // write bam
-    if (unk_out == NULL) { exit_err("failed to open BAM file %s\n", out_fn); }
-    if (sam_hdr_write(unk_out, bam_header) != 0) { exit_err("bad header write %s\n", out_fn); } // write bam header
+    samFile *class_out[NCLASS_BAM] = {NULL};
+    samFile *tag_out = NULL;
+    if (tagged) tag_out = classify_tagged_open(output_prefix, bam_header, &tpool);
+    else classify_bam_open(class_out, output_prefix, bam_header, &tpool);
 
     bam1_t *aln = bam_init1(); // initialize an alignment
     while (sam_read1(sam_in, bam_header, aln) >= 0) {
         if (aln->core.tid < 0) continue; // not mapped
 
-        int is_secondary = 0;
-        int is_read2 = 0;
-        char *flag = bam_flag2str(aln->core.flag);
+        if (pao && (aln->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) continue;
+        int is_read2 = (aln->core.flag & BAM_FREAD2) != 0;
 
-        int n;
-        char *s, token[strlen(flag) + 1];
-        for (s = flag; sscanf(s, "%[^,]%n", token, &n) == 1; s += n + 1) {
-            if (strcmp("READ2", token) == 0) is_read2 = 1;
-            else if (strcmp("SECONDARY", token) == 0 || strcmp("SUPPLEMENTARY", token) == 0) is_secondary = 1;
-            if (*(s + n) != ',') break;
-        }
-        if (pao && is_secondary) {
-            free(flag); flag = NULL;
-            continue;
-        }
         /* Write reads to appropriate file */
         out = NULL;
         char *name = (char *)aln->data;
@@ -355,28 +357,25 @@ static void bam_write(const char *bam_file, const char *output_prefix, char *oth
 
         if (other_bam != NULL) {
             k = kh_get(orh, other_read_hash, name);
-            if (k == kh_end(other_read_hash)) out = ref_out; // unique vs other bams
+            if (k == kh_end(other_read_hash)) out = class_out[0]; // unique vs other bams
+        }
+        else if (tagged) {
+            out = tag_out;
+            k = kh_get(rh, read_hash, key);
+            if (k != kh_end(read_hash)) classify_tag(aln, kh_val(read_hash, k), reverse, refonly);
         }
         else {
             k = kh_get(rh, read_hash, key);
             if (k != kh_end(read_hash)) {
                 read_t *r = kh_val(read_hash, k);
-                if (r->index == 0 && !reverse) out = ref_out;
-                else if (r->index == 1 && reverse) out = ref_out; // reverse, ALT writes to ref.bam
-                else if (!refonly && r->index == 1 && !reverse) out = alt_out;
-                else if (!refonly && r->index == 0 && reverse) out = alt_out; // reverse, REF writes to alt.bam
-                else if (!refonly && r->index == 2) out = ref_out;
-                else if (!refonly && r->index == 3) out = mul_out;
-                else if (r->index == 4) out = unk_out;
+                out = classify_bam_select(class_out, r->index, reverse, refonly);
                 if (debug >= 1) {
                     fprintf(stderr, "%f\t%f\t%f\t%d\t", r->prgu, r->prgv, r->pout, r->index);
                     fprintf(stderr, "%s\t%s\t%d\t", r->name, r->chr, r->pos);
-                    fprintf(stderr, "%s\t%s\t%p\n", r->flag, r->qseq, out);
+                    fprintf(stderr, "%s\t%s\t%p\n", r->flag, kh_key(read_hash, k), out);
                 }
             }
         }
-        free(flag); flag = NULL;
-
         if (out != NULL) {
             int r = sam_write1(out, bam_header, aln);
             if (r < 0) { exit_err("Bad program call"); }
@@ -396,10 +395,8 @@ static void bam_write(const char *bam_file, const char *output_prefix, char *oth
     sam_close(sam_in);
 
     out = NULL;
-    sam_close(ref_out);
-    sam_close(alt_out);
-    sam_close(mul_out);
-    sam_close(unk_out);
+    if (tag_out != NULL && sam_close(tag_out) != 0) { exit_err("failed to close tagged BAM file\n"); }
+    classify_bam_close(class_out);
     print_status("# BAM Processed:\t%s\t%s", bam_file, asctime(time_info));
 }
 
@@ -447,22 +444,20 @@ static int readlist_read(FILE *file) {
         int absent;
         khiter_t k = kh_put(rh, read_hash, key, &absent);
         if (absent) {
-            read_t *r = read_create(name, 0, chr, pos);
+            read_t *r = read_create(name, 0, chr_intern(chr), pos);
             r->prgu = (float)prgu;
             r->prgv = (float)prgv;
             r->pout = (float)pout;
             r->flag = strdup(flag);
-            r->qseq = strdup(key);
             r->index = type2ind(type);
-            kh_key(read_hash, k) = r->qseq;
+            kh_key(read_hash, k) = strdup(key);
             kh_val(read_hash, k) = r;
             nreads++;
         }
         else {
             read_t *r = kh_val(read_hash, k);
             if (log_add_exp(prgu, prgv) > log_add_exp((double)r->prgu, (double)r->prgv)) {
-                free(r->chr); r->chr = NULL;
-                r->chr = strdup(chr);
+                r->chr = chr_intern(chr);
                 r->pos = pos;
                 free(r->flag); r->flag = NULL;
                 r->flag = strdup(flag);
@@ -479,6 +474,19 @@ static int readlist_read(FILE *file) {
 }
 
 static void fasta_read(const char *fa_file) {
+    refmap = refmap_open(fa_file);
+    if (refmap != NULL) { /* Contigs point into the map, nothing to read or code */
+        int i, absent;
+        for (i = 0; i < (int)refmap->header->n_contigs; i++) {
+            fasta_t *f = refmap_fasta(refmap, i);
+            khiter_t k = kh_put(rsh, refseq_hash, f->name, &absent);
+            if (absent) { kh_val(refseq_hash, k) = f; }
+            else { exit_err("# refseq_hash collision: %s", asctime(time_info)); }
+        }
+        print_status("# Mapped reference genome: %s%s\t%s", fa_file, REFMAP_SUFFIX, asctime(time_info));
+        return;
+    }
+
     faidx_t *fai = fai_load(fa_file);
     if (fai == NULL) {
         errno = fai_build(fa_file);
@@ -511,6 +519,8 @@ static void fasta_read(const char *fa_file) {
         f->seq = faidx_fetch_seq(fai, f->name, 0, faidx_seq_len(fai, f->name) - 1, &f->seq_length);
         char *s;
         for (s = f->seq; *s != '\0'; s++) *s = toupper(*s);
+        int i = encode_seqnt((uint8_t *)f->seq, f->seq, f->seq_length, seqnt_map); // seqnt_map codes from here on
+        if (i >= 0) { exit_err("Character %c at %s:%d not in valid alphabet\n", f->seq[i], name, i + 1); }
 
         //u_int32_t hash = fnv_32a_str(name);
         //fprintf(stdout, "%s\t%u\n", name, hash);
@@ -527,6 +537,18 @@ static void fasta_read(const char *fa_file) {
     print_status("# Read reference genome: %s\t%s", fa_file, asctime(time_info));
 }
 
+static void refseq_destroy(void) {
+    khiter_t k;
+    for (k = kh_begin(refseq_hash); k != kh_end(refseq_hash); k++) {
+        if (kh_exist(refseq_hash, k)) {
+            if (refmap != NULL) kh_val(refseq_hash, k)->seq = NULL; // in the map
+            fasta_destroy(kh_val(refseq_hash, k)); free(kh_val(refseq_hash, k)); kh_val(refseq_hash, k) = NULL;
+        }
+    }
+    kh_destroy(rsh, refseq_hash);
+    if (refmap != NULL) { refmap_close(refmap); free(refmap); refmap = NULL; }
+}
+
 static fasta_t *refseq_fetch(char *name) {
 	khiter_t k = kh_get(rsh, refseq_hash, name);
     if (k != kh_end(refseq_hash)) {
@@ -535,9 +557,11 @@ static fasta_t *refseq_fetch(char *name) {
     return NULL;
 }
 
-static void bam_read(const char *bam_file, int ind) {
+static void bam_read(const char *bam_file, const char *fa_file, int ind) {
     samFile *sam_in = sam_open(bam_file, "r"); // open bam file
     if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_file); }
+    if (tpool.pool != NULL) hts_set_thread_pool(sam_in, &tpool); // shared bgzf threads
+    if (fa_file != NULL && sam_in->format.format == cram && hts_set_fai_filename(sam_in, fa_file) != 0) { exit_err("failed to set CRAM reference %s\n", fa_file); }
     bam_hdr_t *bam_header = sam_hdr_read(sam_in); // bam header
     if (bam_header == 0) { exit_err("bad header %s\n", bam_file); }
 
@@ -545,7 +569,7 @@ static void bam_read(const char *bam_file, int ind) {
     bam1_t *aln = bam_init1(); // initialize an alignment
     while (sam_read1(sam_in, bam_header, aln) >= 0) {
         int i;
-        read_t *read = read_fetch(bam_header, aln, pao, isc, nodup, splice, phred64, const_qual);
+        read_t *read = read_fetch(bam_header, aln, pao, isc, nodup, splice, phred64, const_qual, 1); // name and flag needed for the read list
         if (read == NULL) continue;
 
         fasta_t *f = refseq_fetch(read->chr);
@@ -554,7 +578,7 @@ static void bam_read(const char *bam_file, int ind) {
             read_destroy(read); free(read); read = NULL;
             continue;
         }
-        char *refseq = f->seq;
+        const uint8_t *refseq = (const uint8_t *)f->seq; // seqnt_map codes
         int refseq_length = f->seq_length;
 
         double is_match[read->length], no_match[read->length];
@@ -574,8 +598,8 @@ static void bam_read(const char *bam_file, int ind) {
         double prgv = -DBL_MAX;
         double pout = elsewhere;
 
-        if (ind == 0) prgu = calc_prob(readprobmatrix, read->length, refseq, refseq_length, read->pos, read->splice_pos, read->splice_offset, read->n_splice, seqnt_map);
-        else if (ind == 1) prgv = calc_prob(readprobmatrix, read->length, refseq, refseq_length, read->pos, read->splice_pos, read->splice_offset, read->n_splice, seqnt_map);
+        if (ind == 0) prgu = calc_prob(readprobmatrix, read->length, refseq, refseq_length, read->pos, read->splice_pos, read->splice_offset, read->n_splice);
+        else if (ind == 1) prgv = calc_prob(readprobmatrix, read->length, refseq, refseq_length, read->pos, read->splice_pos, read->splice_offset, read->n_splice);
 
         // Assuming all secondary alignments, corresponding to multi-map tags, are outputted to the bam file and will be processed eventually
         pout += lgomega;
@@ -583,12 +607,12 @@ static void bam_read(const char *bam_file, int ind) {
         prgv = log_add_exp(pout, prgv);
 
         char key[strlen(read->name) + 3];
-        snprintf(key, strlen(read->name) + 3, "%s\t%d", read->name, read->is_read2);
+        snprintf(key, strlen(read->name) + 3, "%s\t%d", read->name, read_is_read2(read));
 
         if (debug >= 2) {
             fprintf(stderr, "%f\t%f\t%f\t", prgu, prgv, pout);
             fprintf(stderr, "%s\t%s\t%d\t%d\t", read->name, read->chr, read->pos, read->end);
-            for (i = 0; i < read->n_cigar; i++) fprintf(stderr, "%d%c ", read->cigar_oplen[i], read->cigar_opchr[i]);
+            fprintf(stderr, "%s ", read->cigar);
             fprintf(stderr, "\t");
             if (read->multimapXA != NULL) fprintf(stderr, "%s\t", read->multimapXA);
             else fprintf(stderr, "%d\t", read->multimapNH);
@@ -599,21 +623,19 @@ static void bam_read(const char *bam_file, int ind) {
         int absent;
         khiter_t k = kh_put(rh, read_hash, key, &absent);
         if (absent) {
-            read_t *r = read_create(read->name, read->tid, read->chr, read->pos);
+            read_t *r = read_create(read->name, read->tid, chr_intern(read->chr), read->pos);
             r->prgu = (float)prgu;
             r->prgv = (float)prgv;
             r->pout = (float)pout;
             r->flag = strdup(read->flag);
-            r->qseq = strdup(key);
-            kh_key(read_hash, k) = r->qseq;
+            kh_key(read_hash, k) = strdup(key);
             kh_val(read_hash, k) = r;
         }
         else {
             read_t *r = kh_val(read_hash, k);
             if (log_add_exp(prgu, prgv) > log_add_exp((double)r->prgu, (double)r->prgv)) {
                 r->tid = read->tid;
-                free(r->chr); r->chr = NULL;
-                r->chr = strdup(read->chr);
+                r->chr = chr_intern(read->chr);
                 r->pos = read->pos;
                 free(r->flag); r->flag = NULL;
                 r->flag = strdup(read->flag);
@@ -649,16 +671,14 @@ static void combine_pe() {
                 r2->prgv = r->prgv;
                 r2->pout = r->pout;
                 r2->flag = strdup(r->flag);
-                r2->qseq = strdup(key);
-                kh_key(other_read_hash, k2) = r2->qseq;
+                kh_key(other_read_hash, k2) = strdup(key);
                 kh_val(other_read_hash, k2) = r2;
             }
             else {
                 read_t *r2 = kh_val(other_read_hash, k2);
                 if (log_add_exp((double)r->prgu, (double)r->prgv) > log_add_exp((double)r2->prgu, (double)r2->prgv)) {
                     r2->tid = r->tid;
-                    free(r2->chr); r2->chr = NULL;
-                    r2->chr = strdup(r->chr);
+                    r2->chr = r->chr; // interned
                     r2->pos = r->pos;
                 }
                 r2->prgu += r->prgu;
@@ -670,6 +690,7 @@ static void combine_pe() {
                 r2->flag = strdup(flag);
             }
             read_destroy(r); free(r); r = NULL;
+            free((char *)kh_key(read_hash, k)); kh_key(read_hash, k) = NULL;
         }
     }
     kh_destroy(rh, read_hash);
@@ -692,14 +713,17 @@ static void print_usage() {
     printf("Options:\n");
     printf("  -v --var       FILE             EAGLE output text with variant likelihood ratios.\n");
     printf("  -a --bam       FILE             Alignment data BAM file whose reads are to be classified.\n");
+    printf("  -r --ref       FILE             Reference sequence fasta file, only needed to decode CRAM input.\n");
     printf("  -o --out       String           Prefix for output BAM files.\n");
     printf("  -u --unique    FILE1,FILE2,...  Optionally, also output reads that are unique against other BAM files (comma separated list).\n");
     printf("     --listonly                   Print classified read list only (stdout) without processing BAM file.\n");
     printf("     --readlist                   Read from classified read list file instead of EAGLE outputs and proccess BAM file.\n");
     printf("     --reclassify                 Reclassify after reading in classified read list file.\n");
     printf("     --refonly                    Write REF classified reads only when processing BAM file.\n");
+    printf("     --tagged                     Write a single BAM file, out.tagged.bam, with the class (ec) and likelihoods (eu, ev, eo) tagged on the classified reads, instead of one BAM file per class.\n");
     printf("     --paired                     Consider paired-end reads together.\n");
     printf("     --pao                        Primary alignments only.\n");
+    printf("     --iothread  INT              Number of threads shared by all BAM handles for BGZF decompression and compression. [0]\n");
     printf("     --version                    Display version.\n");
     printf("\nNo genotype info mode: eagle-rc [options] --ngi --ref1=ref1.fa --ref2=ref2.fa --bam1=align1.bam --bam2=align2.bam -o out > classified_reads.list\n");
     printf("Options (the above default mode options are also applicable):\n");
@@ -723,12 +747,14 @@ int main(int argc, char **argv) {
     char *readinfo_file = NULL;
     char *var_file = NULL;
     char *bam_file = NULL;
+    char *fa_file = NULL;
     char *output_prefix = NULL;
     char *other_bam = NULL;
     listonly = 0;
     readlist = 0;
     reclassify = 0;
     refonly = 0;
+    tagged = 0;
     paired = 0;
     already_paired = 0;
     pao = 0;
@@ -739,6 +765,7 @@ int main(int argc, char **argv) {
     bisulfite = 0;
     const_qual = 0;
     reclassify = 0;
+    iothread = 0;
 
     ngi = 0;
     omega = 1.0e-40;
@@ -751,13 +778,16 @@ int main(int argc, char **argv) {
         {"debug", optional_argument, NULL, 'd'},
         {"var", optional_argument, NULL, 'v'},
         {"bam", optional_argument, NULL, 'a'},
+        {"ref", optional_argument, NULL, 'r'},
         {"out", optional_argument, NULL, 'o'},
         {"unique", optional_argument, NULL, 'u'},
         {"listonly", no_argument, &listonly, 1},
         {"readlist", no_argument, &readlist, 1},
         {"reclassify", no_argument, &reclassify, 1},
         {"refonly", no_argument, &refonly, 1},
+        {"tagged", no_argument, &tagged, 1},
         {"paired", no_argument, &paired, 1},
+        {"iothread", optional_argument, NULL, 994},
         {"pao", no_argument, &pao, 1},
         {"ngi", no_argument, &ngi, 1},
         {"isc", no_argument, &isc, 1},
@@ -776,7 +806,7 @@ int main(int argc, char **argv) {
     };
 
     int opt = 0;
-    while ((opt = getopt_long(argc, argv, "d:v:a:o:u:", long_options, &opt)) != -1) {
+    while ((opt = getopt_long(argc, argv, "d:v:a:r:o:u:", long_options, &opt)) != -1) {
         switch (opt) {
             case 0: 
                 //if (long_options[option_index].flag != 0) break;
@@ -784,6 +814,7 @@ int main(int argc, char **argv) {
             case 'd': debug = parse_int(optarg); break;
             case 'v': var_file = optarg; break;
             case 'a': bam_file = optarg; break;
+            case 'r': fa_file = optarg; break;
             case 'o': output_prefix = optarg; break;
             case 'u': other_bam = optarg; break;
             case 981: ref_file1 = optarg; break;
@@ -793,6 +824,7 @@ int main(int argc, char **argv) {
             case 991: omega = parse_double(optarg); break;
             case 992: bisulfite = parse_int(optarg); break;
             case 993: const_qual = parse_int(optarg); break;
+            case 994: iothread = parse_int(optarg); break;
             case 999: printf("EAGLE-RC %s\n", VERSION); exit(0);
             default: exit_usage("Bad options");
         }
@@ -802,15 +834,23 @@ int main(int argc, char **argv) {
     if (!listonly && !ngi && bam_file == NULL) { exit_usage("Missing BAM file! -a bam"); }
     else if (!listonly && output_prefix == NULL) { exit_usage("Missing output prefix!"); }
 
-    print_status("# Options: listonly=%d readlist=%d reclassify=%d refonly=%d paired=%d pao=%d\n", listonly, readlist, reclassify, refonly, paired, pao);
-    print_status("#          ngi=%d isc=%d nodup=%d splice=%d bs=%d phred64=%d omega=%g cq=%d\n", ngi, isc, nodup, splice, bisulfite, phred64, omega, const_qual);
+    if (tagged && other_bam != NULL) { exit_usage("--tagged labels classified reads, not the unique reads of -u"); }
+
+    print_status("# Options: listonly=%d readlist=%d reclassify=%d refonly=%d paired=%d pao=%d tagged=%d\n", listonly, readlist, reclassify, refonly, paired, pao, tagged);
+    print_status("#          ngi=%d isc=%d nodup=%d splice=%d bs=%d phred64=%d omega=%g cq=%d iothread=%d\n", ngi, isc, nodup, splice, bisulfite, phred64, omega, const_qual, iothread);
     print_status("# Start: \t%s", asctime(time_info));
 
+    if (iothread > 0) { // shared pool for bgzf decompression and compression by every open handle
+        tpool.pool = hts_tpool_init(iothread);
+        if (tpool.pool == NULL) { exit_err("failed to create htslib thread pool with %d threads\n", iothread); }
+    }
+
     /* Start processing data */
     clock_t tic = clock();
 
     var_hash = kh_init(vh);
     read_hash = kh_init(rh);
+    chr_hash = kh_init(ch);
 
     if (ngi) {
         init_seqnt_map(seqnt_map);
@@ -821,26 +861,15 @@ int main(int argc, char **argv) {
         if (omega < 0 || omega > 1) omega = 1e-40;
         lgomega = (log(omega) - log(1.0-omega));
 
-        khiter_t k;
         refseq_hash = kh_init(rsh);
         fasta_read(ref_file1);
-        bam_read(bam_file1, 0);
-        for (k = kh_begin(ref_hash); k != kh_end(refseq_hash); k++) {
-            if (kh_exist(refseq_hash, k)) {
-                fasta_destroy(kh_val(refseq_hash, k)); free(kh_val(refseq_hash, k)); kh_val(refseq_hash, k) = NULL;
-            }
-        }
-        kh_destroy(rsh, refseq_hash);
+        bam_read(bam_file1, ref_file1, 0);
+        refseq_destroy();
 
         refseq_hash = kh_init(rsh);
         fasta_read(ref_file2);
-        bam_read(bam_file2, 1);
-        for (k = kh_begin(ref_hash); k != kh_end(refseq_hash); k++) {
-            if (kh_exist(refseq_hash, k)) {
-                fasta_destroy(kh_val(refseq_hash, k)); free(kh_val(refseq_hash, k)); kh_val(refseq_hash, k) = NULL;
-            }
-        }
-        kh_destroy(rsh, refseq_hash);
+        bam_read(bam_file2, ref_file2, 1);
+        refseq_destroy();
 
         if (paired) combine_pe();
         readinfo_classify();
@@ -850,8 +879,8 @@ int main(int argc, char **argv) {
             snprintf(output_prefix1, strlen(output_prefix) + 2, "%s1", output_prefix);
             snprintf(output_prefix2, strlen(output_prefix) + 2, "%s2", output_prefix);
 
-            bam_write(bam_file1, output_prefix1, other_bam, 0);
-            bam_write(bam_file2, output_prefix2, other_bam, 1);
+            bam_write(bam_file1, ref_file1, output_prefix1, other_bam, 0);
+            bam_write(bam_file2, ref_file2, output_prefix2, other_bam, 1);
         }
     }
     else if (readlist) {
@@ -869,7 +898,7 @@ int main(int argc, char **argv) {
 
         if (paired) combine_pe();
         if (reclassify) readinfo_classify();
-        if (!listonly) bam_write(bam_file, output_prefix, other_bam, 0);
+        if (!listonly) bam_write(bam_file, fa_file, output_prefix, other_bam, 0);
     }
     else {
         //var_file = argv[optind++];
@@ -886,7 +915,7 @@ int main(int argc, char **argv) {
 
         if (paired) combine_pe();
         readinfo_classify();
-        if (!listonly) bam_write(bam_file, output_prefix, other_bam, 0);
+        if (!listonly) bam_write(bam_file, fa_file, output_prefix, other_bam, 0);
     }
 
     khiter_t k;
@@ -900,10 +929,18 @@ int main(int argc, char **argv) {
     for (k = kh_begin(read_hash); k != kh_end(read_hash); k++) {
         if (kh_exist(read_hash, k)) {
             read_destroy(kh_val(read_hash, k)); free(kh_val(read_hash, k)); kh_val(read_hash, k) = NULL;
+            free((char *)kh_key(read_hash, k)); kh_key(read_hash, k) = NULL;
         }
     }
     kh_destroy(rh, read_hash);
 
+    for (k = kh_begin(chr_hash); k != kh_end(chr_hash); k++) {
+        if (kh_exist(chr_hash, k)) { free((char *)kh_key(chr_hash, k)); kh_key(chr_hash, k) = NULL; }
+    }
+    kh_destroy(ch, chr_hash);
+
+    if (tpool.pool != NULL) { hts_tpool_destroy(tpool.pool); tpool.pool = NULL; }
+
     clock_t toc = clock();
     print_status("# CPU time (hr):\t%f\n", (double)(toc - tic) / CLOCKS_PER_SEC / 3600);
 
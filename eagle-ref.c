@@ -0,0 +1,142 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Utility program that converts a reference fasta into a memory mapped reference, used by eagle, eagle-rc and eagle-nm
+
+Every contig is stored as the seqnt_map codes of its uppercased bases and nul terminated, so that processes map the file 
+read-only instead of reading and coding their own copy, and concurrent jobs share it in the page cache
+
+ex) eagle-ref ref.fa
+    eagle -t 2 -v var.vcf -a align.bam -r ref.fa > out.txt
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <time.h>
+#include <getopt.h>
+#include <sys/stat.h>
+
+#include "htslib/faidx.h"
+#include "util.h"
+#include "calc.h"
+#include "refmap.h"
+
+#define VERSION "1.1.3"
+
+/* Command line arguments */
+static char *fa_file;
+
+/* Time info */
+static time_t now; 
+static struct tm *time_info; 
+#define print_status(M, ...) time(&now); time_info = localtime(&now); fprintf(stderr, M, ##__VA_ARGS__);
+
+static void refmap_build(const char *out_file) {
+    struct stat st;
+    if (stat(fa_file, &st) != 0) { exit_err("failed to stat reference %s\n", fa_file); }
+    faidx_t *fai = fai_load(fa_file);
+    if (fai == NULL) {
+        errno = fai_build(fa_file);
+        if (errno == 0) { fai = fai_load(fa_file); }
+        if (fai == NULL) { exit_err("failed to build and open FA index %s\n", fa_file); }
+    }
+
+    /* Header, the sequences one contig at a time, then the names and the directory */
+    refmap_header_t header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, REFMAP_MAGIC, 8);
+    header.fa_size = st.st_size;
+    header.fa_mtime = st.st_mtime;
+    header.n_contigs = faidx_nseq(fai);
+
+    FILE *out = fopen(out_file, "wb");
+    if (out == NULL) { exit_err("failed to open reference map %s\n", out_file); }
+    if (fwrite(&header, sizeof (header), 1, out) != 1) { exit_err("failed to write reference map %s\n", out_file); }
+    uint64_t offset = sizeof (header);
+
+    int i;
+    uint64_t nbases = 0;
+    refmap_contig_t *dir = malloc((header.n_contigs + 1) * sizeof (refmap_contig_t));
+    for (i = 0; i < (int)header.n_contigs; i++) {
+        const char *name = faidx_iseq(fai, i);
+        int length = 0;
+        char *seq = faidx_fetch_seq(fai, name, 0, faidx_seq_len(fai, name) - 1, &length);
+        if (seq == NULL) { exit_err("failed to read %s from reference %s\n", name, fa_file); }
+        char *s;
+        for (s = seq; *s != '\0'; s++) *s = toupper(*s);
+        int bad = encode_seqnt((uint8_t *)seq, seq, length, seqnt_map); // in place, still nul terminated
+        if (bad >= 0) { exit_err("Character %c at %s:%d not in valid alphabet\n", seq[bad], name, bad + 1); }
+        dir[i].seq = offset;
+        dir[i].length = length;
+        if (fwrite(seq, 1, length + 1, out) != (size_t)length + 1) { exit_err("failed to write reference map %s\n", out_file); }
+        offset += length + 1;
+        nbases += length;
+        free(seq); seq = NULL;
+    }
+    for (i = 0; i < (int)header.n_contigs; i++) {
+        const char *name = faidx_iseq(fai, i);
+        size_t n = strlen(name) + 1;
+        dir[i].name = offset;
+        if (fwrite(name, 1, n, out) != n) { exit_err("failed to write reference map %s\n", out_file); }
+        offset += n;
+    }
+    static const char pad[8] = {0};
+    size_t npad = (8 - offset % 8) % 8;
+    if (npad > 0 && fwrite(pad, 1, npad, out) != npad) { exit_err("failed to write reference map %s\n", out_file); }
+    offset += npad;
+    header.dir_offset = offset;
+    if (header.n_contigs > 0 && fwrite(dir, sizeof (refmap_contig_t), header.n_contigs, out) != header.n_contigs) { exit_err("failed to write reference map %s\n", out_file); }
+    offset += header.n_contigs * sizeof (refmap_contig_t);
+
+    rewind(out);
+    if (fwrite(&header, sizeof (header), 1, out) != 1) { exit_err("failed to write reference map %s\n", out_file); }
+    if (fclose(out) != 0) { exit_err("failed to write reference map %s\n", out_file); }
+    free(dir); dir = NULL;
+    fai_destroy(fai);
+    print_status("# Wrote reference map: %s\t%llu contigs\t%llu bases\t%s", out_file, (unsigned long long)header.n_contigs, (unsigned long long)nbases, asctime(time_info));
+}
+
+static void print_usage() {
+    printf("\nUsage: eagle-ref [options] ref.fa\n\n");
+    printf("Converts a reference fasta into a memory mapped reference, ref.fa%s, used in its place by eagle, eagle-rc and eagle-nm.\n", REFMAP_SUFFIX);
+    printf("Rebuild it whenever the fasta changes.\n");
+    printf("Options:\n");
+    printf("     --version           Display version.\n");
+}
+
+int main(int argc, char **argv) {
+    /* Command line parameters defaults */
+    fa_file = NULL;
+
+    static struct option long_options[] = {
+        {"version", optional_argument, NULL, 999},
+        {0, 0, 0, 0}
+    };
+
+    int opt = 0;
+    while ((opt = getopt_long(argc, argv, "", long_options, &opt)) != -1) {
+        switch (opt) {
+            case 0: break;
+            case 999: printf("EAGLE-REF %s\n", VERSION); exit(0);
+            default: exit_usage("Bad options");
+        }
+    }
+    if (optind >= argc) { exit_usage("Missing reference fasta file!"); }
+    fa_file = argv[optind];
+
+    int n = strlen(fa_file) + strlen(REFMAP_SUFFIX) + 1;
+    char out_file[n];
+    snprintf(out_file, n, "%s%s", fa_file, REFMAP_SUFFIX);
+
+    print_status("# Start: \t%s", asctime(time_info));
+    clock_t tic = clock();
+    init_seqnt_map(seqnt_map);
+    refmap_build(out_file);
+
+    clock_t toc = clock();
+    print_status("# CPU time (hr):\t%f\n", (double)(toc - tic) / CLOCKS_PER_SEC / 3600);
+    return 0;
+}
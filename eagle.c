@@ -8,19 +8,31 @@ This program is distributed under the terms of the GNU General Public License
 */
 
 #include <stdlib.h>
+#include <limits.h>
 #include <ctype.h>
 #include <float.h>
 #include <math.h>
 #include <time.h>
 #include <getopt.h>
 #include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/resource.h>
 #include "htslib/sam.h"
 #include "htslib/faidx.h"
 #include "htslib/khash.h"
+#include "htslib/kstring.h"
+#include "htslib/vcf.h"
+#include "htslib/kseq.h"
+#include "htslib/bgzf.h"
+#include "htslib/thread_pool.h"
 #include "vector.h"
 #include "util.h"
 #include "calc.h"
 #include "heap.h"
+#include "classify.h"
+#include "store.h"
+#include "refmap.h"
 
 /* Constants */
 #define VERSION "1.1.3"
@@ -33,14 +45,31 @@ This program is distributed under the terms of the GNU General Public License
 #define LOG10 (log(0.1))
 #define LOG90 (log(0.9))
 #define LGALPHA (log(ALPHA))
+#define SWEEP_GAP 65536 // start a new streamed region when consecutive sets are further apart
+#define CHECKPOINT_SEC 60 // seconds between checkpoint flushes
+#define REORDER_MAX 65536 // finished sets held for ordered output, workers wait beyond this many sets ahead of the writer
+#define CLASSIFY_SHARDS 64 // independently locked parts of the --classify read table
+#define PLAN_SAMPLE 1000 // sets whose reads are fetched by --plan, the rest are estimated from them
+#define PLAN_CALIBRATE 16 // sampled sets evaluated by --plan to time the work per read and hypothesis
+#define PLAN_WORST 10 // costliest sets listed by --plan
+#define PLAN_SHARD_HOURS 24 // wall clock hours per shard that --plan recommends
+#define REFWIN_SLOTS 4 // reference windows kept by each thread
+#define REFWIN_PAD 65536 // bases fetched past either side of a window, so the next sets on the contig find it cached
+#define REFWIN_FLANK 1024 // bases kept past the furthest a read of the set can be aligned
 
 /* Command line arguments */
 static int debug;
 static char *vcf_file;
-static char *bam_file;
+static char *bam_file; // comma separated alignment files, as given
+static char **bam_files;
+static int nbam;
+static int rgsplit;
 static char *fa_file;
 static char *out_file;
 static int nthread;
+static int iothread;
+static htsThreadPool tpool = {NULL, 0};
+static bam_hts_t *bam_shared; // opened first, its cram reference is shared with every per-thread handle
 static int sharedr;
 static int distlim;
 static int maxdist;
@@ -55,150 +84,566 @@ static int lowmem;
 static int phred64;
 static int bisulfite;
 static int const_qual;
+static int sweep_mode;
+static int shard, nshard;
+static char *ckpt_file;
+static char *vcf_out;
+static char *readinfo_file;
+static char *classify_prefix;
+static int classify_split;
+static int readstore;
+static int plan_mode;
+static int stream_mode;
+static int refmem; // --refmem: MB of reference windows held by all threads, 0 for REFWIN_SLOTS windows each
+static char *settable_file; // --settable: Set column as an id into this table of the sets
+static FILE *settable_fh;
+static size_t settable_nsets;
+static size_t set_offset; // id of the first set of this call to process, sets of the contigs streamed before
+static size_t set_base; // id of the first set of this shard
+static store_t **stores; // --readstore: read store of each bam, shared read only by every thread
+static int resume;
+static volatile sig_atomic_t terminated; // SIGTERM or SIGINT received, finish the sets in progress and flush the checkpoint
+static int min_mapq;
+static int maxdepth;
 static double hetbias;
 static double omega, lgomega;
 static int dp, gap_op, gap_ex;
 static int rc;
 static double ref_prior, alt_prior, het_prior;
 
+/* Samples evaluated jointly, one per alignment file or one per read group of a single file */
+typedef struct {
+    char *name;
+    char *rg; // read group id when split by read group, NULL otherwise
+    int file; // index in bam_files
+} sample_t;
+static sample_t *samples;
+static int nsample;
+
 /* Time info */
 static time_t now; 
 static struct tm *time_info; 
 #define print_status(M, ...) time(&now); time_info = localtime(&now); fprintf(stderr, M, ##__VA_ARGS__);
 
-KHASH_MAP_INIT_STR(rsh, fasta_t *)   // hashmap: string key, vector value
-static khash_t(rsh) *refseq_hash; // pointer to hashmap
-static pthread_mutex_t refseq_lock; 
+typedef struct {
+    uint8_t *seq; // seqnt_map codes of the bases beg to end of contig chr, in the reference map or owned
+    char *chr;
+    int beg, end, length; // length of the whole contig
+    int owned, set; // fetched for a set rather than an XA lookup
+    int refs; // sets and XA lookups evaluating with it, never evicted while held
+    size_t used; // tick of last use, least recently used is evicted
+} refwin_t;
 
-static vector_t *vcf_read(FILE *file) {
-    vector_t *var_list = vector_create(8, VARIANT_T);
+typedef struct {
+    refwin_t win[REFWIN_SLOTS];
+    size_t tick;
+    size_t bytes, budget; // bases held, and the share of --refmem of this thread
+    faidx_t *fai; // index handle of this thread, opened on its first fetch, a handle reads through one file position
+} refwin_cache_t; // reference windows of one thread
+
+static faidx_t *refseq_fai; // reference index for contig lengths, sequences are read through the handle of each thread
+static refmap_t *refmap; // reference mapped from eagle-ref, in place of the index when there is one
+
+KHASH_MAP_INIT_STR(xh, vector_int_t *) // hashmap: string key, BED regions as sorted disjoint begin, end pairs
+static khash_t(xh) *exclude_hash; // pointer to hashmap
+static khash_t(xh) *region_hash; // pointer to hashmap
+
+static int interval_cmp(const void *a, const void *b) {
+    const int *x = (const int *)a;
+    const int *y = (const int *)b;
+    return (x[0] > y[0]) - (x[0] < y[0]);
+}
 
+static void bed_read(khash_t(xh) *bed_hash, const char *filename, const char *label) {
+    /* BED regions per chromosome, merged into sorted disjoint begin, end pairs */
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) { exit_err("failed to open BED file %s\n", filename); }
+
+    khiter_t k;
+    int nregions = 0;
     char *line = NULL;
     ssize_t read_file = 0;
     size_t line_length = 0;
     while ((read_file = getline(&line, &line_length, file)) != -1) {
         if (line_length <= 0 || line[strspn(line, " \t\v\r\n")] == '\0') continue; // blank line
-        if (line[0] == '#') continue;
+        if (line[0] == '#' || strncmp(line, "track", 5) == 0 || strncmp(line, "browser", 7) == 0) continue;
+
+        int pos1, pos2;
+        char chr[line_length];
+        int t = sscanf(line, "%s %d %d", chr, &pos1, &pos2);
+        if (t < 3) { exit_err("bad fields in BED file\n%s\n", line); }
+
+        int absent;
+        k = kh_put(xh, bed_hash, chr, &absent);
+        if (absent) {
+            kh_key(bed_hash, k) = strdup(chr);
+            kh_val(bed_hash, k) = vector_int_create(8);
+        }
+        vector_int_add(kh_val(bed_hash, k), pos1);
+        vector_int_add(kh_val(bed_hash, k), pos2);
+        nregions++;
+    }
+    free(line); line = NULL;
+    fclose(file);
+
+    for (k = kh_begin(bed_hash); k != kh_end(bed_hash); k++) {
+        if (!kh_exist(bed_hash, k)) continue;
+        vector_int_t *r = kh_val(bed_hash, k);
+        qsort(r->data, r->len / 2, 2 * sizeof (int), interval_cmp);
+        size_t i, j = 0;
+        for (i = 2; i < r->len; i += 2) {
+            if (r->data[i] <= r->data[j + 1]) { // overlapping or adjacent, merge
+                if (r->data[i + 1] > r->data[j + 1]) r->data[j + 1] = r->data[i + 1];
+                continue;
+            }
+            j += 2;
+            r->data[j] = r->data[i];
+            r->data[j + 1] = r->data[i + 1];
+        }
+        r->len = j + 2;
+    }
+    print_status("# Read %s BED: %s\t%i regions\t%s", label, filename, nregions, asctime(time_info));
+}
+
+static int bed_find(const khash_t(xh) *bed_hash, const char *chr, int pos) {
+    /* 1-based variant position within a 0-based half open BED region */
+    khiter_t k = kh_get(xh, bed_hash, chr);
+    if (k == kh_end(bed_hash)) return 0;
+    vector_int_t *r = kh_val(bed_hash, k);
+    size_t lo = 0, hi = r->len / 2;
+    while (lo < hi) { // first region beginning at or after pos
+        size_t mid = (lo + hi) / 2;
+        if (r->data[2 * mid] < pos) lo = mid + 1;
+        else hi = mid;
+    }
+    return (lo > 0 && pos <= r->data[2 * (lo - 1) + 1]);
+}
+
+static void bed_destroy(khash_t(xh) *bed_hash) {
+    if (bed_hash == NULL) return;
+    khiter_t k;
+    for (k = kh_begin(bed_hash); k != kh_end(bed_hash); k++) {
+        if (kh_exist(bed_hash, k)) {
+            free((char *)kh_key(bed_hash, k)); kh_key(bed_hash, k) = NULL;
+            vector_int_free(kh_val(bed_hash, k)); kh_val(bed_hash, k) = NULL;
+        }
+    }
+    kh_destroy(xh, bed_hash);
+}
+
+typedef struct {
+    htsFile *fp;
+    bcf_hdr_t *hdr; // NULL for a VCF without header lines, read as text
+    bcf1_t *rec;
+    kstring_t line;
+    vector_t *pending; // variants of the record that started the next contig
+    vector_t *seen; // names of the contigs already read, each must come in one run of records to be streamed
+    vector_t *chunk; // contig read ahead while the previous one is evaluated
+    size_t nvars; // variants read so far, the index of the next
+    const char *chr; // contig of the pending variants, in seen
+} vcf_stream_t;
+
+static vcf_stream_t *vcf_open(const char *filename) {
+    /* VCF, bgzipped VCF or BCF read in order, without an index; text without header lines, such as the lists of 
+       variants written by the scripts, is read line by line as before */
+    vcf_stream_t *vs = malloc(sizeof (vcf_stream_t));
+    vs->fp = hts_open(filename, "r");
+    if (vs->fp == NULL) { exit_err("failed to open VCF file %s\n", filename); }
+    if (iothread > 0) hts_set_threads(vs->fp, iothread);
+    vs->hdr = NULL;
+    const htsFormat *fmt = hts_get_format(vs->fp);
+    if (fmt->format == vcf || fmt->format == bcf) {
+        vs->hdr = bcf_hdr_read(vs->fp);
+        if (vs->hdr == NULL) { exit_err("bad header in VCF file %s\n", filename); }
+    }
+    vs->rec = bcf_init();
+    vs->line.l = vs->line.m = 0;
+    vs->line.s = NULL;
+    vs->pending = vector_create(8, VARIANT_T);
+    vs->seen = vector_create(64, VOID_T);
+    vs->chunk = NULL;
+    vs->nvars = 0;
+    vs->chr = NULL;
+    return vs;
+}
+
+static void vcf_close(vcf_stream_t *vs) {
+    hts_close(vs->fp); vs->fp = NULL;
+    if (vs->hdr != NULL) { bcf_hdr_destroy(vs->hdr); vs->hdr = NULL; }
+    bcf_destroy(vs->rec); vs->rec = NULL;
+    free(vs->line.s); vs->line.s = NULL;
+    vector_destroy(vs->pending); free(vs->pending); vs->pending = NULL;
+    vector_destroy(vs->seen); free(vs->seen); vs->seen = NULL;
+    vs->chr = NULL;
+}
+
+static int vcf_line(vcf_stream_t *vs) {
+    /* Next record, parsed by htslib or as a text line, 0 at the end */
+    if (vs->hdr != NULL) {
+        int ret = bcf_read(vs->fp, vs->hdr, vs->rec);
+        if (ret < -1) { exit_err("failed to read VCF file %s\n", vcf_file); }
+        return ret == 0;
+    }
+    int ret;
+    while ((ret = hts_getline(vs->fp, KS_SEP_LINE, &vs->line)) >= 0) {
+        if (vs->line.l == 0 || vs->line.s[strspn(vs->line.s, " \t\v\r\n")] == '\0') continue; // blank line
+        if (vs->line.s[0] == '#') continue;
+        return 1;
+    }
+    if (ret < -1) { exit_err("failed to read VCF file %s\n", vcf_file); }
+    return 0;
+}
 
+static void vcf_variants(vcf_stream_t *vs, vector_t *var_list) {
+    /* Each alternative allele of a record as its own variant, heterozygous non-reference as separate entries */
+    if (vs->hdr == NULL) {
+        char *line = vs->line.s;
         int pos;
-        char chr[line_length], ref[line_length], alt[line_length];
+        char chr[vs->line.l + 1], ref[vs->line.l + 1], alt[vs->line.l + 1];
         int t = sscanf(line, "%s %d %*[^\t] %s %s", chr, &pos, ref, alt);
         if (t < 4 || has_numbers(ref) || has_numbers(alt)) { exit_err("bad fields in VCF file\n%s\n", line); }
 
         int n1, n2;
         char *s1, *s2, ref_token[strlen(ref) + 1], alt_token[strlen(alt) + 1];
-        for (s1 = ref; sscanf(s1, "%[^, ]%n", ref_token, &n1) == 1 || sscanf(s1, "%[-]%n", ref_token, &n1) == 1; s1 += n1 + 1) { // heterogenenous non-reference (comma-delimited) as separate entries
+        for (s1 = ref; sscanf(s1, "%[^, ]%n", ref_token, &n1) == 1 || sscanf(s1, "%[-]%n", ref_token, &n1) == 1; s1 += n1 + 1) {
             for (s2 = alt; sscanf(s2, "%[^, ]%n", alt_token, &n2) == 1 || sscanf(s2, "%[-]%n", alt_token, &n2) == 1; s2 += n2 + 1) {
-                if (alt_token[0] != '.' && alt_token[0] != '*' && strcmp("<*:DEL>", alt_token) != 0) {
-                    variant_t *v = variant_create(chr, pos, ref_token, alt_token);
-                    vector_add(var_list, v);
-                }
+                if (alt_token[0] != '.' && alt_token[0] != '*' && strcmp("<*:DEL>", alt_token) != 0) vector_add(var_list, variant_create(chr, pos, ref_token, alt_token));
                 if (*(s2 + n2) != ',') break;
             }
             if (*(s1 + n1) != ',') break;
         }
+        return;
     }
-    free(line); line = NULL;
-    fclose(file);
+
+    bcf1_t *rec = vs->rec;
+    char *chr = (char *)bcf_seqname(vs->hdr, rec);
+    int pos = (int)rec->pos + 1;
+    if (rec->errcode != 0 || bcf_unpack(rec, BCF_UN_STR) < 0) { exit_err("bad record in VCF file at %s:%d\n", chr, pos); }
+
+    int j;
+    char *ref = rec->d.allele[0];
+    for (j = 1; j < rec->n_allele; j++) {
+        char *alt = rec->d.allele[j];
+        if (has_numbers(ref) || has_numbers(alt)) { exit_err("bad fields in VCF file\n%s\t%d\t%s\t%s\n", chr, pos, ref, alt); }
+        if (alt[0] != '.' && alt[0] != '*' && strcmp("<*:DEL>", alt) != 0) vector_add(var_list, variant_create(chr, pos, ref, alt));
+    }
+}
+
+static vector_t *vcf_next(vcf_stream_t *vs, int by_contig) {
+    /* Variants up to the end of the next contig with any, or of the whole input, sorted and indexed in input order, NULL when done */
+    size_t i;
+    vector_t *var_list = vector_create(8, VARIANT_T);
+    for (i = 0; i < vs->pending->len; i++) vector_add(var_list, vs->pending->data[i]);
+    vs->pending->len = 0;
+
+    vector_t *rec_list = vector_create(4, VARIANT_T); // variants of one record
+    while (vcf_line(vs)) {
+        vcf_variants(vs, rec_list);
+        if (rec_list->len == 0) continue;
+        const char *chr = ((variant_t *)rec_list->data[0])->chr;
+        int next = 0;
+        if (by_contig && (vs->chr == NULL || strcmp(chr, vs->chr) != 0)) {
+            for (i = 0; i < vs->seen->len; i++) {
+                if (strcmp((char *)vs->seen->data[i], chr) == 0) { exit_err("%s in VCF file is not in one run of records, sort it to stream by contig\n", chr); }
+            }
+            vector_add(vs->seen, strdup(chr));
+            vs->chr = (const char *)vs->seen->data[vs->seen->len - 1];
+            next = (var_list->len > 0); // contig done, the record starts the next one
+        }
+        for (i = 0; i < rec_list->len; i++) vector_add(next ? vs->pending : var_list, rec_list->data[i]);
+        rec_list->len = 0;
+        if (next) break;
+    }
+    vector_free(rec_list);
+    if (var_list->len == 0) {
+        vector_free(var_list);
+        return NULL;
+    }
+
     qsort(var_list->data, var_list->len, sizeof (void *), nat_sort_variant);
+    for (i = 0; i < var_list->len; i++) ((variant_t *)var_list->data[i])->index = vs->nvars + i;
+    vs->nvars += var_list->len;
     return var_list;
 }
 
-static int bam_fetch_last(const char *bam_file, const char *chr, const int pos1, const int pos2) {
-    /* Reads in variant j = i + 1 region coordinates */
-    samFile *sam_in = sam_open(bam_file, "r"); // open bam file
-    if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_file); }
-    bam_hdr_t *bam_header = sam_hdr_read(sam_in); // bam header
-    if (bam_header == 0) { exit_err("bad header %s\n", bam_file); }
-    hts_idx_t *bam_idx = sam_index_load(sam_in, bam_file); // bam index
-    if (bam_idx == NULL) { exit_err("failed to open BAM index %s\n", bam_file); }
+static void *vcf_prefetch(void *stream) {
+    vcf_stream_t *vs = (vcf_stream_t *)stream;
+    vs->chunk = vcf_next(vs, 1);
+    return NULL;
+}
 
-    int last = -1;
-    int tid = bam_name2id(bam_header, chr);
-    hts_itr_t *iter = sam_itr_queryi(bam_idx, tid, pos1-1, pos2); // read iterator
-    if (iter != NULL) {
-        bam1_t *aln = bam_init1(); // initialize an alignment
-        while (sam_itr_next(sam_in, iter, aln) >= 0) {
-            if (aln->core.tid < 0) continue; // not mapped
-            last = aln->core.pos + aln->core.l_qseq;
+static int read_crosses(int pos, int end, const vector_t *var_set) {
+    /* Read crosses at least one variant of the set, otherwise it is skipped in every combination */
+    size_t i;
+    variant_t **var_data = (variant_t **)var_set->data;
+    for (i = 0; i < var_set->len; i++) {
+        if (pos <= var_data[i]->pos && end >= var_data[i]->pos) return 1;
+    }
+    return 0;
+}
+
+static inline int read_skipped(int pos, int end, const vector_t *var_set) {
+    /* Reads crossing no variant are counted without being read in, except when every read seen is reported per read */
+    if (verbose || classify_prefix != NULL) return 0;
+    return !read_crosses(pos, end, var_set);
+}
+
+static inline u_int64_t reservoir_seed(const vector_t *var_set) {
+    /* Seeded by locus so that downsampling is reproducible across runs, threads and modes */
+    variant_t *v = (variant_t *)var_set->data[0];
+    return ((u_int64_t)fnv_32a_str(v->chr) << 32) ^ (u_int64_t)v->pos;
+}
+
+static inline int reservoir_slot(u_int64_t *seed, int depth) {
+    /* Reservoir sampling of maxdepth reads, depth is the count of reads seen including this one, -1 if not sampled */
+    if (maxdepth <= 0 || depth <= maxdepth) return depth - 1;
+    int j = (int)(splitmix64(seed) % (u_int64_t)depth);
+    return (j < maxdepth) ? j : -1;
+}
+
+static inline void reservoir_add(vector_t *read_list, int slot, read_t *read) {
+    if (slot == read_list->len) { vector_add(read_list, read); return; }
+    read_destroy((read_t *)read_list->data[slot]); free(read_list->data[slot]);
+    read_list->data[slot] = read;
+}
+
+static int read_sample_rg(const char *id) {
+    /* Sample of a read group, -1 if none */
+    if (id == NULL) return -1;
+    int s;
+    for (s = 0; s < nsample; s++) {
+        if (strcmp(id, samples[s].rg) == 0) return s;
+    }
+    return -1;
+}
+
+static int read_sample(const bam1_t *aln, int file) {
+    /* Sample of a read by its alignment file, or by its read group when a single file is split, -1 if none */
+    if (!rgsplit) return file;
+    uint8_t *tag = bam_aux_get(aln, "RG");
+    if (tag == NULL) return -1;
+    return read_sample_rg(bam_aux2Z(tag));
+}
+
+static void store_fetch(const store_t *st, int file, const vector_t *var_set, vector_t **read_list, int *nskip, int *depth) {
+    /* As bam_fetch, from the columns of the read store, the same reads in the same order */
+    int s;
+    variant_t **var_data = (variant_t **)var_set->data;
+    u_int64_t seed[nsample];
+    for (s = 0; s < nsample; s++) seed[s] = reservoir_seed(var_set);
+
+    int beg = var_data[0]->pos - 1;
+    int end = var_data[var_set->len - 1]->pos;
+    size_t i, first;
+    size_t last = store_query(st, store_name2id(st, var_data[0]->chr), beg, &first);
+    for (i = first; i < last && st->pos[i] < end; i++) {
+        if (st->ref_end[i] <= beg) continue; // ends before the region
+        if (store_filter(st, i, pao, nodup, min_mapq)) continue;
+        s = (rgsplit) ? read_sample_rg(store_str(st, st->rg_off[i])) : file;
+        if (s < 0) continue;
+
+        int pos, end;
+        store_span(st, i, isc, &pos, &end);
+        if (read_skipped(pos, end, var_set)) {
+            nskip[s]++;
+            continue;
         }
-        bam_destroy1(aln);
+        int slot = reservoir_slot(&seed[s], ++depth[s]);
+        if (slot < 0) continue; // not sampled, don't decode
+
+        read_t *read = store_read(st, i, isc, splice, phred64, const_qual, verbose || classify_prefix != NULL || debug >= 2);
+        reservoir_add(read_list[s], slot, read);
     }
-    hts_itr_destroy(iter);
-    hts_idx_destroy(bam_idx);
-    bam_hdr_destroy(bam_header);
-    sam_close(sam_in);
-    return(last);
 }
 
-static vector_t *bam_fetch(const char *bam_file, const char *chr, const int pos1, const int pos2) {
-    /* Reads in region coordinates */
-    vector_t *read_list = vector_create(64, READ_T);
+static void bam_fetch(bam_hts_t *h, int file, const vector_t *var_set, vector_t **read_list, int *nskip, int *depth) {
+    /* Reads of one alignment file in variant set region coordinates added to the lists of its samples, 
+       filtered before decoding, counting those that cross no variant */
+    if (stores != NULL) {
+        store_fetch(stores[file], file, var_set, read_list, nskip, depth);
+        return;
+    }
 
-    samFile *sam_in = sam_open(bam_file, "r"); // open bam file
-    if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_file); }
-    bam_hdr_t *bam_header = sam_hdr_read(sam_in); // bam header
-    if (bam_header == 0) { exit_err("bad header %s\n", bam_file); }
-    hts_idx_t *bam_idx = sam_index_load(sam_in, bam_file); // bam index
-    if (bam_idx == NULL) { exit_err("failed to open BAM index %s\n", bam_file); }
+    int s;
+    variant_t **var_data = (variant_t **)var_set->data;
+    u_int64_t seed[nsample];
+    for (s = 0; s < nsample; s++) seed[s] = reservoir_seed(var_set);
 
-    int tid = bam_name2id(bam_header, chr);
-    hts_itr_t *iter = sam_itr_queryi(bam_idx, tid, pos1-1, pos2); // read iterator
+    int tid = bam_name2id(h->bam_header, var_data[0]->chr);
+    hts_itr_t *iter = sam_itr_queryi(h->bam_idx, tid, var_data[0]->pos - 1, var_data[var_set->len - 1]->pos); // read iterator
     if (iter != NULL) {
-        bam1_t *aln = bam_init1(); // initialize an alignment
-        while (sam_itr_next(sam_in, iter, aln) >= 0) {
-            read_t *read = read_fetch(bam_header, aln, pao, isc, nodup, splice, phred64, const_qual);
-            if (read != NULL) vector_add(read_list, read);
+        while (sam_itr_next(h->sam_in, iter, h->aln) >= 0) {
+            if (read_filter(h->aln, pao, nodup, min_mapq)) continue;
+            s = read_sample(h->aln, file);
+            if (s < 0) continue;
+
+            int pos, end;
+            read_span(h->aln, isc, &pos, &end);
+            if (read_skipped(pos, end, var_set)) {
+                nskip[s]++;
+                continue;
+            }
+            int slot = reservoir_slot(&seed[s], ++depth[s]);
+            if (slot < 0) continue; // not sampled, don't decode
+
+            read_t *read = read_fetch(h->bam_header, h->aln, pao, isc, nodup, splice, phred64, const_qual, verbose || classify_prefix != NULL || debug >= 2);
+            if (read != NULL) reservoir_add(read_list[s], slot, read);
         }
-        bam_destroy1(aln);
     }
     hts_itr_destroy(iter);
-    hts_idx_destroy(bam_idx);
-    bam_hdr_destroy(bam_header);
-    sam_close(sam_in);
-    return read_list;
 }
 
-static fasta_t *refseq_fetch(char *name, const char *fa_file) {
-    pthread_mutex_lock(&refseq_lock);
-	khiter_t k = kh_get(rsh, refseq_hash, name);
-    if (k != kh_end(refseq_hash)) {
-        pthread_mutex_unlock(&refseq_lock);
-        return kh_val(refseq_hash, k);
+static void refseq_open(const char *fa_file) {
+    /* One index or reference map shared by every thread, windows are fetched from the map or through an index handle of each thread */
+    refseq_fai = NULL;
+    refmap = refmap_open(fa_file);
+    if (refmap != NULL) {
+        print_status("# Reference map: %s%s\t%d contigs\t%s", fa_file, REFMAP_SUFFIX, (int)refmap->header->n_contigs, asctime(time_info));
     }
+    else {
+        refseq_fai = fai_load(fa_file);
+        if (refseq_fai == NULL) { 
+            errno = fai_build(fa_file);
+            if (errno == 0) { refseq_fai = fai_load(fa_file); }
+            if (refseq_fai == NULL) { exit_err("failed to build and open FA index %s\n", fa_file); }
+        }
+    }
+}
 
-    faidx_t *fai = fai_load(fa_file);
-    if (fai == NULL) { 
-        errno = fai_build(fa_file);
-        if (errno == 0) { fai = fai_load(fa_file); }
-        else { exit_err("failed to build and open FA index %s\n", fa_file); }
+static void refseq_close(void) {
+    if (refseq_fai != NULL) { fai_destroy(refseq_fai); refseq_fai = NULL; }
+    if (refmap != NULL) { refmap_close(refmap); free(refmap); refmap = NULL; }
+}
+
+static void refwin_cache_init(refwin_cache_t *c) {
+    memset(c, 0, sizeof (refwin_cache_t));
+    c->budget = (refmem > 0) ? (size_t)refmem * 1048576 / nthread : 0;
+}
+
+static void refwin_release(refwin_cache_t *c, refwin_t *w) {
+    /* Empty slots are released again when reused, only a held window counts */
+    if (w->seq != NULL && w->owned) {
+        c->bytes -= w->end - w->beg;
+        free(w->seq);
     }
-    if (!faidx_has_seq(fai, name)) { exit_err("failed to find %s in reference %s\n", name, fa_file); }
+    w->seq = NULL;
+    w->owned = 0;
+    w->beg = w->end = 0;
+    free(w->chr); w->chr = NULL;
+}
+
+static void refwin_cache_destroy(refwin_cache_t *c) {
+    int i;
+    for (i = 0; i < REFWIN_SLOTS; i++) refwin_release(c, &c->win[i]);
+    if (c->fai != NULL) { fai_destroy(c->fai); c->fai = NULL; }
+}
 
-    fasta_t *f = fasta_create(name);
-    //f->seq = fai_fetch(fai, f->name, &f->seq_length);
-    f->seq = faidx_fetch_seq(fai, f->name, 0, faidx_seq_len(fai, f->name) - 1, &f->seq_length);
-    char *s;
-    for (s = f->seq; *s != '\0'; s++) *s = toupper(*s);
+static void refwin_retire(refwin_cache_t *c, const char *chr, int beg) {
+    /* Windows of the sets this thread has moved past, it takes sets in order so none of its later sets needs them */
+    int i;
+    for (i = 0; i < REFWIN_SLOTS; i++) {
+        refwin_t *w = &c->win[i];
+        if (w->seq != NULL && w->set && w->refs == 0 && (strcmp(w->chr, chr) != 0 || w->end <= beg)) refwin_release(c, w);
+    }
+}
 
-    int absent;
-    k = kh_put(rsh, refseq_hash, f->name, &absent);
-    if (absent) { kh_val(refseq_hash, k) = f; }
-    else { exit_err("# refseq_hash collision: %s", asctime(time_info)); }
-    fai_destroy(fai);
-    pthread_mutex_unlock(&refseq_lock);
-    return f;
+static inline void refwin_unref(refwin_t *w) {
+    w->refs--;
 }
 
-static char *construct_altseq(const char *refseq, int refseq_length, const vector_int_t *combo, variant_t **var_data, int *altseq_length) {
+static inline uint8_t *refwin_view(const refwin_t *w) {
+    /* Indexed by contig position, only bases beg to end of it are read by the kernels */
+    return w->seq - w->beg;
+}
+
+static refwin_t *refwin_fetch(refwin_cache_t *c, const char *chr, int beg, int end, int set) {
+    /* Window of chr over beg to end, held until refwin_unref, cached by this thread or read with padding in place of the 
+       least recently used, then those beyond the --refmem budget evicted; a reference map is used in place as one window over the whole contig */
+    int i, length, id = -1;
+    if (refmap != NULL) {
+        id = refmap_name2id(refmap, chr);
+        length = (id >= 0) ? (int)refmap->contig[id].length : -1;
+    }
+    else length = faidx_seq_len(refseq_fai, chr);
+    if (length < 0) { exit_err("failed to find %s in reference %s\n", chr, fa_file); }
+    if (beg < 0) beg = 0;
+    if (end > length) end = length;
+    if (end < beg) end = beg;
+
+    c->tick++;
+    refwin_t *w = NULL;
+    for (i = 0; i < REFWIN_SLOTS; i++) {
+        w = &c->win[i];
+        if (w->seq != NULL && w->beg <= beg && end <= w->end && strcmp(w->chr, chr) == 0) {
+            w->used = c->tick;
+            w->set |= set;
+            w->refs++;
+            return w;
+        }
+    }
+    w = NULL;
+    for (i = 0; i < REFWIN_SLOTS; i++) {
+        if (c->win[i].refs > 0) continue;
+        if (w == NULL || c->win[i].seq == NULL || (w->seq != NULL && c->win[i].used < w->used)) w = &c->win[i];
+        if (w->seq == NULL) break;
+    }
+    if (w == NULL) { exit_err("no reference window left to fetch %s:%d-%d\n", chr, beg, end); }
+    refwin_release(c, w);
+
+    if (refmap != NULL) { /* Already coded in the map */
+        w->seq = (uint8_t *)refmap->map + refmap->contig[id].seq;
+        w->beg = 0;
+        w->end = length;
+        w->owned = 0;
+    }
+    else {
+        w->beg = (beg > REFWIN_PAD) ? beg - REFWIN_PAD : 0;
+        w->end = (end < length - REFWIN_PAD) ? end + REFWIN_PAD : length;
+        int n = 0;
+        char *seq;
+        if (w->end > w->beg) {
+            if (c->fai == NULL) c->fai = fai_load(fa_file); // index built by refseq_open
+            if (c->fai == NULL) { exit_err("failed to open FA index %s\n", fa_file); }
+            seq = faidx_fetch_seq(c->fai, chr, w->beg, w->end - 1, &n);
+        }
+        else seq = calloc(1, 1);
+        if (seq == NULL || n != w->end - w->beg) { exit_err("failed to read %s:%d-%d from reference %s\n", chr, w->beg, w->end, fa_file); }
+        for (i = 0; i < n; i++) seq[i] = toupper(seq[i]);
+        i = encode_seqnt((uint8_t *)seq, seq, n, seqnt_map); // in place
+        if (i >= 0) { exit_err("Character %c at %s:%d not in valid alphabet\n", seq[i], chr, w->beg + i + 1); }
+        w->seq = (uint8_t *)seq;
+        w->owned = 1;
+        c->bytes += w->end - w->beg;
+    }
+    w->chr = strdup(chr);
+    w->length = length;
+    w->used = c->tick;
+    w->set = set;
+    w->refs = 1;
+    while (c->budget > 0 && c->bytes > c->budget) {
+        refwin_t *lru = NULL;
+        for (i = 0; i < REFWIN_SLOTS; i++) {
+            refwin_t *v = &c->win[i];
+            if (v->seq != NULL && v->owned && v->refs == 0 && (lru == NULL || v->used < lru->used)) lru = v;
+        }
+        if (lru == NULL) break; // every window is held, over budget until released
+        refwin_release(c, lru);
+    }
+    return w;
+}
+
+static uint8_t *construct_altseq(const uint8_t *refseq, int refseq_length, int beg, int end, const vector_int_t *combo, variant_t **var_data, int *altseq_length) {
+    /* Alternative sequence of the reference bases beg to end, indexed from beg as refseq is, *altseq_length is that of the whole contig */
     int i;
-    int offset = 0;
-    char *altseq = strdup(refseq);
+    int offset = -beg;
+    int n = end - beg; // bases held
+    uint8_t *altseq = malloc((n + 1) * sizeof (*altseq));
+    memcpy(altseq, refseq + beg, n * sizeof (*altseq));
     *altseq_length = refseq_length;
     for (i = 0; i < combo->len; i++) {
         variant_t *v = var_data[combo->data[i]];
         int pos = v->pos - 1 + offset;
-        if (pos < 0 || pos > *altseq_length) { exit_err("Variant at %s:%d is out of bounds in reference\n", v->chr, v->pos); }
+        if (pos < 0 || pos > n) { exit_err("Variant at %s:%d is out of bounds in reference\n", v->chr, v->pos); }
 
         char *var_ref, *var_alt;
         if (v->ref[0] == '-') { // account for "-" variant representations 
@@ -222,18 +667,20 @@ static char *construct_altseq(const char *refseq, int refseq_length, const vecto
         }
         size_t var_ref_length = strlen(var_ref);
         size_t var_alt_length = strlen(var_alt);
+        uint8_t alt_code[var_alt_length + 1];
+        if (encode_seqnt(alt_code, var_alt, var_alt_length, seqnt_map) >= 0) { exit_err("Alt allele %s of %s:%d not in valid alphabet\n", v->alt, v->chr, v->pos); }
         int delta = var_alt_length - var_ref_length;
         offset += delta;
         if (delta == 0) { // snps, equal length haplotypes
-            memcpy(altseq + pos, var_alt, var_alt_length * sizeof (*var_alt));
+            memcpy(altseq + pos, alt_code, var_alt_length * sizeof (*altseq));
         }
         else { // indels
-            char *newalt = malloc((*altseq_length + delta + 1) * sizeof (*newalt));
+            uint8_t *newalt = malloc((n + delta + 1) * sizeof (*newalt));
             memcpy(newalt, altseq, pos * sizeof (*newalt));
-            memcpy(newalt + pos, var_alt, var_alt_length * sizeof (*newalt));
-            memcpy(newalt + pos + var_alt_length, altseq + pos + var_ref_length, (*altseq_length - pos - var_ref_length) * sizeof (*newalt));
+            memcpy(newalt + pos, alt_code, var_alt_length * sizeof (*newalt));
+            memcpy(newalt + pos + var_alt_length, altseq + pos + var_ref_length, (n - pos - var_ref_length) * sizeof (*newalt));
+            n += delta;
             *altseq_length += delta;
-            newalt[*altseq_length] = '\0';
             free(altseq); altseq = NULL;
             altseq = newalt;
         }
@@ -254,34 +701,74 @@ static inline int variant_find(const vector_int_t *a, int v) {
     return -1;
 }
 
-static inline void variant_print(char **output, const vector_t *var_set, int i, int nreads, int not_alt_count, int has_alt_count, double total, double has_alt, double not_alt) {
+typedef struct {
+    int seen, ref_count, alt_count;
+    double prob, odds;
+} call_t;
+
+static call_t *vcf_calls; // --vcfout: call of each variant and sample, by variant index
+static char *vcf_called;
+static pthread_mutex_t vcf_lock;
+
+static void vcf_record(const vector_t *var_set, call_t **call) {
+    /* Variants in several sets, as heterozygous non-reference alternatives, keep the call with the highest probability */
+    size_t i;
+    int s;
     variant_t **var_data = (variant_t **)var_set->data;
+    pthread_mutex_lock(&vcf_lock);
+    for (i = 0; i < var_set->len; i++) {
+        for (s = 0; s < nsample; s++) {
+            size_t k = var_data[i]->index * nsample + s;
+            if (vcf_called[k] && vcf_calls[k].prob >= call[s][i].prob) continue;
+            vcf_calls[k] = call[s][i];
+            vcf_called[k] = 1;
+        }
+    }
+    pthread_mutex_unlock(&vcf_lock);
+}
 
-    double prob = (has_alt - total) * M_1_LN10;
-    double odds = (has_alt - not_alt) * M_1_LN10;
+static inline void set_print(kstring_t *output, const vector_t *var_set) {
+    size_t i;
+    variant_t **var_data = (variant_t **)var_set->data;
+    kputc('[', output);
+    for (i = 0; i < var_set->len; i++) ksprintf(output, "%s,%d,%s,%s;", var_data[i]->chr, var_data[i]->pos, var_data[i]->ref, var_data[i]->alt);
+    kputc(']', output);
+}
 
-    int n = snprintf(NULL, 0, "%s\t%d\t%s\t%s\t%d\t%d\t%d\t%e\t%f\t", var_data[i]->chr, var_data[i]->pos, var_data[i]->ref, var_data[i]->alt, nreads, not_alt_count, has_alt_count, prob, odds) + 1;
-    char token[n];
-    snprintf(token, n, "%s\t%d\t%s\t%s\t%d\t%d\t%d\t%e\t%f\t", var_data[i]->chr, var_data[i]->pos, var_data[i]->ref, var_data[i]->alt, nreads, not_alt_count, has_alt_count, prob, odds);
-    str_resize(output, strlen(*output) + n);
-    strcat(*output, token);
+static inline void variant_print(kstring_t *output, const vector_t *var_set, size_t seti, int i, call_t **call, const int *depth, const int *sampled) {
+    /* One row per variant, the reads, probability and odds of each sample in turn, then the set or its id in the set table */
+    int s;
+    variant_t **var_data = (variant_t **)var_set->data;
 
-    str_resize(output, strlen(*output) + 2);
-    strcat(*output, "[");
-    if (var_set->len > 1) {
-        for (i = 0; i < var_set->len; i++) {
-            n = snprintf(NULL, 0, "%s,%d,%s,%s;", var_data[i]->chr, var_data[i]->pos, var_data[i]->ref, var_data[i]->alt) + 1;
-            char token[n];
-            snprintf(token, n, "%s,%d,%s,%s;", var_data[i]->chr, var_data[i]->pos, var_data[i]->ref, var_data[i]->alt);
-            str_resize(output, strlen(*output) + n);
-            strcat(*output, token);
-        }
+    ksprintf(output, "%s\t%d\t%s\t%s\t", var_data[i]->chr, var_data[i]->pos, var_data[i]->ref, var_data[i]->alt);
+    for (s = 0; s < nsample; s++) {
+        call_t *c = &call[s][i];
+        ksprintf(output, "%d\t%d\t%d\t%e\t%f\t", c->seen, c->ref_count, c->alt_count, c->prob, c->odds);
+    }
+    if (var_set->len == 1) kputs("[]", output);
+    else if (settable_file != NULL) ksprintf(output, "%zu", set_base + seti);
+    else set_print(output, var_set);
+    for (s = 0; s < nsample && maxdepth > 0; s++) ksprintf(output, "\t%d\t%d", depth[s], sampled[s]);
+    kputc('\n', output);
+}
+
+static inline int combo_has_indel(const vector_int_t *combo, variant_t **var_data) {
+    size_t i;
+    for (i = 0; i < combo->len; i++) {
+        variant_t *v = var_data[combo->data[i]];
+        if (v->ref[0] == '-' || v->alt[0] == '-' || strlen(v->ref) != strlen(v->alt)) return 1;
     }
-    str_resize(output, strlen(*output) + 3);
-    strcat(*output, "]\n");
+    return 0;
 }
 
-static void calc_likelihood(stats_t *stat, vector_t *var_set, const char *refseq, const int refseq_length, read_t **read_data, const int nreads, int seti, int *seqnt_map) {
+static uint8_t *combo_altseq(const vector_int_t *combo, const vector_t *var_set, const uint8_t *refseq, int refseq_length, int beg, int end, int *altseq_length) {
+    /* Alternative sequence of a combination over the set window, only needed for indels or dp, NULL otherwise */
+    *altseq_length = 0;
+    if (!dp && (lowmem || !combo_has_indel(combo, (variant_t **)var_set->data))) return NULL;
+    return construct_altseq(refseq, refseq_length, beg, end, combo, (variant_t **)var_set->data, altseq_length);
+}
+
+static void calc_likelihood(stats_t *stat, vector_t *var_set, const uint8_t *refseq, const int refseq_length, const uint8_t *altseq, const int altseq_length, read_t **read_data, const int nreads, int seti, int *seqnt_map, refwin_cache_t *cache) {
     size_t i, readi;
     stat->ref = 0;
     stat->alt = 0;
@@ -293,21 +780,7 @@ static void calc_likelihood(stats_t *stat, vector_t *var_set, const char *refseq
     variant_t **var_data = (variant_t **)var_set->data;
     double log_nv = log((double)var_set->len);
 
-    int has_indel = 0;
-    if (!lowmem) {
-        for (i = 0; i < stat->combo->len; i++) {
-            variant_t *v = var_data[stat->combo->data[i]];
-            if (v->ref[0] == '-' || v->alt[0] == '-' || strlen(v->ref) != strlen(v->alt)) {
-                has_indel = 1;
-                break;
-            }
-        }
-    }
-
-    /* Alternative sequence */
-    int altseq_length = 0;
-    char *altseq = NULL;
-    if (has_indel || dp) altseq = construct_altseq(refseq, refseq_length, stat->combo, var_data, &altseq_length); 
+    int has_indel = !lowmem && combo_has_indel(stat->combo, var_data);
 
     /* Aligned reads */
     for (readi = 0; readi < nreads; readi++) {
@@ -345,12 +818,12 @@ static void calc_likelihood(stats_t *stat, vector_t *var_set, const char *refseq
         //for (i =0; i < stat->combo->len; i++) { variant_t *v = var_data[stat->combo->data[i]]; printf("%d;%s;%s;", v->pos, v->ref, v->alt); }
         //printf("\t%s\t%d\t%d\t%s\n", read_data[readi]->name, read_data[readi]->pos, read_data[readi]->length, read_data[readi]->qseq);
         if (dp) {
-            prgu = calc_prob_dp(readprobmatrix, read_data[readi]->length, refseq, refseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, gap_op, gap_ex, seqnt_map);
-            prgv = calc_prob_dp(readprobmatrix, read_data[readi]->length, altseq, altseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, gap_op, gap_ex, seqnt_map);
+            prgu = calc_prob_dp(readprobmatrix, read_data[readi]->length, refseq, refseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, gap_op, gap_ex);
+            prgv = calc_prob_dp(readprobmatrix, read_data[readi]->length, altseq, altseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, gap_op, gap_ex);
         }
         else if (has_indel) {
-            prgu = calc_prob(readprobmatrix, read_data[readi]->length, refseq, refseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, seqnt_map);
-            prgv = calc_prob(readprobmatrix, read_data[readi]->length, altseq, altseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, seqnt_map);
+            prgu = calc_prob(readprobmatrix, read_data[readi]->length, refseq, refseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice);
+            prgv = calc_prob(readprobmatrix, read_data[readi]->length, altseq, altseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice);
         }
         else {
             calc_prob_snps(&prgu, &prgv, stat->combo, var_data, readprobmatrix, read_data[readi]->length, refseq, refseq_length, read_data[readi]->pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, seqnt_map);
@@ -365,23 +838,25 @@ static void calc_likelihood(stats_t *stat, vector_t *var_set, const char *refseq
             for (s = read_data[readi]->multimapXA; sscanf(s, "%[^,],%d,%*[^;]%n", xa_chr, &xa_pos, &n) == 2; s += n + 1) {
                 pout = log_add_exp(pout, elsewhere); // the more multi-mapped, the more likely it is the read is from elsewhere (paralogous), hence it scales (multiplied) with the number of multi-mapped locations
                 if (strcmp(xa_chr, read_data[readi]->chr) != 0 && abs(xa_pos - read_data[readi]->pos) < read_data[readi]->length) { // if secondary alignment does not overlap primary aligment
-                    fasta_t *f = refseq_fetch(xa_chr, fa_file);
-                    if (f == NULL) continue;
-                    char *xa_refseq = f->seq;
-                    int xa_refseq_length = f->seq_length;
+                    int xa_beg = abs(xa_pos) - read_data[readi]->length - REFWIN_FLANK;
+                    int xa_end = abs(xa_pos) + (read_data[readi]->end - read_data[readi]->pos) + 3 * read_data[readi]->length + REFWIN_FLANK;
+                    refwin_t *xa_win = refwin_fetch(cache, xa_chr, xa_beg, xa_end, 0);
+                    uint8_t *xa_refseq = refwin_view(xa_win);
+                    int xa_refseq_length = xa_win->length;
 
                     double *p_readprobmatrix = readprobmatrix;
                     double *newreadprobmatrix = NULL;
-                    if ((xa_pos < 0 && !read_data[readi]->is_reverse) || (xa_pos > 0 && read_data[readi]->is_reverse)) { // opposite of primary alignment strand
+                    if ((xa_pos < 0 && !read_is_reverse(read_data[readi])) || (xa_pos > 0 && read_is_reverse(read_data[readi]))) { // opposite of primary alignment strand
                         newreadprobmatrix = reverse(readprobmatrix, read_data[readi]->length * NT_CODES);
                         p_readprobmatrix = newreadprobmatrix;
                     }
 
                     xa_pos = abs(xa_pos);
-                    double readprobability = calc_prob(p_readprobmatrix, read_data[readi]->length, xa_refseq, xa_refseq_length, xa_pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice, seqnt_map);
+                    double readprobability = calc_prob(p_readprobmatrix, read_data[readi]->length, xa_refseq, xa_refseq_length, xa_pos, read_data[readi]->splice_pos, read_data[readi]->splice_offset, read_data[readi]->n_splice);
                     prgu = log_add_exp(prgu, readprobability);
                     prgv = log_add_exp(prgv, readprobability);
                     free(newreadprobmatrix); newreadprobmatrix = NULL;
+                    refwin_unref(xa_win);
                 }
                 if (*(s + n) != ';') break;
             }
@@ -431,67 +906,204 @@ static void calc_likelihood(stats_t *stat, vector_t *var_set, const char *refseq
         if (debug >= 2) {
             fprintf(stderr, "%f\t%f\t%f\t%f\t%d\t%d\t", prgu, phet, prgv, pout, stat->ref_count, stat->alt_count);
             fprintf(stderr, "%s\t%s\t%d\t%d\t", read_data[readi]->name, read_data[readi]->chr, read_data[readi]->pos, read_data[readi]->end);
-            for (i = 0; i < read_data[readi]->n_cigar; i++) fprintf(stderr, "%d%c ", read_data[readi]->cigar_oplen[i], read_data[readi]->cigar_opchr[i]);
+            fprintf(stderr, "%s ", read_data[readi]->cigar);
             fprintf(stderr, "\t");
             for (i = 0; i < stat->combo->len; i++) { variant_t *v = var_data[stat->combo->data[i]]; fprintf(stderr, "%s,%d,%s,%s;", v->chr, v->pos, v->ref, v->alt); }
             fprintf(stderr, "\t");
             if (read_data[readi]->multimapXA != NULL) fprintf(stderr, "%s\t", read_data[readi]->multimapXA);
             else fprintf(stderr, "%d\t", read_data[readi]->multimapNH);
             if (read_data[readi]->flag != NULL) fprintf(stderr, "%s\t", read_data[readi]->flag);
-            fprintf(stderr, "%s\t", read_data[readi]->qseq);
+            for (i = 0; i < read_data[readi]->length; i++) fputc(read_base(read_data[readi], i), stderr);
+            fprintf(stderr, "\t");
             for (i = 0; i < read_data[readi]->length; i++) fprintf(stderr, "%d ", read_data[readi]->qual[i]);
             fprintf(stderr, "\n");
         }
     }
     stat->mut = log_add_exp(stat->alt, stat->het);
-    free(altseq); altseq = NULL;
     if (debug >= 1) {
         fprintf(stderr, "==\t%f\t%f\t%f\t%d\t%d\t%d\t", stat->ref, stat->het, stat->alt, stat->ref_count, stat->alt_count, (int)nreads);
         for (i = 0; i < stat->combo->len; i++) { variant_t *v = var_data[stat->combo->data[i]]; fprintf(stderr, "%s,%d,%s,%s;", v->chr, v->pos, v->ref, v->alt); } fprintf(stderr, "\n");
     }
 }
 
-static char *evaluate(vector_t *var_set) {
+static BGZF *readinfo_fh; // --readinfo: binary per read likelihoods in place of the verbose text
+static pthread_mutex_t readinfo_lock;
+static uint32_t readinfo_nset; // set table ids handed out
+static int *readinfo_contig; // contig ids already defined in the stream
+static int readinfo_ncontig;
+
+static void readinfo_put(kstring_t *ks, char type, const void *data, size_t len, const char *str) {
+    /* Record: uint32 length of what follows, type, fixed fields, trailing string without terminator */
+    size_t slen = strlen(str);
+    uint32_t n = 1 + len + slen;
+    kputsn((char *)&n, sizeof (n), ks);
+    kputc(type, ks);
+    kputsn((const char *)data, len, ks);
+    kputsn(str, slen, ks);
+}
+
+static void readinfo_write(read_t **read_data, size_t nreads, stats_t **stat, size_t nstat, variant_t **var_data) {
+    /* Set table entries for the hypotheses the reads favour, then one record per read, built outside the lock and written as one block; 
+       new contigs are written as they are marked, before any other thread can write reads on them */
     size_t i, readi, seti;
+    kstring_t ks = {0, 0, NULL};
+    kstring_t contig = {0, 0, NULL};
+    char used[nstat];
+    uint32_t id[nstat];
+    memset(used, 0, sizeof (used));
+    for (readi = 0; readi < nreads; readi++) {
+        if (read_data[readi]->prgu == 0 && read_data[readi]->prgv == 0 && read_data[readi]->pout == 0) continue; // unprocessed read
+        used[read_data[readi]->index] = 1;
+    }
+    uint32_t nused = 0;
+    for (seti = 0; seti < nstat; seti++) nused += used[seti];
+
+    pthread_mutex_lock(&readinfo_lock);
+    uint32_t base = readinfo_nset;
+    readinfo_nset += nused;
+    for (readi = 0; readi < nreads; readi++) { // contigs, defined on first use
+        int32_t tid = read_data[readi]->tid;
+        if (!used[read_data[readi]->index] || tid < 0) continue;
+        if (tid >= readinfo_ncontig) {
+            int n = tid + 1 > readinfo_ncontig * 2 ? tid + 1 : readinfo_ncontig * 2;
+            readinfo_contig = realloc(readinfo_contig, n * sizeof (int));
+            memset(readinfo_contig + readinfo_ncontig, 0, (n - readinfo_ncontig) * sizeof (int));
+            readinfo_ncontig = n;
+        }
+        if (readinfo_contig[tid]) continue;
+        readinfo_contig[tid] = 1;
+        readinfo_put(&contig, 'C', &tid, sizeof (tid), read_data[readi]->chr);
+    }
+    if (contig.l > 0 && bgzf_write(readinfo_fh, contig.s, contig.l) < 0) { exit_err("failed to write read info file %s\n", readinfo_file); }
+    pthread_mutex_unlock(&readinfo_lock);
+    free(contig.s); contig.s = NULL;
+
+    kstring_t set = {0, 0, NULL};
+    for (seti = 0; seti < nstat; seti++) {
+        if (!used[seti]) continue;
+        id[seti] = base++;
+        set.l = 0;
+        kputc('[', &set);
+        for (i = 0; i < stat[seti]->combo->len; i++) {
+            variant_t *v = var_data[stat[seti]->combo->data[i]];
+            ksprintf(&set, "%s,%d,%s,%s;", v->chr, v->pos, v->ref, v->alt);
+        }
+        kputc(']', &set);
+        readinfo_put(&ks, 'S', &id[seti], sizeof (uint32_t), set.s);
+    }
+    free(set.s); set.s = NULL;
 
-    variant_t **var_data = (variant_t **)var_set->data;
+    for (readi = 0; readi < nreads; readi++) {
+        read_t *r = read_data[readi];
+        if (r->prgu == 0 && r->prgv == 0 && r->pout == 0) continue;
+        struct __attribute__((packed)) {
+            int32_t tid, pos;
+            float prgu, prgv, pout;
+            uint16_t sam_flag;
+            uint32_t set;
+        } rec = {r->tid, r->pos, r->prgu, r->prgv, r->pout, r->sam_flag, id[r->index]};
+        readinfo_put(&ks, 'R', &rec, sizeof (rec), r->name);
+    }
 
-    /* Reference sequence */
-    fasta_t *f = refseq_fetch(var_data[0]->chr, fa_file);
-    if (f == NULL) return NULL;
-    char *refseq = f->seq;
-    int refseq_length = f->seq_length;
+    pthread_mutex_lock(&readinfo_lock);
+    if (ks.l > 0 && bgzf_write(readinfo_fh, ks.s, ks.l) < 0) { exit_err("failed to write read info file %s\n", readinfo_file); }
+    pthread_mutex_unlock(&readinfo_lock);
+    free(ks.s); ks.s = NULL;
+}
 
-    /* Reads in variant region coordinates */
-    vector_t *read_list = bam_fetch(bam_file, var_data[0]->chr, var_data[0]->pos, var_data[var_set->len - 1]->pos);
-    if (read_list->len == 0) {
-        vector_destroy(read_list); free(read_list); read_list = NULL;
-        return NULL;
-    }
-    read_t **read_data = (read_t **)read_list->data;
+KHASH_MAP_INIT_STR(crh, read_t *) // hashmap: read name and read2 bit key, read_t * value
+KHASH_SET_INIT_STR(cvh) // hashset: variants of the best hypotheses, as chr,pos,ref,alt
 
-    /* Variant combinations as a vector of vectors */
-    //vector_t *combo = powerset(var_set->len, maxh);
-    vector_t *combo = all_and_singletons(var_set->len);
+typedef struct {
+    khash_t(crh) *hash;
+    pthread_mutex_t lock;
+} class_shard_t;
+static class_shard_t *class_shard; // --classify: reads summed over the sets they were seen in, as in eagle-rc
+static khash_t(cvh) *class_var;
+static pthread_mutex_t class_var_lock;
+
+static void classify_add(read_t **read_data, size_t nreads, stats_t **stat, variant_t **var_data) {
+    /* Likelihoods of the reads of a set into the table, each read locking only its shard */
+    size_t i, readi;
+    for (readi = 0; readi < nreads; readi++) {
+        read_t *r = read_data[readi];
+        if (r->prgu == 0 && r->prgv == 0 && r->pout == 0) continue; // unprocessed read
+        if (r->prgu == r->prgv) continue; // didn't "align" and was in a splice zone
+
+        int n = snprintf(NULL, 0, "%s\t%d", r->name, read_is_read2(r)) + 1;
+        char key[n];
+        snprintf(key, n, "%s\t%d", r->name, read_is_read2(r));
+        class_shard_t *shard = &class_shard[fnv_32a_str(key) % CLASSIFY_SHARDS];
+
+        pthread_mutex_lock(&shard->lock);
+        int absent;
+        khiter_t k = kh_put(crh, shard->hash, key, &absent);
+        read_t *c;
+        if (absent) {
+            c = read_create(r->name, r->tid, bam_shared->bam_header->target_name[r->tid], r->pos); // one bam with --mvh, its shared header outlives the variants streamed by contig
+            c->prgu = r->prgu;
+            c->prgv = r->prgv;
+            c->pout = r->pout;
+            c->sam_flag = r->sam_flag;
+            c->flag = bam_flag2str(r->sam_flag);
+            c->var_list = vector_create(1, VOID_T);
+            kh_key(shard->hash, k) = strdup(key);
+            kh_val(shard->hash, k) = c;
+        }
+        else {
+            c = kh_val(shard->hash, k);
+            c->prgu = (float)log_add_exp((double)c->prgu, (double)r->prgu);
+            c->prgv = (float)log_add_exp((double)c->prgv, (double)r->prgv);
+        }
+        vector_int_t *combo = stat[r->index]->combo;
+        for (i = 0; i < combo->len; i++) {
+            variant_t *v = var_data[combo->data[i]];
+            int n = snprintf(NULL, 0, "%s,%d,%s,%s", v->chr, v->pos, v->ref, v->alt) + 1;
+            char var[n];
+            snprintf(var, n, "%s,%d,%s,%s", v->chr, v->pos, v->ref, v->alt);
+            classify_var_add(c->var_list, var);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
 
-    /*
-    for (seti = 0; seti < combo->len; seti++) { // Print combinations
-        fprintf(stderr, "%d\t", (int)seti); 
-        for (i = 0; i < ((vector_int_t *)combo->data[seti])->len; i++) { fprintf(stderr, "%d;", ((vector_int_t *)combo->data[seti])->data[i]); } fprintf(stderr, "\t"); 
-        for (i = 0; i < ((vector_int_t *)combo->data[seti])->len; i++) { variant_t *v = var_data[((vector_int_t *)combo->data[seti])->data[i]]; fprintf(stderr, "%s,%d,%s,%s;", v->chr, v->pos, v->ref, v->alt); } fprintf(stderr, "\n"); 
+static void classify_add_output(const vector_t *best) {
+    /* Variants of the best hypothesis of a set, the EAGLE output of eagle-rc */
+    size_t i;
+    variant_t **var_data = (variant_t **)best->data;
+    pthread_mutex_lock(&class_var_lock);
+    for (i = 0; i < best->len; i++) {
+        variant_t *v = var_data[i];
+        int n = snprintf(NULL, 0, "%s,%d,%s,%s", v->chr, v->pos, v->ref, v->alt) + 1;
+        char var[n];
+        snprintf(var, n, "%s,%d,%s,%s", v->chr, v->pos, v->ref, v->alt);
+        int absent;
+        khiter_t k = kh_put(cvh, class_var, var, &absent);
+        if (absent) kh_key(class_var, k) = strdup(var);
     }
-    */
+    pthread_mutex_unlock(&class_var_lock);
+}
+
+static void evaluate_sample(vector_t *var_set, const uint8_t *refseq, int refseq_length, int beg, int end, const vector_t *shared_combo, uint8_t **altseq, const int *altseq_length, vector_t *read_list, int nskip, int depth, call_t *call, kstring_t *output, refwin_cache_t *cache) {
+    /* Hypotheses of one sample, the combinations of all and singles and their alternative sequences are shared by every sample */
+    size_t i, readi, seti;
+
+    variant_t **var_data = (variant_t **)var_set->data;
+
+    /* Reads in variant region coordinates */
+    if (depth > read_list->len) nskip = (int)((double)nskip * read_list->len / depth + 0.5); // downsampled, scale the reads crossing no variant alike
+    read_t **read_data = (read_t **)read_list->data;
 
     vector_t *stats = vector_create(var_set->len + 1, STATS_T);
 
-    for (seti = 0; seti < combo->len; seti++) { // all, singles
-        stats_t *s = stats_create((vector_int_t *)combo->data[seti], read_list->len);
-        calc_likelihood(s, var_set, refseq, refseq_length, read_data, read_list->len, seti, seqnt_map);
+    for (seti = 0; seti < shared_combo->len; seti++) { // all, singles
+        stats_t *s = stats_create(vector_int_dup((vector_int_t *)shared_combo->data[seti]), read_list->len);
+        calc_likelihood(s, var_set, refseq, refseq_length, altseq[seti], altseq_length[seti], read_data, read_list->len, seti, seqnt_map, cache);
         vector_add(stats, s);
     }
     if (var_set->len > 1) { // doubles and beyond
         heap_t *h = heap_create(STATS_T);
-        for (seti = 1; seti < combo->len; seti++) heap_push(h, ((stats_t *)stats->data[seti])->mut, stats->data[seti]);
+        for (seti = 1; seti < shared_combo->len; seti++) heap_push(h, ((stats_t *)stats->data[seti])->mut, stats->data[seti]);
 
         stats_t *s;
         while (s = heap_pop(h), s != NULL) {
@@ -501,7 +1113,10 @@ static char *evaluate(vector_t *var_set) {
             derive_combo(c, s->combo, var_set->len);
             for (i = 0; i < c->len; i++) {
                 stats_t *s = stats_create((vector_int_t *)c->data[i], read_list->len);
-                calc_likelihood(s, var_set, refseq, refseq_length, read_data, read_list->len, stats->len, seqnt_map);
+                int derived_length;
+                uint8_t *derived = combo_altseq(s->combo, var_set, refseq, refseq_length, beg, end, &derived_length);
+                calc_likelihood(s, var_set, refseq, refseq_length, (derived != NULL) ? derived - beg : NULL, derived_length, read_data, read_list->len, stats->len, seqnt_map, cache);
+                free(derived); derived = NULL;
                 vector_add(stats, s);
                 heap_push(h, s->mut, s);
             }
@@ -509,7 +1124,6 @@ static char *evaluate(vector_t *var_set) {
         }
         heap_free(h);
     }
-    vector_free(combo); //combos in stat so don't destroy
 
     stats_t **stat = (stats_t **)stats->data;
 
@@ -517,12 +1131,13 @@ static char *evaluate(vector_t *var_set) {
     int c[stats->len];
     memset(c, 0, sizeof (c));
     for (readi = 0; readi < read_list->len; readi++) c[read_data[readi]->index]++; // combinations, based on best combination in each read
+    c[0] += nskip; // reads crossing no variant were never read in, as if unprocessed
 
     vector_int_t *haplotypes = vector_int_create(stats->len);
-    for (i = 0; i < stats->len; i++) {
-        if ((double)c[i] / (double)read_list->len >= 0.1) vector_int_add(haplotypes, i); // relevant combination if read count >= 10% of reads seen
+    for (i = 0; i < stats->len && read_list->len + nskip > 0; i++) {
+        if ((double)c[i] / (double)(read_list->len + nskip) >= 0.1) vector_int_add(haplotypes, i); // relevant combination if read count >= 10% of reads seen
     }
-    combo = vector_create(haplotypes->len, VOID_T);
+    vector_t *combo = vector_create(haplotypes->len, VOID_T);
     if (haplotypes->len > 1) combinations(combo, 2, haplotypes->len); // combination pairs
 
     vector_double_t *prhap = vector_double_create(combo->len);
@@ -555,8 +1170,6 @@ static char *evaluate(vector_t *var_set) {
     }
     for (seti = 0; seti < combo->len; seti++) total = log_add_exp(total, prhap->data[seti]);
 
-    char *output = malloc(sizeof (*output));
-    output[0] = '\0';
     if (mvh) { /* Max likelihood variant hypothesis */
         size_t max_seti = 0;
         double r = stat[0]->mut - stat[0]->ref;
@@ -570,7 +1183,14 @@ static char *evaluate(vector_t *var_set) {
         }
         vector_t *v = vector_create(var_set->len, VARIANT_T);
         for (i = 0; i < stat[max_seti]->combo->len; i++) vector_add(v, var_data[stat[max_seti]->combo->data[i]]);
-        variant_print(&output, v, 0, stat[max_seti]->seen, stat[max_seti]->ref_count, stat[max_seti]->alt_count, log_add_exp(total, stat[max_seti]->ref), has_alt, stat[max_seti]->ref);
+        int sampled = (int)read_list->len;
+        call->seen = stat[max_seti]->seen;
+        call->ref_count = stat[max_seti]->ref_count;
+        call->alt_count = stat[max_seti]->alt_count;
+        call->prob = (has_alt - log_add_exp(total, stat[max_seti]->ref)) * M_1_LN10;
+        call->odds = (has_alt - stat[max_seti]->ref) * M_1_LN10;
+        variant_print(output, v, 0, 0, &call, &depth, &sampled); // the chosen hypothesis, never in the set table
+        if (class_shard != NULL) classify_add_output(v);
         vector_free(v); //variants in var_list so don't destroy
     }
     else { /* Marginal probabilities & likelihood ratios*/
@@ -600,17 +1220,27 @@ static char *evaluate(vector_t *var_set) {
                 if (variant_find(stat[x]->combo, i) != -1 || variant_find(stat[y]->combo, i) != -1) has_alt = log_add_exp(has_alt, prhap->data[seti]);
                 else not_alt = log_add_exp(not_alt, prhap->data[seti]);
             }
-            variant_print(&output, var_set, i, seen, rcount, acount, total, has_alt, not_alt);
+            call[i].seen = seen;
+            call[i].ref_count = rcount;
+            call[i].alt_count = acount;
+            call[i].prob = (has_alt - total) * M_1_LN10;
+            call[i].odds = (has_alt - not_alt) * M_1_LN10;
         }
     }
 
-    if (verbose) {
+    if (class_shard != NULL) {
+        classify_add(read_data, read_list->len, stat, var_data);
+    }
+    if (readinfo_fh != NULL) {
+        readinfo_write(read_data, read_list->len, stat, stats->len, var_data);
+    }
+    else if (verbose) {
         for (readi = 0; readi < read_list->len; readi++) {
             if (read_data[readi]->prgu == 0 && read_data[readi]->prgv == 0 && read_data[readi]->pout == 0) continue; // unprocessed read
             flockfile(stderr);
             fprintf(stderr, "%s\t%s\t%d\t", read_data[readi]->name, read_data[readi]->chr, read_data[readi]->pos);
             fprintf(stderr, "%f\t%f\t%f\t", read_data[readi]->prgu, read_data[readi]->prgv, read_data[readi]->pout);
-            for (i = 0; i < read_data[readi]->n_cigar; i++) fprintf(stderr, "%d%c", read_data[readi]->cigar_oplen[i], read_data[readi]->cigar_opchr[i]);
+            fprintf(stderr, "%s", read_data[readi]->cigar);
             fprintf(stderr, "\t");
             if (read_data[readi]->multimapXA != NULL) fprintf(stderr, "%s\t", read_data[readi]->multimapXA);
             else fprintf(stderr, "%d\t", read_data[readi]->multimapNH);
@@ -630,47 +1260,856 @@ static char *evaluate(vector_t *var_set) {
     vector_free(combo); //not destroyed because previously vector_int_free all elements
     vector_int_free(haplotypes);
     vector_double_free(prhap);
-    vector_destroy(read_list); free(read_list); read_list = NULL;
     vector_destroy(stats); free(stats); stats = NULL;
-    return output;
+}
+
+static char *evaluate(vector_t *var_set, size_t seti, vector_t **read_list, int *nskip, int *depth, kstring_t *output, refwin_cache_t *cache) {
+    /* Output of a set, formatted in the buffer of the calling thread and returned as its own string */
+    size_t i, comboi;
+    int s;
+
+    variant_t **var_data = (variant_t **)var_set->data;
+
+    /* Reads in variant region coordinates */
+    size_t nreads = 0;
+    for (s = 0; s < nsample; s++) nreads += read_list[s]->len + nskip[s];
+    if (nreads == 0) return NULL;
+
+    /* Reference window, every base the reads can be aligned to in the reference or an alternative sequence, 
+       kernels index it by contig position through the view so their results are those of the whole contig */
+    int beg = var_data[0]->pos - 1, end = 0, span = 0, shift = 0;
+    for (i = 0; i < var_set->len; i++) {
+        int ref_length = strlen(var_data[i]->ref), alt_length = strlen(var_data[i]->alt);
+        if (var_data[i]->pos - 1 < beg) beg = var_data[i]->pos - 1;
+        if (var_data[i]->pos + ref_length > end) end = var_data[i]->pos + ref_length;
+        shift += abs(alt_length - ref_length) + 1; // "-" representations included
+    }
+    for (s = 0; s < nsample; s++) {
+        for (i = 0; i < read_list[s]->len; i++) {
+            read_t *r = (read_t *)read_list[s]->data[i];
+            if (r->pos < beg) beg = r->pos;
+            if (r->end > end) end = r->end;
+            if (r->length > span) span = r->length;
+        }
+    }
+    refwin_retire(cache, var_data[0]->chr, beg - span - shift - REFWIN_FLANK);
+    refwin_t *win = refwin_fetch(cache, var_data[0]->chr, beg - span - shift - REFWIN_FLANK, end + 3 * span + shift + REFWIN_FLANK, 1);
+    uint8_t *refseq = refwin_view(win);
+    int refseq_length = win->length;
+    beg = (beg - span - shift - REFWIN_FLANK > 0) ? beg - span - shift - REFWIN_FLANK : 0;
+    end = (end + 3 * span + shift + REFWIN_FLANK < refseq_length) ? end + 3 * span + shift + REFWIN_FLANK : refseq_length;
+
+    /* Variant combinations as a vector of vectors */
+    //vector_t *combo = powerset(var_set->len, maxh);
+    vector_t *combo = all_and_singletons(var_set->len);
+
+    /*
+    for (comboi = 0; comboi < combo->len; comboi++) { // Print combinations
+        fprintf(stderr, "%d\t", (int)comboi); 
+        for (i = 0; i < ((vector_int_t *)combo->data[comboi])->len; i++) { fprintf(stderr, "%d;", ((vector_int_t *)combo->data[comboi])->data[i]); } fprintf(stderr, "\t"); 
+        for (i = 0; i < ((vector_int_t *)combo->data[comboi])->len; i++) { variant_t *v = var_data[((vector_int_t *)combo->data[comboi])->data[i]]; fprintf(stderr, "%s,%d,%s,%s;", v->chr, v->pos, v->ref, v->alt); } fprintf(stderr, "\n"); 
+    }
+    */
+
+    /* Alternative sequences, constructed once for every sample */
+    uint8_t *altbuf[combo->len], *altseq[combo->len]; // buffers over the window, and their views by contig position
+    int altseq_length[combo->len];
+    for (comboi = 0; comboi < combo->len; comboi++) {
+        altbuf[comboi] = combo_altseq((vector_int_t *)combo->data[comboi], var_set, refseq, refseq_length, beg, end, &altseq_length[comboi]);
+        altseq[comboi] = (altbuf[comboi] != NULL) ? altbuf[comboi] - beg : NULL;
+    }
+
+    output->l = 0;
+    call_t *call[nsample];
+    int sampled[nsample];
+    for (s = 0; s < nsample; s++) {
+        call[s] = malloc(var_set->len * sizeof (call_t));
+        sampled[s] = (int)read_list[s]->len;
+        evaluate_sample(var_set, refseq, refseq_length, beg, end, combo, altseq, altseq_length, read_list[s], nskip[s], depth[s], call[s], output, cache);
+    }
+    if (!mvh) { /* Marginal probabilities & likelihood ratios */
+        for (i = 0; i < var_set->len; i++) variant_print(output, var_set, seti, i, call, depth, sampled);
+        if (vcf_calls != NULL) vcf_record(var_set, call);
+    }
+
+    for (s = 0; s < nsample; s++) free(call[s]);
+    for (comboi = 0; comboi < combo->len; comboi++) {
+        free(altbuf[comboi]); altbuf[comboi] = altseq[comboi] = NULL;
+        vector_int_free(combo->data[comboi]);
+    }
+    vector_free(combo); //not destroyed because previously vector_int_free all elements
+    refwin_unref(win);
+    return (output->l > 0) ? strndup(output->s, output->l) : NULL;
 }
 
 typedef struct {
-    vector_t *queue, *results;
+    vector_t *queue;
+    char **results; // reorder buffer: output of each set by set index until written
+    char *set_done;
+    size_t nresults, next_out; // sets done, next set to write
+    int finished; // workers have stopped
+    FILE *out_fh;
+    FILE *ckpt_data, *ckpt_manifest; // checkpoint: set outputs, and the index, offset and length of each once flushed
+    long ckpt_end;
+    kstring_t ckpt_pending; // manifest lines of outputs not yet flushed
+    time_t ckpt_time;
     pthread_mutex_t q_lock;
     pthread_mutex_t r_lock;
+    pthread_cond_t q_ready, q_space; // sweep mode: queue has sets for workers, queue has room for the reader
+    pthread_cond_t r_ready, r_space; // next set to write is done, reorder buffer has room
+    int done; // sweep mode: reader has dispatched all sets
     size_t len;
 } work_t;
 
+typedef struct {
+    vector_t *var_set, *read_list; // sweep mode: reads copied by the reader
+    int nskip, depth;
+    size_t seti; // set index, the output order
+} job_t;
+
+static char *checkpoint_path(const char *suffix) {
+    char *path = malloc(strlen(ckpt_file) + strlen(suffix) + 1);
+    strcpy(path, ckpt_file);
+    strcat(path, suffix);
+    return path;
+}
+
+static u_int32_t checkpoint_fingerprint(const vector_t *var_set) {
+    /* Inputs, options and sets that the output depends on, a checkpoint of another run must not be resumed */
+    size_t i, j;
+    int n = snprintf(NULL, 0, "%s %s %d %d %d %d %d %d %d %d %d %d %d %d %d %g %g %d %d %d %d %d/%d", VERSION, bam_file, rgsplit, sharedr, distlim, maxdist, maxh, mvh, pao, isc, nodup, splice, bisulfite, lowmem, phred64, hetbias, omega, const_qual, min_mapq, maxdepth, dp, shard, nshard) + 1;
+    char opts[n];
+    snprintf(opts, n, "%s %s %d %d %d %d %d %d %d %d %d %d %d %d %d %g %g %d %d %d %d %d/%d", VERSION, bam_file, rgsplit, sharedr, distlim, maxdist, maxh, mvh, pao, isc, nodup, splice, bisulfite, lowmem, phred64, hetbias, omega, const_qual, min_mapq, maxdepth, dp, shard, nshard);
+    u_int32_t fp = fnv_32a_str(opts);
+    for (i = 0; i < var_set->len; i++) {
+        vector_t *curr_set = (vector_t *)var_set->data[i];
+        for (j = 0; j < curr_set->len; j++) {
+            variant_t *v = (variant_t *)curr_set->data[j];
+            fp = (fp ^ fnv_32a_str(v->chr) ^ (u_int32_t)v->pos ^ fnv_32a_str(v->ref) ^ fnv_32a_str(v->alt)) * 16777619; // fnv prime
+        }
+        fp = (fp ^ (u_int32_t)curr_set->len) * 16777619;
+    }
+    return fp;
+}
+
+static size_t checkpoint_resume(work_t *w, u_int32_t fp) {
+    /* Outputs of the sets in the manifest, truncating both files after the last flushed output, 0 if there is no checkpoint */
+    char *data_path = checkpoint_path(".data");
+    char *manifest_path = checkpoint_path(".manifest");
+    FILE *manifest = fopen(manifest_path, "r");
+    if (manifest == NULL) {
+        free(data_path); data_path = NULL;
+        free(manifest_path); manifest_path = NULL;
+        return 0;
+    }
+    FILE *data = fopen(data_path, "r");
+    if (data == NULL) { exit_err("failed to open checkpoint data %s\n", data_path); }
+
+    size_t nloaded = 0;
+    long end = 0;
+    long kept = 0; // manifest bytes up to the last complete line
+    char *line = NULL;
+    ssize_t read_file = 0;
+    size_t line_length = 0;
+    u_int32_t ckpt_fp;
+    size_t ckpt_len;
+    if (getline(&line, &line_length, manifest) == -1 || sscanf(line, "# EAGLE checkpoint\t%x\t%zu", &ckpt_fp, &ckpt_len) != 2) { exit_err("bad checkpoint manifest %s\n", manifest_path); }
+    if (ckpt_fp != fp || ckpt_len != w->len) { exit_err("checkpoint %s is from a run with other inputs or options\n", manifest_path); }
+    kept = ftell(manifest);
+    while ((read_file = getline(&line, &line_length, manifest)) != -1) {
+        size_t seti, length;
+        long offset;
+        if (line[read_file - 1] != '\n' || sscanf(line, "%zu\t%ld\t%zu", &seti, &offset, &length) != 3 || seti >= w->len) break; // partly written
+        kept += read_file;
+        if (w->set_done[seti]) continue;
+
+        char *outstr = malloc(length + 1);
+        if (fseek(data, offset, SEEK_SET) != 0 || fread(outstr, 1, length, data) != length) { exit_err("checkpoint data %s is shorter than its manifest\n", data_path); }
+        outstr[length] = '\0';
+        w->results[seti] = outstr;
+        w->set_done[seti] = 1;
+        if (offset + (long)length > end) end = offset + length;
+        nloaded++;
+    }
+    free(line); line = NULL;
+    fclose(data);
+    fclose(manifest);
+    if (truncate(data_path, end) != 0) { exit_err("failed to truncate checkpoint data %s\n", data_path); }
+    if (truncate(manifest_path, kept) != 0) { exit_err("failed to truncate checkpoint manifest %s\n", manifest_path); } // appended lines must not join a partial one
+    w->ckpt_end = end;
+    free(data_path); data_path = NULL;
+    free(manifest_path); manifest_path = NULL;
+    return nloaded;
+}
+
+static void checkpoint_open(work_t *w, u_int32_t fp, int append) {
+    char *data_path = checkpoint_path(".data");
+    char *manifest_path = checkpoint_path(".manifest");
+    w->ckpt_data = fopen(data_path, append ? "a" : "w");
+    if (w->ckpt_data == NULL) { exit_err("failed to open checkpoint data %s\n", data_path); }
+    w->ckpt_manifest = fopen(manifest_path, append ? "a" : "w");
+    if (w->ckpt_manifest == NULL) { exit_err("failed to open checkpoint manifest %s\n", manifest_path); }
+    if (!append) {
+        w->ckpt_end = 0;
+        fprintf(w->ckpt_manifest, "# EAGLE checkpoint\t%08x\t%zu\n", fp, w->len);
+        fflush(w->ckpt_manifest);
+    }
+    w->ckpt_pending = (kstring_t){0, 0, NULL};
+    w->ckpt_time = time(NULL);
+    free(data_path); data_path = NULL;
+    free(manifest_path); manifest_path = NULL;
+}
+
+static void checkpoint_flush(work_t *w) {
+    /* Outputs are on disk before the manifest lists them */
+    fflush(w->ckpt_data);
+    fsync(fileno(w->ckpt_data));
+    if (w->ckpt_pending.l > 0) {
+        fputs(w->ckpt_pending.s, w->ckpt_manifest);
+        fflush(w->ckpt_manifest);
+        fsync(fileno(w->ckpt_manifest));
+        w->ckpt_pending.l = 0;
+    }
+    w->ckpt_time = time(NULL);
+}
+
+static void checkpoint_close(work_t *w, int remove) {
+    if (w->ckpt_data == NULL) return;
+    checkpoint_flush(w);
+    fclose(w->ckpt_data); w->ckpt_data = NULL;
+    fclose(w->ckpt_manifest); w->ckpt_manifest = NULL;
+    free(w->ckpt_pending.s); w->ckpt_pending.s = NULL;
+    if (remove) { /* Output written, checkpoint no longer needed */
+        char *data_path = checkpoint_path(".data");
+        char *manifest_path = checkpoint_path(".manifest");
+        unlink(data_path);
+        unlink(manifest_path);
+        free(data_path); data_path = NULL;
+        free(manifest_path); manifest_path = NULL;
+    }
+}
+
+static void result_add(work_t *w, size_t seti, char *outstr) {
+    /* Output of a set by its index, also appended to the checkpoint, empty if the set had no reads */
+    if (outstr == NULL) outstr = strdup("");
+    size_t length = strlen(outstr);
+
+    pthread_mutex_lock(&w->r_lock);
+    while (seti >= w->next_out + REORDER_MAX) pthread_cond_wait(&w->r_space, &w->r_lock); // too far ahead of the writer
+    size_t n = w->len / 10;
+    if (!verbose && n > 10 && w->nresults > 10 && w->nresults % n == 0) {
+        print_status("# Progress: %zd%%: %zd / %zd\t%s", 10 * w->nresults / n, w->nresults, w->len - w->nresults, asctime(time_info));
+    }
+    w->results[seti] = outstr;
+    w->set_done[seti] = 1;
+    w->nresults++;
+    if (seti == w->next_out) pthread_cond_signal(&w->r_ready);
+    if (w->ckpt_data != NULL) {
+        if (fwrite(outstr, 1, length, w->ckpt_data) != length) { exit_err("failed to write checkpoint data\n"); }
+        ksprintf(&w->ckpt_pending, "%zu\t%ld\t%zu\n", seti, w->ckpt_end, length);
+        w->ckpt_end += length;
+        if (terminated || time(NULL) - w->ckpt_time >= CHECKPOINT_SEC) checkpoint_flush(w);
+    }
+    pthread_mutex_unlock(&w->r_lock);
+}
+
+static void output_header(FILE *out_fh) {
+    if (nshard > 0) fprintf(out_fh, "# Shard: %d/%d\n", shard, nshard);
+    if (nsample == 1) {
+        fprintf(out_fh, "# SEQ\tPOS\tREF\tALT\tReads\tRefReads\tAltReads\tProb\tOdds\tSet%s\n", (maxdepth > 0) ? "\tDepth\tSampled" : "");
+    }
+    else { /* Columns of each sample prefixed with its name */
+        int i;
+        fprintf(out_fh, "# SEQ\tPOS\tREF\tALT");
+        for (i = 0; i < nsample; i++) {
+            char *n = samples[i].name;
+            fprintf(out_fh, "\t%s:Reads\t%s:RefReads\t%s:AltReads\t%s:Prob\t%s:Odds", n, n, n, n, n);
+        }
+        fprintf(out_fh, "\tSet");
+        for (i = 0; i < nsample && maxdepth > 0; i++) fprintf(out_fh, "\t%s:Depth\t%s:Sampled", samples[i].name, samples[i].name);
+        fprintf(out_fh, "\n");
+    }
+}
+
+static void *writer(void *work) {
+    /* Output in set order as soon as the next set is done, each output freed once written */
+    work_t *w = (work_t *)work;
+
+    pthread_mutex_lock(&w->r_lock);
+    while (w->next_out < w->len) {
+        char *outstr = w->results[w->next_out];
+        if (outstr == NULL) {
+            if (w->finished) break; // terminated, the rest is left for --resume
+            pthread_cond_wait(&w->r_ready, &w->r_lock);
+            continue;
+        }
+        w->results[w->next_out] = NULL;
+        pthread_mutex_unlock(&w->r_lock);
+        fputs(outstr, w->out_fh);
+        free(outstr); outstr = NULL;
+        pthread_mutex_lock(&w->r_lock);
+        w->next_out++;
+        pthread_cond_broadcast(&w->r_space);
+    }
+    pthread_mutex_unlock(&w->r_lock);
+    return NULL;
+}
+
 static void *pool(void *work) {
     work_t *w = (work_t *)work;
 
-    size_t n = w->len / 10;
+    int f, s;
+    bam_hts_t *h[nbam]; // per thread bam handles, reused for every set
+    for (f = 0; f < nbam; f++) h[f] = bam_hts_create(bam_files[f], fa_file, &tpool, bam_shared);
+
+    kstring_t output = {0, 0, NULL};
+    refwin_cache_t cache;
+    refwin_cache_init(&cache);
     while (1) { //pthread_t ptid = pthread_self(); uint64_t threadid = 0; memcpy(&threadid, &ptid, min(sizeof (threadid), sizeof (ptid)));
         pthread_mutex_lock(&w->q_lock);
-        vector_t *var_set = (vector_t *)vector_pop(w->queue);
+        job_t *job = (job_t *)vector_pop(w->queue);
         pthread_mutex_unlock(&w->q_lock);
-        if (var_set == NULL) break;
-        
-        char *outstr = evaluate(var_set);
-        if (outstr != NULL) {
-            pthread_mutex_lock(&w->r_lock);
-            if (!verbose && n > 10 && w->results->len > 10 && w->results->len % n == 0) {
-                print_status("# Progress: %zd%%: %zd / %zd\t%s", 10 * w->results->len / n, w->results->len, w->queue->len, asctime(time_info));
-            }
-            vector_add(w->results, outstr);
-            pthread_mutex_unlock(&w->r_lock);
+        if (job == NULL) break;
+        vector_t *var_set = job->var_set;
+        if (terminated) { /* Drain the queue */
+            vector_free(var_set); //variants in var_list so don't destroy
+            free(job); job = NULL;
+            continue;
         }
+
+        vector_t *read_list[nsample];
+        int nskip[nsample], depth[nsample];
+        for (s = 0; s < nsample; s++) {
+            read_list[s] = vector_create(64, READ_T);
+            nskip[s] = 0;
+            depth[s] = 0;
+        }
+        for (f = 0; f < nbam; f++) bam_fetch(h[f], f, var_set, read_list, nskip, depth);
+        char *outstr = evaluate(var_set, job->seti, read_list, nskip, depth, &output, &cache);
+        for (s = 0; s < nsample; s++) { vector_destroy(read_list[s]); free(read_list[s]); read_list[s] = NULL; }
+        result_add(w, job->seti, outstr);
         vector_free(var_set); //variants in var_list so don't destroy
+        free(job); job = NULL;
+    }
+    for (f = 0; f < nbam; f++) { bam_hts_destroy(h[f]); free(h[f]); h[f] = NULL; }
+    free(output.s); output.s = NULL;
+    refwin_cache_destroy(&cache);
+    return NULL;
+}
+
+static void *sweep_pool(void *work) {
+    work_t *w = (work_t *)work;
+
+    kstring_t output = {0, 0, NULL};
+    refwin_cache_t cache;
+    refwin_cache_init(&cache);
+    while (1) {
+        pthread_mutex_lock(&w->q_lock);
+        while (w->queue->len == 0 && !w->done) pthread_cond_wait(&w->q_ready, &w->q_lock);
+        job_t *job = NULL;
+        if (w->queue->len > 0) { // first in first out, the earliest set is never left behind the reorder buffer
+            job = (job_t *)w->queue->data[0];
+            vector_del(w->queue, 0);
+        }
+        pthread_cond_signal(&w->q_space);
+        pthread_mutex_unlock(&w->q_lock);
+        if (job == NULL) break;
+
+        if (!terminated) result_add(w, job->seti, evaluate(job->var_set, job->seti, &job->read_list, &job->nskip, &job->depth, &output, &cache)); // single sample
+        vector_free(job->var_set); //variants in var_list so don't destroy
+        vector_destroy(job->read_list); free(job->read_list);
+        free(job); job = NULL;
     }
+    free(output.s); output.s = NULL;
+    refwin_cache_destroy(&cache);
     return NULL;
 }
 
+static inline int set_first(const vector_t *var_set) { return ((variant_t *)var_set->data[0])->pos; }
+static inline int set_last(const vector_t *var_set) { return ((variant_t *)var_set->data[var_set->len - 1])->pos; }
+
+static int nat_sort_set(const void *a, const void *b) {
+    vector_t *s1 = *(vector_t **)a;
+    vector_t *s2 = *(vector_t **)b;
+    /* Total order so the output is the same whatever order the sets were built in: position, span, alleles, then the variants themselves */
+    int cmp = nat_sort_variant(&s1->data[0], &s2->data[0]);
+    if (cmp == 0) cmp = (set_last(s1) > set_last(s2)) - (set_last(s1) < set_last(s2));
+    if (cmp != 0) return cmp;
+    variant_t *v1 = (variant_t *)s1->data[0];
+    variant_t *v2 = (variant_t *)s2->data[0];
+    cmp = strcmp(v1->ref, v2->ref);
+    if (cmp == 0) cmp = strcmp(v1->alt, v2->alt);
+    size_t i;
+    for (i = 0; cmp == 0 && i < s1->len && i < s2->len; i++) { // index is the position in the sorted variant list, unique per variant
+        size_t i1 = ((variant_t *)s1->data[i])->index;
+        size_t i2 = ((variant_t *)s2->data[i])->index;
+        cmp = (i1 > i2) - (i1 < i2);
+    }
+    if (cmp == 0) cmp = (s1->len > s2->len) - (s1->len < s2->len);
+    return cmp;
+}
+
+static void sweep_dispatch(work_t *w, vector_t *curr, size_t seti, vector_t *window, vector_int_t *window_beg, vector_int_t *window_end) {
+    /* Copy the window reads the index query of this set would return, in file order, and queue for evaluation */
+    size_t i;
+    int beg = set_first(curr) - 1;
+    int end = set_last(curr);
+    if (terminated || w->set_done[seti]) { /* Stopping, or done before resuming */
+        vector_free(curr); //variants in var_list so don't destroy
+        return;
+    }
+
+    job_t *job = malloc(sizeof (job_t));
+    job->var_set = curr;
+    job->read_list = vector_create(64, READ_T);
+    job->nskip = 0;
+    job->depth = 0;
+    job->seti = seti;
+    u_int64_t seed = reservoir_seed(curr);
+    for (i = 0; i < window->len; i++) {
+        if (window_beg->data[i] < end && window_end->data[i] > beg) {
+            read_t *r = (read_t *)window->data[i];
+            if (read_skipped(r->pos, r->end, curr)) {
+                job->nskip++;
+                continue;
+            }
+            int slot = reservoir_slot(&seed, ++job->depth);
+            if (slot >= 0) reservoir_add(job->read_list, slot, read_dup(r));
+        }
+    }
+
+    pthread_mutex_lock(&w->q_lock);
+    while (w->queue->len >= 4 * nthread) pthread_cond_wait(&w->q_space, &w->q_lock);
+    vector_add(w->queue, job);
+    pthread_cond_signal(&w->q_ready);
+    pthread_mutex_unlock(&w->q_lock);
+}
+
+static void sweep_evict(vector_t *window, vector_int_t *window_beg, vector_int_t *window_end, int beg) {
+    /* Drop reads that end before the first pending set, keeping file order */
+    size_t i, j;
+    for (i = 0, j = 0; i < window->len; i++) {
+        if (window_end->data[i] <= beg) {
+            read_destroy((read_t *)window->data[i]); free(window->data[i]); window->data[i] = NULL;
+            continue;
+        }
+        window->data[j] = window->data[i];
+        window_beg->data[j] = window_beg->data[i];
+        window_end->data[j] = window_end->data[i];
+        j++;
+    }
+    window->len = window_beg->len = window_end->len = j;
+}
+
+static void sweep(vector_t *var_set, work_t *w, bam_hts_t *h) {
+    /* Chromosome sweep: stream each region of nearby sets once with a sliding window of decoded reads, 
+       dispatching a set as soon as the stream has passed its last variant, sets are in sorted order */
+    size_t i, j, k;
+
+    vector_t *window = vector_create(64, READ_T);
+    vector_int_t *window_beg = vector_int_create(64);
+    vector_int_t *window_end = vector_int_create(64);
+
+    i = 0;
+    while (i < var_set->len) {
+        vector_t **set_data = (vector_t **)var_set->data;
+        char *chr = ((variant_t *)set_data[i]->data[0])->chr;
+
+        /* Region of consecutive sets on the same chromosome, split where the gap is too wide to be worth decoding */
+        int beg = set_first(set_data[i]);
+        int end = set_last(set_data[i]);
+        for (j = i + 1; j < var_set->len; j++) {
+            if (strcmp(chr, ((variant_t *)set_data[j]->data[0])->chr) != 0 || set_first(set_data[j]) - end > SWEEP_GAP) break;
+            if (set_last(set_data[j]) > end) end = set_last(set_data[j]);
+        }
+
+        int pending = 0;
+        for (k = i; k < j; k++) {
+            if (!w->set_done[k]) pending = 1;
+        }
+
+        k = i; // next set to dispatch
+        int tid = bam_name2id(h->bam_header, chr);
+        hts_itr_t *iter = (terminated || !pending) ? NULL : sam_itr_queryi(h->bam_idx, tid, beg - 1, end); // read iterator
+        if (iter != NULL) {
+            while (!terminated && sam_itr_next(h->sam_in, iter, h->aln) >= 0) {
+                int pos = h->aln->core.pos;
+                if (k < j && set_last(set_data[k]) <= pos) {
+                    for (; k < j && set_last(set_data[k]) <= pos; k++) sweep_dispatch(w, set_data[k], k, window, window_beg, window_end); // stream passed the last variant
+                    if (k < j) sweep_evict(window, window_beg, window_end, set_first(set_data[k]) - 1);
+                }
+                if (k == j) break;
+
+                int pos_end = bam_endpos(h->aln);
+                if (pos_end <= set_first(set_data[k]) - 1) continue; // ends before any pending set, don't decode
+                if (read_filter(h->aln, pao, nodup, min_mapq)) continue;
+
+                read_t *read = read_fetch(h->bam_header, h->aln, pao, isc, nodup, splice, phred64, const_qual, verbose || classify_prefix != NULL || debug >= 2);
+                if (read == NULL) continue;
+                vector_add(window, read);
+                vector_int_add(window_beg, pos);
+                vector_int_add(window_end, pos_end);
+            }
+        }
+        hts_itr_destroy(iter);
+        for (; k < j; k++) sweep_dispatch(w, set_data[k], k, window, window_beg, window_end);
+        sweep_evict(window, window_beg, window_end, INT_MAX);
+        i = j;
+    }
+    vector_destroy(window); free(window); window = NULL;
+    vector_int_free(window_beg);
+    vector_int_free(window_end);
+
+    pthread_mutex_lock(&w->q_lock);
+    w->done = 1;
+    pthread_cond_broadcast(&w->q_ready);
+    pthread_mutex_unlock(&w->q_lock);
+}
+
+typedef struct {
+    const vector_t *var_list;
+    int file; // index in bam_files
+    int *last; // per variant, end of the last read in file order overlapping it
+    vector_int_t *chunk; // var_list index where each region of nearby variants starts
+    size_t next;
+    pthread_mutex_t lock;
+} extent_t;
+
+static void *extent_pool(void *work) {
+    /* Single pass over the reads of each region, giving the same value as an index query at every variant position */
+    extent_t *e = (extent_t *)work;
+    variant_t **var_data = (variant_t **)e->var_list->data;
+
+    bam_hts_t *h = bam_hts_create(bam_files[e->file], fa_file, &tpool, bam_shared);
+    vector_int_t *stack_end = vector_int_create(64); // bam end of candidate reads, strictly decreasing to the top
+    vector_int_t *stack_last = vector_int_create(64); // pos + l_qseq of candidate reads
+    while (1) {
+        pthread_mutex_lock(&e->lock);
+        size_t c = e->next++;
+        pthread_mutex_unlock(&e->lock);
+        if (c + 1 >= e->chunk->len) break;
+
+        size_t i = e->chunk->data[c];
+        size_t n = e->chunk->data[c + 1];
+        for (; i < n; i++) e->last[i] = -1;
+        i = e->chunk->data[c];
+
+        stack_end->len = stack_last->len = 0;
+        int tid = bam_name2id(h->bam_header, var_data[i]->chr);
+        hts_itr_t *iter = sam_itr_queryi(h->bam_idx, tid, var_data[i]->pos - 1, var_data[n - 1]->pos); // read iterator
+        if (iter == NULL) continue;
+        while (i < n) {
+            int r = sam_itr_next(h->sam_in, iter, h->aln);
+            int pos = (r >= 0) ? h->aln->core.pos : INT_MAX;
+            while (i < n && var_data[i]->pos - 1 < pos) { // every read starting before this variant has been seen
+                while (stack_end->len > 0 && stack_end->data[stack_end->len - 1] <= var_data[i]->pos - 1) { // ends before, and so before every later variant
+                    stack_end->len--;
+                    stack_last->len--;
+                }
+                if (stack_end->len > 0) e->last[i] = stack_last->data[stack_last->len - 1];
+                i++;
+            }
+            if (r < 0) break;
+            if (h->aln->core.tid < 0) continue; // not mapped
+
+            int end = bam_endpos(h->aln);
+            while (stack_end->len > 0 && stack_end->data[stack_end->len - 1] <= end) { // superseded by a later read ending no earlier
+                stack_end->len--;
+                stack_last->len--;
+            }
+            vector_int_add(stack_end, end);
+            vector_int_add(stack_last, pos + h->aln->core.l_qseq);
+        }
+        hts_itr_destroy(iter);
+    }
+    vector_int_free(stack_end);
+    vector_int_free(stack_last);
+    bam_hts_destroy(h); free(h); h = NULL;
+    return NULL;
+}
+
+static double set_cost(const vector_t *curr) {
+    /* Estimated evaluation cost of a set, its number of hypotheses: all, singles and up to maxh derived combinations */
+    double n = curr->len + 1;
+    if (curr->len > 1) {
+        double derived = (curr->len < 31) ? (double)(1 << curr->len) - curr->len - 1 : maxh;
+        n += (derived < maxh) ? derived : maxh;
+    }
+    return n;
+}
+
+static void settable_write(const vector_t *var_set) {
+    /* Each set of several variants once, by the id in the Set column, the ids of all sets before --shard selects its own */
+    size_t i;
+    kstring_t ks = {0, 0, NULL};
+    for (i = 0; i < var_set->len; i++) {
+        vector_t *curr_set = (vector_t *)var_set->data[i];
+        if (curr_set->len == 1) continue;
+        ks.l = 0;
+        ksprintf(&ks, "%zu\t", set_offset + i);
+        set_print(&ks, curr_set);
+        kputc('\n', &ks);
+        if (fwrite(ks.s, 1, ks.l, settable_fh) != ks.l) { exit_err("failed to write set table %s\n", settable_file); }
+        settable_nsets++;
+    }
+    free(ks.s); ks.s = NULL;
+}
+
+static void shard_select(vector_t *var_set) {
+    /* Keep this shard's contiguous run of the sorted sets, whole sets balanced by estimated cost, 
+       every shard run computes the same partition so that concatenated outputs equal a single run */
+    size_t i, j;
+    double total = 0;
+    for (i = 0; i < var_set->len; i++) total += set_cost((vector_t *)var_set->data[i]);
+
+    double cum = 0;
+    double kept = 0;
+    for (i = 0, j = 0; i < var_set->len; i++) {
+        vector_t *curr_set = (vector_t *)var_set->data[i];
+        double cost = set_cost(curr_set);
+        int k = (int)((cum + cost / 2) * nshard / total); // shard of the set midpoint
+        if (k >= nshard) k = nshard - 1;
+        cum += cost;
+        if (k != shard - 1) {
+            vector_free(curr_set); //variants in var_list so don't destroy
+            continue;
+        }
+        kept += cost;
+        if (j == 0) set_base = set_offset + i;
+        var_set->data[j++] = curr_set;
+    }
+    var_set->len = j;
+    print_status("# Shard: %d/%d\t%zd sets\t%.0f of %.0f estimated cost\t%s", shard, nshard, var_set->len, kept, total, asctime(time_info));
+}
+
+static int *read_extent(const vector_t *var_list) {
+    /* End of the last read overlapping each variant, computed per region of nearby variants in parallel, 
+       the furthest over all alignment files so that every sample groups the same sets */
+    size_t i;
+    int f;
+    variant_t **var_data = (variant_t **)var_list->data;
+
+    extent_t *e = malloc(sizeof (extent_t));
+    e->var_list = var_list;
+    e->last = malloc(var_list->len * sizeof (int));
+    e->chunk = vector_int_create(64);
+    for (i = 0; i < var_list->len; i++) {
+        if (i == 0 || strcmp(var_data[i]->chr, var_data[i - 1]->chr) != 0 || var_data[i]->pos - var_data[i - 1]->pos > SWEEP_GAP) vector_int_add(e->chunk, i);
+    }
+    vector_int_add(e->chunk, var_list->len);
+
+    int *last = malloc(var_list->len * sizeof (int));
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_t tid[nthread];
+    for (f = 0; f < nbam; f++) {
+        e->file = f;
+        e->next = 0;
+        for (i = 0; i < nthread; i++) pthread_create(&tid[i], NULL, extent_pool, e);
+        for (i = 0; i < nthread; i++) pthread_join(tid[i], NULL);
+        for (i = 0; i < var_list->len; i++) {
+            if (f == 0 || e->last[i] > last[i]) last[i] = e->last[i];
+        }
+    }
+    pthread_mutex_destroy(&e->lock);
+
+    free(e->last); e->last = NULL;
+    vector_int_free(e->chunk);
+    free(e); e = NULL;
+    return last;
+}
+
+typedef struct {
+    double units;
+    size_t seti;
+} plan_set_t;
+
+static int plan_cmp(const void *a, const void *b) {
+    double x = ((const plan_set_t *)a)->units;
+    double y = ((const plan_set_t *)b)->units;
+    return (x > y) - (x < y);
+}
+
+static inline double plan_width(const vector_t *curr, double readlen) {
+    return set_last(curr) - set_first(curr) + 1 + readlen; // reads overlapping the set
+}
+
+static void plan(const vector_t *var_set, FILE *out_fh) {
+    /* Estimated cost of the run as grouped, without evaluating it: reads fetched for a sample of sets and estimated 
+       from their density for the rest, hypotheses as set_cost, and the time per read, base and hypothesis measured 
+       by evaluating a few sampled sets of median cost */
+    size_t i, j, n = var_set->len;
+    int f, s;
+    double *reads = calloc(n + 1, sizeof (double));
+    char *sampled = calloc(n + 1, sizeof (char));
+
+    bam_hts_t *h[nbam];
+    for (f = 0; f < nbam; f++) h[f] = bam_hts_create(bam_files[f], fa_file, &tpool, bam_shared);
+
+    size_t step = (n > PLAN_SAMPLE) ? n / PLAN_SAMPLE : 1;
+    size_t nsampled = 0;
+    double readlen_sum = 0, readlen_n = 0;
+    for (i = 0; i < n; i += step) {
+        vector_t *curr = (vector_t *)var_set->data[i];
+        vector_t *read_list[nsample];
+        int nskip[nsample], depth[nsample];
+        for (s = 0; s < nsample; s++) {
+            read_list[s] = vector_create(64, READ_T);
+            nskip[s] = depth[s] = 0;
+        }
+        for (f = 0; f < nbam; f++) bam_fetch(h[f], f, curr, read_list, nskip, depth);
+        for (s = 0; s < nsample; s++) {
+            reads[i] += read_list[s]->len;
+            for (j = 0; j < read_list[s]->len; j++) readlen_sum += ((read_t *)read_list[s]->data[j])->length;
+            readlen_n += read_list[s]->len;
+            vector_destroy(read_list[s]); free(read_list[s]); read_list[s] = NULL;
+        }
+        sampled[i] = 1;
+        nsampled++;
+    }
+    double readlen = (readlen_n > 0) ? readlen_sum / readlen_n : 100;
+
+    /* Reads of the other sets from the read density of the sampled sets of their contig, else of all */
+    double all_reads = 0, all_width = 0;
+    for (i = 0; i < n; i++) {
+        if (!sampled[i]) continue;
+        all_reads += reads[i];
+        all_width += plan_width((vector_t *)var_set->data[i], readlen);
+    }
+    size_t b;
+    for (i = 0; i < n; i = b) {
+        const char *chr = ((variant_t *)((vector_t *)var_set->data[i])->data[0])->chr;
+        double chr_reads = 0, chr_width = 0;
+        for (b = i; b < n && strcmp(((variant_t *)((vector_t *)var_set->data[b])->data[0])->chr, chr) == 0; b++) {
+            if (!sampled[b]) continue;
+            chr_reads += reads[b];
+            chr_width += plan_width((vector_t *)var_set->data[b], readlen);
+        }
+        double density = (chr_width > 0) ? chr_reads / chr_width : ((all_width > 0) ? all_reads / all_width : 0);
+        for (j = i; j < b; j++) {
+            if (!sampled[j]) reads[j] = density * plan_width((vector_t *)var_set->data[j], readlen);
+        }
+    }
+
+    /* Work units, reads x read length x hypotheses, timed on sampled sets around the median */
+    plan_set_t *cost = malloc((n + 1) * sizeof (plan_set_t));
+    plan_set_t *sample = malloc((nsampled + 1) * sizeof (plan_set_t));
+    size_t k = 0;
+    double total_units = 0;
+    for (i = 0; i < n; i++) {
+        cost[i].units = set_cost((vector_t *)var_set->data[i]) * reads[i] * readlen;
+        cost[i].seti = i;
+        total_units += cost[i].units;
+        if (sampled[i] && cost[i].units > 0) sample[k++] = cost[i];
+    }
+    qsort(sample, k, sizeof (plan_set_t), plan_cmp);
+    size_t c_beg = (k > PLAN_CALIBRATE) ? (k - PLAN_CALIBRATE) / 2 : 0;
+    size_t c_end = (k > PLAN_CALIBRATE) ? c_beg + PLAN_CALIBRATE : k;
+    double c_units = 0, c_sec = 0;
+    kstring_t output = {0, 0, NULL};
+    refwin_cache_t cache;
+    refwin_cache_init(&cache);
+    for (j = c_beg; j < c_end; j++) {
+        vector_t *curr = (vector_t *)var_set->data[sample[j].seti];
+        vector_t *read_list[nsample];
+        int nskip[nsample], depth[nsample];
+        for (s = 0; s < nsample; s++) {
+            read_list[s] = vector_create(64, READ_T);
+            nskip[s] = depth[s] = 0;
+        }
+        clock_t tic = clock();
+        for (f = 0; f < nbam; f++) bam_fetch(h[f], f, curr, read_list, nskip, depth);
+        char *outstr = evaluate(curr, sample[j].seti, read_list, nskip, depth, &output, &cache);
+        c_sec += (double)(clock() - tic) / CLOCKS_PER_SEC;
+        c_units += sample[j].units;
+        free(outstr); outstr = NULL;
+        for (s = 0; s < nsample; s++) { vector_destroy(read_list[s]); free(read_list[s]); read_list[s] = NULL; }
+    }
+    for (f = 0; f < nbam; f++) { bam_hts_destroy(h[f]); free(h[f]); h[f] = NULL; }
+    free(output.s); output.s = NULL;
+    refwin_cache_destroy(&cache);
+    double sec_per_unit = (c_units > 0) ? c_sec / c_units : 0;
+
+    /* Memory of a set in flight: reads, a likelihood per read for every hypothesis, and copies of the reference window as 
+       alternative sequences for indels or dp, the shared ones and one derived at a time */
+    double peak = 0, max_reads = 0, max_hyp = 0, sum_hyp = 0, sum_reads = 0, max_win = 0;
+    const char *prev_chr = NULL;
+    int contig_len = 0;
+    for (i = 0; i < n; i++) {
+        vector_t *curr = (vector_t *)var_set->data[i];
+        variant_t **var_data = (variant_t **)curr->data;
+        if (prev_chr == NULL || strcmp(prev_chr, var_data[0]->chr) != 0) {
+            prev_chr = var_data[0]->chr;
+            int id = (refmap != NULL) ? refmap_name2id(refmap, prev_chr) : -1;
+            contig_len = (refmap != NULL) ? ((id >= 0) ? (int)refmap->contig[id].length : 0) : faidx_seq_len(refseq_fai, prev_chr);
+        }
+        double win = plan_width(curr, readlen) + 4 * readlen + 2 * REFWIN_FLANK;
+        if (win > contig_len) win = contig_len;
+        if (win > max_win) max_win = win;
+        double hyp = set_cost(curr);
+        int has_indel = 0;
+        for (j = 0; j < curr->len; j++) {
+            if (strlen(var_data[j]->ref) != strlen(var_data[j]->alt)) has_indel = 1;
+        }
+        double naltseq = (dp || (!lowmem && has_indel)) ? ((curr->len == 1) ? 1 : curr->len + 2) : 0;
+        double mem = reads[i] * (sizeof (read_t) + 1.5 * readlen + 16)
+                   + hyp * (sizeof (stats_t) + sizeof (vector_int_t) + sizeof (vector_double_t) + reads[i] * sizeof (double) + curr->len * sizeof (int))
+                   + naltseq * win;
+        if (mem > peak) peak = mem;
+        if (reads[i] > max_reads) max_reads = reads[i];
+        if (hyp > max_hyp) max_hyp = hyp;
+        sum_hyp += hyp;
+        sum_reads += reads[i];
+    }
+    double refwin = (refmap != NULL) ? 0 : REFWIN_SLOTS * (max_win + 2 * REFWIN_PAD); // windows cached by a thread, a reference map is shared in the page cache
+    if (refmem > 0 && refwin > (double)refmem * 1048576 / nthread) refwin = (double)refmem * 1048576 / nthread;
+    double refcache = refwin * ((nthread < 2) ? 1 : nthread);
+
+    /* Threads by cores and memory, shards by a day of wall clock each */
+    double cpu_hours = total_units * sec_per_unit / 3600;
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    double physmem = (double)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+    long threads = (ncpu > 0) ? ncpu : 1;
+    if (peak > 0) {
+        double by_mem = physmem / (peak + refwin);
+        if (by_mem < threads) threads = (by_mem < 1) ? 1 : (long)by_mem;
+    }
+    long shards = (long)ceil(cpu_hours / (threads * PLAN_SHARD_HOURS));
+    if (shards < 1) shards = 1;
+
+    qsort(cost, n, sizeof (plan_set_t), plan_cmp);
+    fprintf(out_fh, "# EAGLE plan, estimated before evaluation\n");
+    fprintf(out_fh, "Sets\t%zd\n", n);
+    fprintf(out_fh, "Sets sampled\t%zd\t%zd timed\n", nsampled, c_end - c_beg);
+    fprintf(out_fh, "Read length\t%.1f\n", readlen);
+    fprintf(out_fh, "Reads per set\tmean %.1f\tmax %.0f\n", (n > 0) ? sum_reads / n : 0, max_reads);
+    fprintf(out_fh, "Hypotheses per set\tmean %.1f\tmax %.0f\n", (n > 0) ? sum_hyp / n : 0, max_hyp);
+    fprintf(out_fh, "CPU hours\t%.2f\n", cpu_hours);
+    fprintf(out_fh, "Peak memory per thread (MB)\t%.1f\n", peak / 1048576);
+    fprintf(out_fh, "Reference cache (MB)\t%.1f\n", refcache / 1048576);
+    fprintf(out_fh, "Recommended threads\t%ld\n", threads);
+    fprintf(out_fh, "Recommended shards\t%ld\n", shards);
+    fprintf(out_fh, "# Worst sets: region, variants, hypotheses, reads, CPU seconds\n");
+    for (j = 0; j < PLAN_WORST && j < n; j++) {
+        plan_set_t *p = &cost[n - 1 - j];
+        vector_t *curr = (vector_t *)var_set->data[p->seti];
+        fprintf(out_fh, "%s:%d-%d\t%zd\t%.0f\t%.0f\t%.1f\n", ((variant_t *)curr->data[0])->chr, set_first(curr), set_last(curr), curr->len, set_cost(curr), reads[p->seti], p->units * sec_per_unit);
+        if (p->units * sec_per_unit > PLAN_SHARD_HOURS * 3600) fprintf(out_fh, "# this set alone exceeds %d hours, consider lower --maxh, --distlim or --maxdist\n", PLAN_SHARD_HOURS);
+    }
+    print_status("# Plan: %zd sets\t%.2f CPU hours\t%s", n, cpu_hours, asctime(time_info));
+    free(cost); cost = NULL;
+    free(sample); sample = NULL;
+    free(reads); reads = NULL;
+    free(sampled); sampled = NULL;
+}
+
 static void process(const vector_t *var_list, FILE *out_fh) {
     size_t i, j;
 
     variant_t **var_data = (variant_t **)var_list->data;
 
+    int *last = NULL;
+    if (sharedr == 1 || sharedr == 2) last = read_extent(var_list);
+
     i = 0;
     vector_t *var_set = vector_create(var_list->len, VOID_T);
     if (sharedr == 1) { /* Variants that share a read: shared with a given first variant */
@@ -679,7 +2118,7 @@ static void process(const vector_t *var_list, FILE *out_fh) {
             vector_add(curr, var_data[i]);
 
             /* Reads in variant i region coordinates */
-            int i_last = bam_fetch_last(bam_file, var_data[i]->chr, var_data[i]->pos, var_data[i]->pos);
+            int i_last = last[i];
 
             j = i + 1;
             while (j < var_list->len && strcmp(var_data[i]->chr, var_data[j]->chr) == 0) { // while last read in i will reach j
@@ -698,7 +2137,7 @@ static void process(const vector_t *var_list, FILE *out_fh) {
             j = i + 1;
             while (j < var_list->len && strcmp(var_data[i]->chr, var_data[j]->chr) == 0) { // while last read in i will reach j
                 /* Reads in variant i region coordinates */
-                int i_last = bam_fetch_last(bam_file, var_data[i]->chr, var_data[i]->pos, var_data[i]->pos);
+                int i_last = last[i];
                 if (var_data[j]->pos > i_last) break;
                 vector_add(curr, var_data[j]);
                 i++;
@@ -721,6 +2160,8 @@ static void process(const vector_t *var_list, FILE *out_fh) {
             vector_add(var_set, curr);
         }
     }
+    free(last); last = NULL;
+
     /* Heterozygous non-reference variants as separate entries */
     int flag_add = 1;
     while (flag_add) {
@@ -784,61 +2225,177 @@ static void process(const vector_t *var_list, FILE *out_fh) {
             }
         }
     }
+    if (exclude_hash != NULL) { /* Skip sets with any variant in an excluded region */
+        size_t nexcluded = 0;
+        for (i = 0, j = 0; i < var_set->len; i++) {
+            vector_t *curr_set = (vector_t *)var_set->data[i];
+            size_t k;
+            for (k = 0; k < curr_set->len; k++) {
+                variant_t *v = (variant_t *)curr_set->data[k];
+                if (bed_find(exclude_hash, v->chr, v->pos)) break;
+            }
+            if (k < curr_set->len) {
+                vector_free(curr_set); //variants in var_list so don't destroy
+                nexcluded++;
+                continue;
+            }
+            var_set->data[j++] = curr_set;
+        }
+        var_set->len = j;
+        print_status("# Excluded: %zd sets\t%s", nexcluded, asctime(time_info));
+    }
+    if (region_hash != NULL) { /* Keep sets whose first variant is in a region, so each set is evaluated whole by exactly one run */
+        for (i = 0, j = 0; i < var_set->len; i++) {
+            vector_t *curr_set = (vector_t *)var_set->data[i];
+            variant_t *v = (variant_t *)curr_set->data[0];
+            if (!bed_find(region_hash, v->chr, v->pos)) {
+                vector_free(curr_set); //variants in var_list so don't destroy
+                continue;
+            }
+            var_set->data[j++] = curr_set;
+        }
+        var_set->len = j;
+        print_status("# Sets in regions: %zd\t%s", var_set->len, asctime(time_info));
+    }
+    qsort(var_set->data, var_set->len, sizeof (void *), nat_sort_set); // set order is the output order
+    set_base = set_offset;
+    if (settable_fh != NULL) settable_write(var_set);
+    size_t nsets = var_set->len;
+    if (nshard > 0) shard_select(var_set);
+    set_offset += nsets;
     if (sharedr == 1) { print_status("# Variants with shared reads to first in set: %i entries\t%s", (int)var_set->len, asctime(time_info)); }
     else if (sharedr == 2) { print_status("# Variants with shared reads to any in set: %i entries\t%s", (int)var_set->len, asctime(time_info)); }
     else { print_status("# Variants within %d (max window: %d) bp: %i entries\t%s", distlim, maxdist, (int)var_set->len, asctime(time_info)); }
 
-    print_status("# Options: maxh=%d mvh=%d pao=%d isc=%d nodup=%d splice=%d bs=%d lowmem=%d phred64=%d\n", maxh, mvh, pao, isc, nodup, splice, bisulfite, lowmem, phred64);
+    print_status("# Options: maxh=%d mvh=%d pao=%d isc=%d nodup=%d splice=%d bs=%d lowmem=%d phred64=%d sweep=%d rg=%d\n", maxh, mvh, pao, isc, nodup, splice, bisulfite, lowmem, phred64, sweep_mode, rgsplit);
     print_status("#          dp=%d gap_op=%d gap_ex=%d\n", dp, gap_op, gap_ex);
-    print_status("#          hetbias=%g omega=%g cq=%d\n", hetbias, omega, const_qual);
-    print_status("#          verbose=%d\n", verbose);
-    print_status("# Start: %d threads \t%s\t%s", nthread, bam_file, asctime(time_info));
+    print_status("#          hetbias=%g omega=%g cq=%d mapq=%d maxdepth=%d\n", hetbias, omega, const_qual, min_mapq, maxdepth);
+    print_status("#          verbose=%d shard=%d/%d resume=%d\n", verbose, shard, nshard, resume);
+    print_status("# Start: %d threads, %d io threads \t%s\t%s", nthread, iothread, bam_file, asctime(time_info));
+
+    if (plan_mode) {
+        plan(var_set, out_fh);
+        for (i = 0; i < var_set->len; i++) vector_free((vector_t *)var_set->data[i]); //variants in var_list so don't destroy
+        vector_free(var_set);
+        return;
+    }
 
     vector_t *queue = vector_create(var_set->len, VOID_T);
-    vector_t *results = vector_create(var_set->len, VOID_T);
-    for (i = 0; i < var_set->len; i++) vector_add(queue, var_set->data[i]);
-
     work_t *w = malloc(sizeof (work_t));
     w->queue = queue;
-    w->results = results;
+    w->results = calloc(var_set->len + 1, sizeof (char *));
+    w->set_done = calloc(var_set->len + 1, sizeof (char));
+    w->nresults = 0;
+    w->next_out = 0;
+    w->finished = 0;
+    w->out_fh = out_fh;
     w->len = var_set->len;
+    w->done = 0;
+    w->ckpt_data = NULL;
+    w->ckpt_manifest = NULL;
+    if (ckpt_file != NULL) {
+        u_int32_t fp = checkpoint_fingerprint(var_set);
+        if (resume) w->nresults = checkpoint_resume(w, fp);
+        checkpoint_open(w, fp, w->nresults > 0);
+        print_status("# Checkpoint: %s\t%zd of %zd sets done\t%s", ckpt_file, w->nresults, w->len, asctime(time_info));
+    }
+    if (!sweep_mode) {
+        for (i = var_set->len; i-- > 0; ) { // reversed, popped in set order
+            if (w->set_done[i]) { /* Done before resuming */
+                vector_free((vector_t *)var_set->data[i]); //variants in var_list so don't destroy
+                continue;
+            }
+            job_t *job = malloc(sizeof (job_t));
+            job->var_set = (vector_t *)var_set->data[i];
+            job->read_list = NULL;
+            job->seti = i;
+            vector_add(queue, job);
+        }
+    }
 
     pthread_mutex_init(&w->q_lock, NULL);
     pthread_mutex_init(&w->r_lock, NULL);
+    pthread_cond_init(&w->q_ready, NULL);
+    pthread_cond_init(&w->q_space, NULL);
+    pthread_cond_init(&w->r_ready, NULL);
+    pthread_cond_init(&w->r_space, NULL);
 
+    pthread_t wtid;
+    pthread_create(&wtid, NULL, writer, w);
     pthread_t tid[nthread];
-    for (i = 0; i < nthread; i++) pthread_create(&tid[i], NULL, pool, w);
+    bam_hts_t *h = NULL;
+    if (sweep_mode) {
+        h = bam_hts_create(bam_files[0], fa_file, &tpool, bam_shared); // reader handle, its header holds the contig names of dispatched reads
+        for (i = 0; i < nthread; i++) pthread_create(&tid[i], NULL, sweep_pool, w);
+        sweep(var_set, w, h);
+    }
+    else {
+        for (i = 0; i < nthread; i++) pthread_create(&tid[i], NULL, pool, w);
+    }
     for (i = 0; i < nthread; i++) pthread_join(tid[i], NULL);
+    bam_hts_destroy(h); free(h); h = NULL;
+    pthread_mutex_lock(&w->r_lock);
+    w->finished = 1;
+    pthread_cond_signal(&w->r_ready);
+    pthread_mutex_unlock(&w->r_lock);
+    pthread_join(wtid, NULL);
 
     pthread_mutex_destroy(&w->q_lock);
     pthread_mutex_destroy(&w->r_lock);
+    pthread_cond_destroy(&w->q_ready);
+    pthread_cond_destroy(&w->q_space);
+    pthread_cond_destroy(&w->r_ready);
+    pthread_cond_destroy(&w->r_space);
+
+    if (terminated) { /* Sets in progress are done and flushed, the rest is left for --resume */
+        checkpoint_close(w, 0);
+        print_status("# Terminated: %zd of %zd sets done\t%s\t%s", w->nresults, w->len, (ckpt_file != NULL) ? ckpt_file : "no checkpoint", asctime(time_info));
+        exit(EXIT_FAILURE);
+    }
 
+    if (w->ckpt_data != NULL) {
+        if (fflush(out_fh) != 0) { exit_err("failed to write output, checkpoint %s is kept\n", ckpt_file); }
+        checkpoint_close(w, 1);
+    }
+    free(w->results); w->results = NULL;
+    free(w->set_done); w->set_done = NULL;
     free(w); w = NULL;
     vector_free(var_set); //variants in var_list so don't destroy
-
-    qsort(results->data, results->len, sizeof (void *), nat_sort_vector);
-    fprintf(out_fh, "# SEQ\tPOS\tREF\tALT\tReads\tRefReads\tAltReads\tProb\tOdds\tSet\n");
-    for (i = 0; i < results->len; i++) fprintf(out_fh, "%s", (char *)results->data[i]);
     vector_destroy(queue); free(queue); queue = NULL;
-    vector_destroy(results); free(results); results = NULL;
     print_status("# Done:\t%s\t%s", bam_file, asctime(time_info));
 }
 
 static void print_usage() {
     printf("\nUsage: eagle [options] -v variants.vcf -a alignment.bam -r reference.fasta\n\n");
     printf("Required:\n");
-    printf("  -v --vcf      FILE   Variants VCF file. [stdin]\n");
-    printf("  -a --bam      FILE   Alignment data bam files, ref-coord sorted with bai index file.\n");
+    printf("  -v --vcf      FILE   Variants VCF, bgzipped VCF or BCF file. [stdin]\n");
+    printf("  -a --bam      FILE   Alignment data bam or cram files, ref-coord sorted with bai or crai index file. Comma separated files are evaluated jointly as one sample each.\n");
     printf("  -r --ref      FILE   Reference sequence, fasta file with fai index file.\n");
     printf("Options:\n");
     printf("  -o --out      FILE   Output file. [stdout]\n");
     printf("  -t --nthread  INT    Number of threads. [1]\n");
+    printf("     --iothread INT    Number of additional threads shared by all BAM handles for BGZF decompression. [0]\n");
     printf("  -s --sharedr  INT    Group nearby variants that share a read, 0:distance based/off, 1:shared with first, 2:shared with any. [0]\n");
     printf("  -n --distlim  INT    Group nearby variants within n bases, 0:off. [10]\n");
     printf("  -w --maxdist  INT    Maximum number of bases between any two variants in a set of hypotheses, 0:off. [0]\n");
     printf("  -m --maxh     INT    Maximum number of combinations in the set of hypotheses, instead of all 2^n. [1024]\n");
     printf("     --mvh             Output the maximum likelihood hypothesis in the set instead of marginal probabilities.\n");
     printf("     --pao             Primary alignments only.\n");
+    printf("     --mapq     INT    Minimum mapping quality, reads below are ignored. [0]\n");
+    printf("     --maxdepth INT    Maximum reads per set, deeper sets are downsampled reproducibly and report Depth and Sampled columns. [0 is off]\n");
+    printf("     --exclude  FILE   Skip variant sets with any variant in these regions, BED file.\n");
+    printf("     --regions  FILE   Only variant sets whose first variant is in these regions, BED file.\n");
+    printf("     --readinfo FILE   With --verbose or --rc, write the per read likelihoods to FILE as a binary stream, compressed for .gz, instead of text to stderr.\n");
+    printf("     --classify STR    With --mvh or --rc, also classify the reads as eagle-rc does, into the list STR.list, without the read info and output files.\n");
+    printf("     --split           With --classify, split the reads of the BAM file into STR.ref.bam, STR.alt.bam, STR.mul.bam and STR.unk.bam.\n");
+    printf("     --stream          Read and evaluate the VCF one contig at a time, the next contig parsed during evaluation, for bounded memory on large VCFs.\n");
+    printf("     --plan            Estimate CPU hours, memory per thread and the costliest sets of the run, recommending threads and --shard, without evaluating.\n");
+    printf("     --readstore       Read from the read store of each BAM file, FILE.ers built by eagle-index, instead of the BAM file.\n");
+    printf("     --settable FILE   Write each set of several variants once to FILE, with the Set column holding its id in FILE instead of the variants.\n");
+    printf("     --vcfout   FILE   Also write the input VCF records with EAGLE scores as INFO fields, FORMAT fields per sample for several samples. bcf or vcf.gz are indexed.\n");
+    printf("     --checkpoint FILE Save finished sets to FILE.data and FILE.manifest every %d seconds and on SIGTERM.\n", CHECKPOINT_SEC);
+    printf("     --resume          Skip the sets finished in --checkpoint FILE, giving the same output as an uninterrupted run.\n");
+    printf("     --shard    i/N    Only the i-th of N parts of the variant sets, balanced by estimated cost. Merge outputs with: eagle merge [-o output] shard outputs...\n");
     printf("     --isc             Ignore soft-clipped bases.\n");
     printf("     --nodup           Ignore marked duplicate reads (based on SAM flag).\n");
     printf("     --splice          RNA-seq spliced reads.\n");
@@ -847,7 +2404,10 @@ static void print_usage() {
     printf("     --gap_op   INT    DP gap open penalty. [6]. Recommend 2 for long reads with indel errors.\n");
     printf("     --gap_ex   INT    DP gap extend penalty. [1].\n");
     printf("     --verbose         Verbose mode, output likelihoods for each read seen for each hypothesis to stderr.\n");
+    printf("     --refmem   INT    Megabytes of reference windows held by all threads, least recently used evicted beyond it. [0 is %d windows per thread]\n", REFWIN_SLOTS);
     printf("     --lowmem          Low memory usage mode, the default mode for snps, this may be slightly slower for indels but uses less memory.\n");
+    printf("     --sweep           Stream each chromosome once in sorted order instead of an index query per variant set, faster for dense variant sets.\n");
+    printf("     --rg              Evaluate each read group of a single bam file jointly as one sample each.\n");
     printf("     --phred64         Read quality scores are in phred64.\n");
     printf("     --hetbias  FLOAT  Prior probability bias towards non-homozygous mutations, between [0,1]. [0.5]\n");
     printf("     --omega    FLOAT  Prior probability of originating from outside paralogous source, between [0,1]. [1e-6]\n");
@@ -856,7 +2416,250 @@ static void print_usage() {
     printf("     --version         Display version.\n");
 }
 
+static variant_t *variant_lookup(const vector_t *var_list, const char *chr, int pos, const char *ref, const char *alt) {
+    /* Binary search of the sorted variant list for the first at chr, pos, then the matching alleles */
+    variant_t key = {pos, 0, (char *)chr, NULL, NULL};
+    variant_t *k = &key;
+    size_t lo = 0, hi = var_list->len;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (nat_sort_variant(&var_list->data[mid], &k) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    for (; lo < var_list->len; lo++) {
+        variant_t *v = (variant_t *)var_list->data[lo];
+        if (v->pos != pos || strcmp(v->chr, chr) != 0) break;
+        if (strcmp(v->ref, ref) == 0 && strcmp(v->alt, alt) == 0) return v;
+    }
+    return NULL;
+}
+
+static void vcf_write(const vector_t *var_list, const char *filename) {
+    /* Input VCF records annotated with the calls of each alternative allele, INFO fields for one sample, FORMAT fields 
+       replacing the input samples for several, indexed when compressed */
+    int i, j, s;
+    htsFile *in = bcf_open(vcf_file, "r");
+    if (in == NULL) { exit_err("failed to open VCF file %s\n", vcf_file); }
+    bcf_hdr_t *hdr = bcf_hdr_read(in);
+    if (hdr == NULL) { exit_err("bad header in VCF file %s\n", vcf_file); }
+
+    bcf_hdr_t *out_hdr;
+    const char *field = (nsample == 1) ? "INFO" : "FORMAT";
+    if (nsample == 1) {
+        out_hdr = bcf_hdr_dup(hdr);
+    }
+    else {
+        out_hdr = bcf_hdr_subset(hdr, 0, NULL, NULL);
+        for (s = 0; s < nsample; s++) bcf_hdr_add_sample(out_hdr, samples[s].name);
+        bcf_hdr_add_sample(out_hdr, NULL);
+    }
+    const char *fields[5][3] = {
+        {"EAGLE_PROB", "Float", "log10 probability of the alternative allele"},
+        {"EAGLE_ODDS", "Float", "log10 likelihood ratio (odds) of the alternative allele"},
+        {"EAGLE_READS", "Integer", "Number of reads seen"},
+        {"EAGLE_REFREADS", "Integer", "Number of reads supporting the reference sequence"},
+        {"EAGLE_ALTREADS", "Integer", "Number of reads supporting the alternative sequence"}
+    };
+    for (i = 0; i < 5; i++) {
+        int n = snprintf(NULL, 0, "##%s=<ID=%s,Number=A,Type=%s,Description=\"EAGLE %s\">", field, fields[i][0], fields[i][1], fields[i][2]) + 1;
+        char line[n];
+        snprintf(line, n, "##%s=<ID=%s,Number=A,Type=%s,Description=\"EAGLE %s\">", field, fields[i][0], fields[i][1], fields[i][2]);
+        bcf_hdr_append(out_hdr, line);
+    }
+    if (bcf_hdr_sync(out_hdr) != 0) { exit_err("failed to add EAGLE fields to the VCF header\n"); }
+
+    size_t n = strlen(filename);
+    int is_bcf = (n > 4 && strcmp(filename + n - 4, ".bcf") == 0);
+    int is_gz = (n > 3 && strcmp(filename + n - 3, ".gz") == 0);
+    htsFile *out = hts_open(filename, is_bcf ? "wb" : (is_gz ? "wz" : "w"));
+    if (out == NULL) { exit_err("failed to open VCF output %s\n", filename); }
+    if (tpool.pool != NULL) hts_set_thread_pool(out, &tpool);
+    if (bcf_hdr_write(out, out_hdr) != 0) { exit_err("failed to write VCF output %s\n", filename); }
+
+    size_t nrecords = 0;
+    bcf1_t *rec = bcf_init();
+    while (bcf_read(in, hdr, rec) == 0) {
+        bcf_unpack(rec, BCF_UN_STR);
+        int nalt = rec->n_allele - 1;
+        if (nalt < 1) continue;
+
+        int found = 0;
+        int nvalue = nalt * nsample;
+        float prob[nvalue], odds[nvalue];
+        int32_t reads[nvalue], refreads[nvalue], altreads[nvalue];
+        for (j = 0; j < nalt; j++) {
+            variant_t *v = variant_lookup(var_list, bcf_seqname(hdr, rec), rec->pos + 1, rec->d.allele[0], rec->d.allele[j + 1]);
+            for (s = 0; s < nsample; s++) {
+                int k = s * nalt + j; // allele values of each sample in turn
+                call_t *c = (v != NULL && vcf_called[v->index * nsample + s]) ? &vcf_calls[v->index * nsample + s] : NULL;
+                if (c == NULL) {
+                    bcf_float_set_missing(prob[k]);
+                    bcf_float_set_missing(odds[k]);
+                    reads[k] = refreads[k] = altreads[k] = bcf_int32_missing;
+                    continue;
+                }
+                prob[k] = (float)c->prob;
+                odds[k] = (float)c->odds;
+                reads[k] = c->seen;
+                refreads[k] = c->ref_count;
+                altreads[k] = c->alt_count;
+                found = 1;
+            }
+        }
+        if (!found && (nshard > 0 || region_hash != NULL)) continue; // evaluated by another run
+
+        if (nsample == 1) {
+            bcf_update_info_float(out_hdr, rec, "EAGLE_PROB", prob, nvalue);
+            bcf_update_info_float(out_hdr, rec, "EAGLE_ODDS", odds, nvalue);
+            bcf_update_info_int32(out_hdr, rec, "EAGLE_READS", reads, nvalue);
+            bcf_update_info_int32(out_hdr, rec, "EAGLE_REFREADS", refreads, nvalue);
+            bcf_update_info_int32(out_hdr, rec, "EAGLE_ALTREADS", altreads, nvalue);
+        }
+        else {
+            bcf_subset(out_hdr, rec, 0, NULL); // drop the input samples
+            rec->n_sample = nsample;
+            bcf_update_format_float(out_hdr, rec, "EAGLE_PROB", prob, nvalue);
+            bcf_update_format_float(out_hdr, rec, "EAGLE_ODDS", odds, nvalue);
+            bcf_update_format_int32(out_hdr, rec, "EAGLE_READS", reads, nvalue);
+            bcf_update_format_int32(out_hdr, rec, "EAGLE_REFREADS", refreads, nvalue);
+            bcf_update_format_int32(out_hdr, rec, "EAGLE_ALTREADS", altreads, nvalue);
+        }
+        if (bcf_write(out, out_hdr, rec) != 0) { exit_err("failed to write VCF output %s\n", filename); }
+        nrecords++;
+    }
+    bcf_destroy(rec);
+    bcf_hdr_destroy(out_hdr);
+    bcf_hdr_destroy(hdr);
+    bcf_close(in);
+    if (bcf_close(out) != 0) { exit_err("failed to close VCF output %s\n", filename); }
+    if (is_bcf || is_gz) { /* CSI for bcf, tabix for vcf.gz */
+        if (bcf_index_build3(filename, NULL, is_bcf ? 14 : 0, iothread) != 0) { exit_err("failed to index VCF output %s\n", filename); }
+    }
+    print_status("# Wrote VCF: %s\t%zd records\t%s", filename, nrecords, asctime(time_info));
+}
+
+static int class_var_in_output(const char *var, void *data) {
+    return kh_get(cvh, class_var, var) != kh_end(class_var);
+}
+
+static void classify_write(const char *prefix) {
+    /* Classified read list as by eagle-rc, and with --split the reads of the bam split by class */
+    size_t i;
+    int n = snprintf(NULL, 0, "%s.list", prefix) + 1;
+    char list_fn[n];
+    snprintf(list_fn, n, "%s.list", prefix);
+    FILE *list_fh = fopen(list_fn, "w");
+    if (list_fh == NULL) { exit_err("failed to open file %s\n", list_fn); }
+
+    size_t nreads = 0;
+    khiter_t k;
+    for (i = 0; i < CLASSIFY_SHARDS; i++) {
+        khash_t(crh) *hash = class_shard[i].hash;
+        for (k = kh_begin(hash); k != kh_end(hash); k++) {
+            if (kh_exist(hash, k)) {
+                read_t *r = kh_val(hash, k);
+                classify_read(r, class_var_in_output, NULL);
+                classify_print(list_fh, r);
+                nreads++;
+            }
+        }
+    }
+    if (fclose(list_fh) != 0) { exit_err("failed to write file %s\n", list_fn); }
+    print_status("# Reads Classified: %s\t%zd reads\t%s", list_fn, nreads, asctime(time_info));
+    if (!classify_split) return;
+
+    /* Every field is written back out, so not through bam_hts_create which leaves the CRAM mate fields undecoded */
+    samFile *sam_in = sam_open(bam_files[0], "r");
+    if (sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_files[0]); }
+    if (tpool.pool != NULL) hts_set_thread_pool(sam_in, &tpool); // shared bgzf threads
+    if (fa_file != NULL && sam_in->format.format == cram && hts_set_fai_filename(sam_in, fa_file) != 0) { exit_err("failed to set CRAM reference %s\n", fa_file); }
+    bam_hdr_t *bam_header = sam_hdr_read(sam_in);
+    if (bam_header == 0) { exit_err("bad header %s\n", bam_files[0]); }
+    bam1_t *aln = bam_init1();
+    samFile *class_out[NCLASS_BAM];
+    classify_bam_open(class_out, prefix, bam_header, &tpool);
+    while (sam_read1(sam_in, bam_header, aln) >= 0) {
+        if (aln->core.tid < 0) continue; // not mapped
+        if (pao && (aln->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) continue;
+
+        char *name = bam_get_qname(aln);
+        int n = snprintf(NULL, 0, "%s\t%d", name, (aln->core.flag & BAM_FREAD2) != 0) + 1;
+        char key[n];
+        snprintf(key, n, "%s\t%d", name, (aln->core.flag & BAM_FREAD2) != 0);
+        khash_t(crh) *hash = class_shard[fnv_32a_str(key) % CLASSIFY_SHARDS].hash;
+        k = kh_get(crh, hash, key);
+        if (k == kh_end(hash)) continue;
+
+        samFile *out = classify_bam_select(class_out, kh_val(hash, k)->index, 0, 0);
+        if (out != NULL && sam_write1(out, bam_header, aln) < 0) { exit_err("failed to write split BAM file\n"); }
+    }
+    classify_bam_close(class_out);
+    bam_destroy1(aln);
+    bam_hdr_destroy(bam_header);
+    sam_close(sam_in);
+    print_status("# BAM split: %s\t%s", bam_files[0], asctime(time_info));
+}
+
+static void on_terminate(int sig) {
+    terminated = 1;
+}
+
+static int merge(int argc, char **argv) {
+    /* Concatenate shard outputs in shard order, every shard run sorts and partitions the same sets so this is the single run output */
+    char *merge_out = NULL;
+    int opt;
+    optind = 1;
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+            case 'o': merge_out = optarg; break;
+            default: exit_usage("Bad options, expected: eagle merge [-o output] shard outputs...");
+        }
+    }
+    int nfiles = argc - optind;
+    if (nfiles < 1) { exit_usage("Missing shard outputs to merge!"); }
+
+    int i, n;
+    char *shard_file[nfiles];
+    for (i = 0; i < nfiles; i++) shard_file[i] = NULL;
+
+    char *line = NULL;
+    size_t line_length = 0;
+    for (i = optind; i < argc; i++) {
+        FILE *file = fopen(argv[i], "r");
+        if (file == NULL) { exit_err("failed to open shard output %s\n", argv[i]); }
+        int si, sn;
+        if (getline(&line, &line_length, file) == -1 || sscanf(line, "# Shard: %d/%d", &si, &sn) != 2) { exit_err("%s is not an eagle --shard output\n", argv[i]); }
+        if (sn != nfiles) { exit_err("%s is shard %d/%d, but %d shard outputs given\n", argv[i], si, sn, nfiles); }
+        if (si < 1 || si > sn || shard_file[si - 1] != NULL) { exit_err("%s repeats shard %d/%d\n", argv[i], si, sn); }
+        shard_file[si - 1] = argv[i];
+        fclose(file);
+    }
+
+    FILE *out_fh = stdout;
+    if (merge_out != NULL) out_fh = fopen(merge_out, "w");
+    if (out_fh == NULL) { exit_err("failed to open output file %s\n", merge_out); }
+    for (i = 0; i < nfiles; i++) {
+        FILE *file = fopen(shard_file[i], "r");
+        if (file == NULL) { exit_err("failed to open shard output %s\n", shard_file[i]); }
+        for (n = 0; getline(&line, &line_length, file) != -1; n++) {
+            if (n == 0) continue; // shard line
+            if (n == 1 && i > 0) continue; // column header, once
+            fputs(line, out_fh);
+        }
+        fclose(file);
+        print_status("# Merged: %s\t%d lines\t%s", shard_file[i], n - 2, asctime(time_info));
+    }
+    free(line); line = NULL;
+    if (merge_out != NULL) fclose(out_fh);
+    else fflush(stdout);
+    return 0;
+}
+
 int main(int argc, char **argv) {
+    int i;
+
+    if (argc > 1 && strcmp(argv[1], "merge") == 0) return merge(argc - 1, argv + 1);
+
     /* Command line parameters defaults */
     debug = 0;
     vcf_file = NULL;
@@ -864,6 +2667,7 @@ int main(int argc, char **argv) {
     fa_file = NULL;
     out_file = NULL;
     nthread = 1;
+    iothread = 0;
     sharedr = 0;
     distlim = 10;
     maxdist = 0;
@@ -883,6 +2687,25 @@ int main(int argc, char **argv) {
     hetbias = 0.5;
     omega = 1.0e-6;
     const_qual = 0;
+    sweep_mode = 0;
+    rgsplit = 0;
+    min_mapq = 0;
+    maxdepth = 0;
+    char *exclude_file = NULL;
+    char *region_file = NULL;
+    ckpt_file = NULL;
+    vcf_out = NULL;
+    readinfo_file = NULL;
+    classify_prefix = NULL;
+    classify_split = 0;
+    settable_file = NULL;
+    readstore = 0;
+    plan_mode = 0;
+    stream_mode = 0;
+    resume = 0;
+    terminated = 0;
+    shard = 0;
+    nshard = 0;
     rc = 0;
 
     static struct option long_options[] = {
@@ -892,6 +2715,7 @@ int main(int argc, char **argv) {
         {"ref", required_argument, NULL, 'r'},
         {"out", optional_argument, NULL, 'o'},
         {"nthread", optional_argument, NULL, 't'},
+        {"iothread", optional_argument, NULL, 994},
         {"sharedr", optional_argument, NULL, 's'},
         {"distlim", optional_argument, NULL, 'n'},
         {"maxdist", optional_argument, NULL, 'w'},
@@ -905,6 +2729,24 @@ int main(int argc, char **argv) {
         {"verbose", no_argument, &verbose, 1},
         {"phred64", no_argument, &phred64, 1},
         {"lowmem", no_argument, &lowmem, 1},
+        {"sweep", no_argument, &sweep_mode, 1},
+        {"rg", no_argument, &rgsplit, 1},
+        {"readstore", no_argument, &readstore, 1},
+        {"plan", no_argument, &plan_mode, 1},
+        {"stream", no_argument, &stream_mode, 1},
+        {"refmem", optional_argument, NULL, 980},
+        {"mapq", optional_argument, NULL, 995},
+        {"maxdepth", optional_argument, NULL, 996},
+        {"exclude", optional_argument, NULL, 997},
+        {"shard", optional_argument, NULL, 983},
+        {"regions", optional_argument, NULL, 984},
+        {"checkpoint", optional_argument, NULL, 985},
+        {"vcfout", optional_argument, NULL, 986},
+        {"readinfo", optional_argument, NULL, 987},
+        {"classify", optional_argument, NULL, 988},
+        {"settable", optional_argument, NULL, 989},
+        {"split", no_argument, &classify_split, 1},
+        {"resume", no_argument, &resume, 1},
         {"dp", no_argument, &dp, 1},
         {"gap_op", optional_argument, NULL, 981},
         {"gap_ex", optional_argument, NULL, 982},
@@ -933,29 +2775,47 @@ int main(int argc, char **argv) {
             case 'n': distlim = parse_int(optarg); break;
             case 'w': maxdist = parse_int(optarg); break;
             case 'm': maxh = parse_int(optarg); break;
+            case 980: refmem = parse_int(optarg); break;
             case 981: gap_op = parse_int(optarg); break;
             case 982: gap_ex = parse_int(optarg); break;
+            case 983:
+                if (sscanf(optarg, "%d/%d", &shard, &nshard) != 2 || nshard < 1 || shard < 1 || shard > nshard) { exit_usage("Bad shard, expected i/N with 1 <= i <= N"); }
+                break;
+            case 984: region_file = optarg; break;
+            case 985: ckpt_file = optarg; break;
+            case 986: vcf_out = optarg; break;
+            case 987: readinfo_file = optarg; break;
+            case 988: classify_prefix = optarg; break;
+            case 989: settable_file = optarg; break;
             case 990: hetbias = parse_double(optarg); break;
             case 991: omega = parse_double(optarg); break;
             case 992: bisulfite = parse_int(optarg); break;
             case 993: const_qual = parse_int(optarg); break;
+            case 994: iothread = parse_int(optarg); break;
+            case 995: min_mapq = parse_int(optarg); break;
+            case 996: maxdepth = parse_int(optarg); break;
+            case 997: exclude_file = optarg; break;
             case 999: printf("EAGLE %s\n", VERSION); exit(0);
             default: exit_usage("Bad options");
         }
     }
     if (optind > argc) { exit_usage("Bad program call"); }
 
-    FILE *vcf_fh = stdin;
-    if (vcf_file != NULL) { // default vcf file handle is stdin unless a vcf file option is used
-        vcf_fh = fopen(vcf_file, "r");
-        if (vcf_fh == NULL) { exit_err("failed to open VCF file %s\n", vcf_file); }
-    }
-    else {
-        vcf_file = "stdin";
-    }
+    if (vcf_file == NULL) vcf_file = "-"; // default vcf input is stdin unless a vcf file option is used
     if (bam_file == NULL) { exit_usage("Missing alignments given as BAM file!"); } 
+    char *bam_list = strdup(bam_file); // alignment files, split in place
+    char *token;
+    nbam = 0;
+    bam_files = malloc((strlen(bam_list) / 2 + 1) * sizeof (char *));
+    for (token = strtok(bam_list, ","); token != NULL; token = strtok(NULL, ",")) bam_files[nbam++] = token;
+    if (nbam == 0) { exit_usage("Missing alignments given as BAM file!"); }
+    if (rgsplit && nbam > 1) { exit_usage("--rg splits a single BAM file by read group"); }
     if (fa_file == NULL) { exit_usage("Missing reference genome given as Fasta file!"); }
     if (nthread < 1) nthread = 1;
+    if (iothread < 0) iothread = 0;
+    if (min_mapq < 0) min_mapq = 0;
+    if (maxdepth < 0) maxdepth = 0;
+    if (refmem < 0) refmem = 0;
     if (sharedr < 0 || sharedr > 2) sharedr = 0;
     if (distlim < 0) distlim = 10;
     if (maxdist < 0) maxdist = 0;
@@ -977,36 +2837,240 @@ int main(int argc, char **argv) {
     alt_prior = log(0.5 * (1 - hetbias));
     het_prior = log(0.5 * hetbias);
 
+    if (resume && ckpt_file == NULL) { exit_usage("--resume needs the --checkpoint of the run to resume"); }
+    if (vcf_out != NULL) {
+        if (strcmp(vcf_file, "-") == 0) { exit_usage("--vcfout reads the input VCF again, give it as a file with -v"); }
+        if (mvh) { exit_usage("--vcfout annotates marginal probabilities, not --mvh or --rc"); }
+        if (ckpt_file != NULL) { exit_usage("--vcfout keeps its calls in memory, not with --checkpoint"); }
+    }
+    if (readinfo_file != NULL) {
+        if (!verbose) { exit_usage("--readinfo holds the per read likelihoods of --verbose or --rc"); }
+        if (ckpt_file != NULL) { exit_usage("--readinfo is written by one run, not with --checkpoint"); }
+    }
+    if (stream_mode) {
+        if (nshard > 0) { exit_usage("--shard partitions all sets, not with --stream"); }
+        if (ckpt_file != NULL) { exit_usage("--checkpoint records all sets, not with --stream"); }
+        if (vcf_out != NULL) { exit_usage("--vcfout keeps every variant, not with --stream"); }
+        if (plan_mode) { exit_usage("--plan estimates all sets, not with --stream"); }
+    }
+    if (settable_file != NULL && mvh) { exit_usage("--settable refers to whole sets, the Set column of --mvh or --rc is the chosen hypothesis"); }
+    if (classify_split && classify_prefix == NULL) { exit_usage("--split writes the bam files of --classify"); }
+    if (classify_prefix != NULL) {
+        if (!mvh) { exit_usage("--classify follows the best hypothesis of each set, use --mvh or --rc"); }
+        if (ckpt_file != NULL) { exit_usage("--classify keeps its reads in memory, not with --checkpoint"); }
+    }
+    if (plan_mode) { /* Only the report, none of the run's outputs */
+        verbose = 0;
+        vcf_out = NULL;
+        readinfo_file = NULL;
+        classify_prefix = NULL;
+        settable_file = NULL;
+        ckpt_file = NULL;
+        resume = 0;
+    }
+    if (ckpt_file != NULL) { /* Finish the sets in progress on termination by the batch scheduler */
+        struct sigaction sa;
+        memset(&sa, 0, sizeof (sa));
+        sa.sa_handler = on_terminate;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGTERM, &sa, NULL);
+        sigaction(SIGINT, &sa, NULL);
+    }
+
     FILE *out_fh = stdout;
     if (out_file != NULL) out_fh = fopen(out_file, "w"); // default output file handle is stdout unless output file option is used
 
     init_seqnt_map(seqnt_map);
     init_q2p_table(p_match, p_mismatch, 50);
+    if (iothread > 0) { // shared pool for bgzf decompression and compression by every open handle
+        tpool.pool = hts_tpool_init(iothread);
+        if (tpool.pool == NULL) { exit_err("failed to create htslib thread pool with %d threads\n", iothread); }
+    }
+    bam_shared = bam_hts_create(bam_files[0], fa_file, &tpool, NULL);
+
+    if (rgsplit) { /* One sample per read group */
+        nsample = sam_hdr_count_lines(bam_shared->bam_header, "RG");
+        if (nsample <= 0) { exit_err("no read groups in the header of %s\n", bam_files[0]); }
+        samples = malloc(nsample * sizeof (sample_t));
+        for (i = 0; i < nsample; i++) {
+            samples[i].rg = strdup(sam_hdr_line_name(bam_shared->bam_header, "RG", i));
+            samples[i].name = samples[i].rg;
+            samples[i].file = 0;
+        }
+    }
+    else { /* One sample per alignment file */
+        nsample = nbam;
+        samples = malloc(nsample * sizeof (sample_t));
+        for (i = 0; i < nsample; i++) {
+            samples[i].rg = NULL;
+            samples[i].name = bam_files[i];
+            samples[i].file = i;
+        }
+    }
+    if (nsample > 1) {
+        if (mvh || verbose) { exit_usage("--mvh, --verbose and --rc output a single sample"); }
+        if (sweep_mode) { exit_usage("--sweep streams a single sample"); }
+    }
+    if (readstore && sweep_mode) { exit_usage("--readstore reads each set from the store, not with --sweep"); }
+    stores = NULL;
+    if (readstore) {
+        stores = malloc(nbam * sizeof (store_t *));
+        for (i = 0; i < nbam; i++) {
+            int n = strlen(bam_files[i]) + 5;
+            char store_file[n];
+            snprintf(store_file, n, "%s.ers", bam_files[i]);
+            stores[i] = store_open(store_file, bam_files[i]);
+            print_status("# Read store: %s\t%llu reads\t%s", store_file, (unsigned long long)stores[i]->header->n_reads, asctime(time_info));
+        }
+    }
+    print_status("# Samples: %d\t%s", nsample, asctime(time_info));
 
     /* Start processing data */
     clock_t tic = clock();
-    vector_t *var_list = vcf_read(vcf_fh);
-    print_status("# Read VCF: %s\t%i entries\t%s", vcf_file, (int)var_list->len, asctime(time_info));
+    vcf_stream_t *vs = vcf_open(vcf_file);
+    if (vcf_out != NULL && vs->hdr == NULL) { exit_usage("--vcfout needs a VCF file with header lines"); }
+    vector_t *var_list = vcf_next(vs, stream_mode);
+    if (var_list == NULL) var_list = vector_create(1, VARIANT_T);
+    if (stream_mode) { print_status("# Read VCF: %s\t%s\t%i entries\t%s", vcf_file, (var_list->len > 0) ? ((variant_t *)var_list->data[0])->chr : "", (int)var_list->len, asctime(time_info)); }
+    else {
+        vcf_close(vs); free(vs); vs = NULL;
+        print_status("# Read VCF: %s\t%i entries\t%s", vcf_file, (int)var_list->len, asctime(time_info));
+    }
 
-    refseq_hash = kh_init(rsh);
+    refseq_open(fa_file);
 
-    pthread_mutex_init(&refseq_lock, NULL);
-    process(var_list, out_fh);
+    exclude_hash = NULL;
+    if (exclude_file != NULL) {
+        exclude_hash = kh_init(xh);
+        bed_read(exclude_hash, exclude_file, "exclusion");
+    }
+    region_hash = NULL;
+    if (region_file != NULL) {
+        region_hash = kh_init(xh);
+        bed_read(region_hash, region_file, "regions");
+    }
+
+    vcf_calls = NULL;
+    vcf_called = NULL;
+    if (vcf_out != NULL) {
+        vcf_calls = malloc((var_list->len * nsample + 1) * sizeof (call_t));
+        vcf_called = calloc(var_list->len * nsample + 1, sizeof (char));
+        pthread_mutex_init(&vcf_lock, NULL);
+    }
+
+    readinfo_fh = NULL;
+    if (readinfo_file != NULL) { /* bgzf compressed for .gz, else bgzf framing only */
+        size_t n = strlen(readinfo_file);
+        int is_gz = (n > 3 && strcmp(readinfo_file + n - 3, ".gz") == 0);
+        readinfo_fh = bgzf_open(readinfo_file, is_gz ? "w" : "wu");
+        if (readinfo_fh == NULL) { exit_err("failed to open read info file %s\n", readinfo_file); }
+        if (tpool.pool != NULL) bgzf_thread_pool(readinfo_fh, tpool.pool, 0);
+        if (bgzf_write(readinfo_fh, READINFO_MAGIC, 8) < 0) { exit_err("failed to write read info file %s\n", readinfo_file); }
+        pthread_mutex_init(&readinfo_lock, NULL);
+        readinfo_nset = 0;
+        readinfo_contig = NULL;
+        readinfo_ncontig = 0;
+    }
+
+    class_shard = NULL;
+    if (classify_prefix != NULL) {
+        class_shard = malloc(CLASSIFY_SHARDS * sizeof (class_shard_t));
+        for (i = 0; i < CLASSIFY_SHARDS; i++) {
+            class_shard[i].hash = kh_init(crh);
+            pthread_mutex_init(&class_shard[i].lock, NULL);
+        }
+        class_var = kh_init(cvh);
+        pthread_mutex_init(&class_var_lock, NULL);
+    }
+
+    settable_fh = NULL;
+    settable_nsets = 0;
+    set_offset = 0;
+    if (settable_file != NULL) {
+        settable_fh = fopen(settable_file, "w");
+        if (settable_fh == NULL) { exit_err("failed to open set table %s\n", settable_file); }
+        fprintf(settable_fh, "# ID\tSet\n");
+    }
+
+    if (!plan_mode) output_header(out_fh);
+    while (1) {
+        pthread_t rtid;
+        if (stream_mode) pthread_create(&rtid, NULL, vcf_prefetch, vs); // next contig parsed while this one is evaluated
+        process(var_list, out_fh);
+        if (!stream_mode) break;
+        pthread_join(rtid, NULL);
+        vector_destroy(var_list); free(var_list);
+        var_list = vs->chunk;
+        if (var_list == NULL) break;
+        print_status("# Read VCF: %s\t%s\t%i entries\t%s", vcf_file, ((variant_t *)var_list->data[0])->chr, (int)var_list->len, asctime(time_info));
+    }
+    if (vs != NULL) {
+        print_status("# Streamed VCF: %s\t%zd entries\t%s", vcf_file, vs->nvars, asctime(time_info));
+        vcf_close(vs); free(vs); vs = NULL;
+    }
     if (out_file != NULL) fclose(out_fh);
     else fflush(stdout);
-    pthread_mutex_destroy(&refseq_lock);
+    if (settable_fh != NULL) {
+        if (fclose(settable_fh) != 0) { exit_err("failed to write set table %s\n", settable_file); }
+        settable_fh = NULL;
+        print_status("# Set table: %s\t%zd sets\t%s", settable_file, settable_nsets, asctime(time_info));
+    }
 
     khiter_t k;
-    for (k = kh_begin(refseq_hash); k != kh_end(refseq_hash); k++) {
-        if (kh_exist(refseq_hash, k)) {
-            fasta_destroy(kh_val(refseq_hash, k)); free(kh_val(refseq_hash, k)); kh_val(refseq_hash, k) = NULL;
+    refseq_close();
+    if (readinfo_fh != NULL) {
+        if (bgzf_close(readinfo_fh) != 0) { exit_err("failed to close read info file %s\n", readinfo_file); }
+        readinfo_fh = NULL;
+        pthread_mutex_destroy(&readinfo_lock);
+        free(readinfo_contig); readinfo_contig = NULL;
+        print_status("# Wrote read info: %s\t%u sets\t%s", readinfo_file, readinfo_nset, asctime(time_info));
+    }
+    if (class_shard != NULL) {
+        classify_write(classify_prefix);
+        for (i = 0; i < CLASSIFY_SHARDS; i++) {
+            khash_t(crh) *hash = class_shard[i].hash;
+            for (k = kh_begin(hash); k != kh_end(hash); k++) {
+                if (kh_exist(hash, k)) {
+                    read_destroy(kh_val(hash, k)); free(kh_val(hash, k)); kh_val(hash, k) = NULL;
+                    free((char *)kh_key(hash, k)); kh_key(hash, k) = NULL;
+                }
+            }
+            kh_destroy(crh, hash);
+            pthread_mutex_destroy(&class_shard[i].lock);
+        }
+        free(class_shard); class_shard = NULL;
+        for (k = kh_begin(class_var); k != kh_end(class_var); k++) {
+            if (kh_exist(class_var, k)) { free((char *)kh_key(class_var, k)); kh_key(class_var, k) = NULL; }
         }
+        kh_destroy(cvh, class_var);
+        pthread_mutex_destroy(&class_var_lock);
     }
-    kh_destroy(rsh, refseq_hash);
+    if (vcf_out != NULL) {
+        vcf_write(var_list, vcf_out);
+        pthread_mutex_destroy(&vcf_lock);
+        free(vcf_calls); vcf_calls = NULL;
+        free(vcf_called); vcf_called = NULL;
+    }
+    bed_destroy(exclude_hash); exclude_hash = NULL;
+    bed_destroy(region_hash); region_hash = NULL;
     vector_destroy(var_list); free(var_list); var_list = NULL;
 
+    if (stores != NULL) {
+        for (i = 0; i < nbam; i++) { store_close(stores[i]); free(stores[i]); stores[i] = NULL; }
+        free(stores); stores = NULL;
+    }
+    bam_hts_destroy(bam_shared); free(bam_shared); bam_shared = NULL;
+    for (i = 0; i < nsample; i++) { free(samples[i].rg); samples[i].rg = NULL; }
+    free(samples); samples = NULL;
+    free(bam_files); bam_files = NULL;
+    free(bam_list); bam_list = NULL;
+    if (tpool.pool != NULL) { hts_tpool_destroy(tpool.pool); tpool.pool = NULL; }
+
     clock_t toc = clock();
     print_status("# CPU time (hr):\t%f\n", (double)(toc - tic) / CLOCKS_PER_SEC / 3600);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    print_status("# Peak RSS (MB):\t%f\n", (double)usage.ru_maxrss / 1024); // kilobytes on Linux
 
     return 0;
 }
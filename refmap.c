@@ -0,0 +1,82 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Given the sequencing data and candidate variant, explicitly test 
+the alternative hypothesis against the reference hypothesis
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "htslib/khash.h"
+#include "util.h"
+#include "refmap.h"
+
+KHASH_MAP_INIT_STR(rfh, int) // hashmap: contig name key, id value
+
+refmap_t *refmap_open(const char *fa_file) {
+    /* Map fa_file.erf if eagle-ref made one, checking that it was made from fa_file as it is now, else NULL */
+    int n = strlen(fa_file) + strlen(REFMAP_SUFFIX) + 1;
+    char ref_file[n];
+    snprintf(ref_file, n, "%s%s", fa_file, REFMAP_SUFFIX);
+    int fd = open(ref_file, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof (refmap_header_t)) { exit_err("bad reference map %s\n", ref_file); }
+
+    refmap_t *r = malloc(sizeof (refmap_t));
+    r->size = st.st_size;
+    r->map = mmap(NULL, r->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (r->map == MAP_FAILED) { exit_err("failed to map reference map %s\n", ref_file); }
+    r->header = (const refmap_header_t *)r->map;
+    if (memcmp(r->header->magic, REFMAP_MAGIC, 8) != 0) { exit_err("not an EAGLE reference map %s, or built by an older eagle-ref, rebuild it\n", ref_file); }
+    if (r->header->dir_offset + r->header->n_contigs * sizeof (refmap_contig_t) > r->size) { exit_err("truncated reference map %s\n", ref_file); }
+    if (stat(fa_file, &st) != 0) { exit_err("failed to stat reference %s\n", fa_file); }
+    if ((uint64_t)st.st_size != r->header->fa_size || (int64_t)st.st_mtime != r->header->fa_mtime) { exit_err("reference map %s is out of date with %s, rebuild it with eagle-ref\n", ref_file, fa_file); }
+
+    const char *base = (const char *)r->map;
+    r->contig = (const refmap_contig_t *)(base + r->header->dir_offset);
+
+    int i;
+    khash_t(rfh) *h = kh_init(rfh);
+    for (i = 0; i < (int)r->header->n_contigs; i++) {
+        if (r->contig[i].seq + r->contig[i].length >= r->size || r->contig[i].name >= r->size) { exit_err("truncated reference map %s\n", ref_file); }
+        int absent;
+        khiter_t k = kh_put(rfh, h, base + r->contig[i].name, &absent); // keys point into the map
+        kh_val(h, k) = i;
+    }
+    r->name_hash = h;
+    return r;
+}
+
+void refmap_close(refmap_t *r) {
+    if (r != NULL) {
+        kh_destroy(rfh, (khash_t(rfh) *)r->name_hash); r->name_hash = NULL;
+        munmap(r->map, r->size); r->map = NULL;
+        r->header = NULL;
+        r->contig = NULL;
+    }
+}
+
+int refmap_name2id(const refmap_t *r, const char *name) {
+    khash_t(rfh) *h = (khash_t(rfh) *)r->name_hash;
+    khiter_t k = kh_get(rfh, h, name);
+    return (k != kh_end(h)) ? kh_val(h, k) : -1;
+}
+
+const char *refmap_name(const refmap_t *r, int id) {
+    return (const char *)r->map + r->contig[id].name;
+}
+
+fasta_t *refmap_fasta(const refmap_t *r, int id) {
+    /* Sequence in the map, read-only and not owned: set seq to NULL before fasta_destroy */
+    fasta_t *f = fasta_create((char *)refmap_name(r, id));
+    f->seq = (char *)r->map + r->contig[id].seq;
+    f->seq_length = (int)r->contig[id].length;
+    return f;
+}
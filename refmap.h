@@ -0,0 +1,49 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Given the sequencing data and candidate variant, explicitly test 
+the alternative hypothesis against the reference hypothesis
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#ifndef _refmap_h_
+#define _refmap_h_
+
+#include <stdint.h>
+#include "vector.h"
+
+/* Reference written by eagle-ref next to its fasta: each contig already coded by seqnt_map and nul terminated, one byte per base, 
+   with a directory of names and lengths, memory mapped read-only so that concurrent processes share one copy */
+#define REFMAP_MAGIC "EAGLERF2" // bases as seqnt_map codes, version 1 held the uppercased bases
+#define REFMAP_SUFFIX ".erf"
+
+typedef struct {
+    char magic[8];
+    uint64_t fa_size; // of the fasta converted, to reject a stale reference
+    int64_t fa_mtime;
+    uint64_t n_contigs;
+    uint64_t dir_offset; // bytes from the start of the file
+} refmap_header_t;
+
+typedef struct {
+    uint64_t name, seq; // bytes from the start of the file, nul terminated
+    uint64_t length;
+} refmap_contig_t;
+
+typedef struct {
+    void *map;
+    size_t size;
+    const refmap_header_t *header;
+    const refmap_contig_t *contig;
+    void *name_hash; // contig name to id
+} refmap_t;
+
+refmap_t *refmap_open(const char *fa_file);
+void refmap_close(refmap_t *r);
+
+int refmap_name2id(const refmap_t *r, const char *name);
+const char *refmap_name(const refmap_t *r, int id);
+fasta_t *refmap_fasta(const refmap_t *r, int id);
+
+#endif
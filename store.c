@@ -0,0 +1,192 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Given the sequencing data and candidate variant, explicitly test 
+the alternative hypothesis against the reference hypothesis
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "htslib/khash.h"
+#include "util.h"
+#include "store.h"
+
+KHASH_MAP_INIT_STR(sth, int) // hashmap: contig name key, tid value
+
+store_t *store_open(const char *store_file, const char *bam_file) {
+    /* Map the store and check that it was built from bam_file as it is now */
+    int fd = open(store_file, O_RDONLY);
+    if (fd < 0) { exit_err("failed to open read store %s\n", store_file); }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof (store_header_t)) { exit_err("bad read store %s\n", store_file); }
+
+    store_t *s = malloc(sizeof (store_t));
+    s->size = st.st_size;
+    s->map = mmap(NULL, s->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->map == MAP_FAILED) { exit_err("failed to map read store %s\n", store_file); }
+    s->header = (const store_header_t *)s->map;
+    if (memcmp(s->header->magic, STORE_MAGIC, 8) != 0) { exit_err("not an EAGLE read store %s\n", store_file); }
+
+    int i;
+    for (i = 0; i < STORE_NCOL; i++) {
+        if (s->header->offset[i] + s->header->length[i] > s->size) { exit_err("truncated read store %s\n", store_file); }
+    }
+    if (bam_file != NULL) {
+        if (stat(bam_file, &st) != 0) { exit_err("failed to stat BAM file %s\n", bam_file); }
+        if ((uint64_t)st.st_size != s->header->bam_size || (int64_t)st.st_mtime != s->header->bam_mtime) { exit_err("read store %s is out of date with %s, rebuild it with eagle-index\n", store_file, bam_file); }
+    }
+
+    const char *base = (const char *)s->map;
+    const uint64_t *off = s->header->offset;
+    s->tid = (const int32_t *)(base + off[STORE_TID]);
+    s->pos = (const int32_t *)(base + off[STORE_POS]);
+    s->ref_end = (const int32_t *)(base + off[STORE_REF_END]);
+    s->end = (const int32_t *)(base + off[STORE_END]);
+    s->s_clip = (const int32_t *)(base + off[STORE_S_CLIP]);
+    s->e_clip = (const int32_t *)(base + off[STORE_E_CLIP]);
+    s->lqseq = (const int32_t *)(base + off[STORE_LQSEQ]);
+    s->qlen = (const int32_t *)(base + off[STORE_QLEN]);
+    s->n_cigar = (const int32_t *)(base + off[STORE_NCIGAR]);
+    s->nh = (const int32_t *)(base + off[STORE_NH]);
+    s->flag = (const uint16_t *)(base + off[STORE_FLAG]);
+    s->mapq = (const uint8_t *)(base + off[STORE_MAPQ]);
+    s->seq_off = (const uint64_t *)(base + off[STORE_SEQ_OFF]);
+    s->qual_off = (const uint64_t *)(base + off[STORE_QUAL_OFF]);
+    s->name_off = (const uint64_t *)(base + off[STORE_NAME_OFF]);
+    s->cigar_off = (const uint64_t *)(base + off[STORE_CIGAR_OFF]);
+    s->xa_off = (const uint64_t *)(base + off[STORE_XA_OFF]);
+    s->rg_off = (const uint64_t *)(base + off[STORE_RG_OFF]);
+    s->splice_off = (const uint64_t *)(base + off[STORE_SPLICE_OFF]);
+    s->seq = (const uint8_t *)(base + off[STORE_SEQ]);
+    s->qual = (const uint8_t *)(base + off[STORE_QUAL]);
+    s->str = base + off[STORE_STR];
+    s->splice = (const int32_t *)(base + off[STORE_SPLICE]);
+    s->target_off = (const uint64_t *)(base + off[STORE_TARGET_OFF]);
+    s->tid_first = (const uint64_t *)(base + off[STORE_TID_FIRST]);
+    s->win_off = (const uint64_t *)(base + off[STORE_WIN_OFF]);
+    s->win = (const uint64_t *)(base + off[STORE_WIN]);
+
+    khash_t(sth) *h = kh_init(sth);
+    for (i = 0; i < (int)s->header->n_targets; i++) {
+        int absent;
+        khiter_t k = kh_put(sth, h, s->str + s->target_off[i], &absent); // keys point into the map
+        kh_val(h, k) = i;
+    }
+    s->name_hash = h;
+    return s;
+}
+
+void store_close(store_t *s) {
+    if (s != NULL) {
+        kh_destroy(sth, (khash_t(sth) *)s->name_hash); s->name_hash = NULL;
+        munmap(s->map, s->size); s->map = NULL;
+        s->header = NULL;
+    }
+}
+
+int store_name2id(const store_t *s, const char *chr) {
+    khash_t(sth) *h = (khash_t(sth) *)s->name_hash;
+    khiter_t k = kh_get(sth, h, chr);
+    return (k != kh_end(h)) ? kh_val(h, k) : -1;
+}
+
+const char *store_target_name(const store_t *s, int tid) {
+    return s->str + s->target_off[tid];
+}
+
+const char *store_str(const store_t *s, uint64_t offset) {
+    return (offset == STORE_NONE) ? NULL : s->str + offset;
+}
+
+size_t store_query(const store_t *s, int tid, int beg, size_t *first) {
+    /* Reads of tid from *first to the returned bound include every read overlapping beg onwards, in position order, 
+       so a region ends at the first read at or past its end; those ending at or before beg are left to the caller */
+    *first = 0;
+    if (tid < 0 || tid >= (int)s->header->n_targets) return 0;
+    uint64_t nwin = s->win_off[tid + 1] - s->win_off[tid];
+    uint64_t w = (beg < 0) ? 0 : (uint64_t)beg >> STORE_WINDOW_SHIFT;
+    if (w >= nwin) { // past the last read of the contig
+        *first = s->tid_first[tid + 1];
+        return s->tid_first[tid + 1];
+    }
+    *first = s->win[s->win_off[tid] + w];
+    return s->tid_first[tid + 1];
+}
+
+int store_filter(const store_t *s, size_t i, int pao, int nodup, int min_mapq) {
+    /* As read_filter, from the columns */
+    if (s->tid[i] < 0) return 1; // not mapped
+    if (nodup && (s->flag[i] & BAM_FDUP)) return 1;
+    if (pao && (s->flag[i] & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) return 1;
+    if (s->mapq[i] < min_mapq) return 1;
+    return 0;
+}
+
+void store_span(const store_t *s, size_t i, int isc, int *pos, int *end) {
+    /* As read_span */
+    *pos = s->pos[i];
+    *end = s->end[i];
+    if (!isc) *pos -= s->s_clip[i];
+    else *end -= s->e_clip[i];
+}
+
+read_t *store_read(const store_t *s, size_t i, int isc, int splice, int phred64, int const_qual, int verbose) {
+    /* Same read as read_fetch would build from the bam record */
+    int j;
+    int tid = s->tid[i];
+    read_t *read = read_create((verbose) ? (char *)store_str(s, s->name_off[i]) : NULL, tid, (char *)store_target_name(s, tid), s->pos[i]);
+    read->sam_flag = s->flag[i];
+    if (verbose) read->flag = bam_flag2str(s->flag[i]);
+    if (verbose) read->cigar = strdup(store_str(s, s->cigar_off[i]));
+
+    read->n_cigar = s->n_cigar[i];
+    read->end = s->end[i];
+    read->inferred_length = s->qlen[i];
+
+    int n_skip = (splice) ? (int)(s->splice_off[i + 1] - s->splice_off[i]) : 0;
+    if (n_skip > 0) {
+        const int32_t *sp = s->splice + 2 * s->splice_off[i];
+        read->splice_pos = malloc(n_skip * sizeof (*read->splice_pos));
+        read->splice_offset = malloc(n_skip * sizeof (*read->splice_offset));
+        for (j = 0; j < n_skip; j++) {
+            read->splice_pos[j] = (isc) ? sp[2 * j] - s->s_clip[i] : sp[2 * j];
+            read->splice_offset[j] = sp[2 * j + 1];
+        }
+    }
+    read->n_splice = n_skip;
+
+    int s_offset = s->s_clip[i];
+    int e_offset = s->e_clip[i];
+    if (!isc) {
+        read->pos -= s_offset; // compensate for soft clip in mapped position
+        s_offset = 0;
+        e_offset = 0;
+    }
+    else {
+        read->end -= e_offset; // compensate for soft clip in mapped position
+    }
+    read->length = s->lqseq[i] - (s_offset + e_offset);
+    if (read->length < 0) read->length = 0;
+
+    const uint8_t *seq = s->seq + s->seq_off[i];
+    read->qseq = calloc((read->length + 1) / 2 + 1, 1);
+    if (s_offset % 2 == 0) { // byte aligned, copy the packed bases as is
+        memcpy(read->qseq, seq + s_offset / 2, (read->length + 1) / 2);
+    }
+    else {
+        for (j = 0; j < read->length; j++) bam_set_seqi(read->qseq, j, bam_seqi(seq, j + s_offset));
+    }
+
+    read_set_qual(read, s->qual + s->qual_off[i] + s_offset, phred64, const_qual); // as read_fetch
+
+    const char *xa = store_str(s, s->xa_off[i]);
+    if (xa != NULL) read->multimapXA = strdup(xa);
+    read->multimapNH = s->nh[i];
+    return read;
+}
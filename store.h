@@ -0,0 +1,69 @@
+/*
+EAGLE: explicit alternative genome likelihood evaluator
+Given the sequencing data and candidate variant, explicitly test 
+the alternative hypothesis against the reference hypothesis
+
+Copyright 2016 Tony Kuo
+This program is distributed under the terms of the GNU General Public License
+*/
+
+#ifndef _store_h_
+#define _store_h_
+
+#include <stdint.h>
+#include "htslib/sam.h"
+#include "vector.h"
+
+/* Read store written by eagle-index: the reads of a bam as columns, each an array over all reads in bam order, 
+   memory mapped so that reads are built without decompressing or parsing anything */
+#define STORE_MAGIC "EAGLERS1"
+#define STORE_WINDOW_SHIFT 14 // position index in windows of 16kb, as the bam linear index
+#define STORE_NONE UINT64_MAX // string offset of an absent tag
+
+enum store_column {
+    STORE_TID, STORE_POS, STORE_REF_END, STORE_END, STORE_S_CLIP, STORE_E_CLIP, // int32, per read
+    STORE_LQSEQ, STORE_QLEN, STORE_NCIGAR, STORE_NH,                            // int32, per read
+    STORE_FLAG,                                                                 // uint16, per read
+    STORE_MAPQ,                                                                 // uint8, per read
+    STORE_SEQ_OFF, STORE_QUAL_OFF, STORE_NAME_OFF, STORE_CIGAR_OFF, STORE_XA_OFF, STORE_RG_OFF, // uint64, per read
+    STORE_SPLICE_OFF,                                                           // uint64, per read + 1
+    STORE_SEQ, STORE_QUAL, STORE_STR,                                           // packed bases, qualities, nul terminated strings
+    STORE_SPLICE,                                                               // int32 pairs, splice position in read and skipped length
+    STORE_TARGET_OFF,                                                           // uint64, per contig, name in STORE_STR
+    STORE_TID_FIRST, STORE_WIN_OFF,                                             // uint64, per contig + 1
+    STORE_WIN,                                                                  // uint64, first read overlapping each window
+    STORE_NCOL
+};
+
+typedef struct {
+    char magic[8];
+    uint64_t bam_size; // of the bam indexed, to reject a stale store
+    int64_t bam_mtime;
+    uint64_t n_targets, n_reads;
+    uint64_t offset[STORE_NCOL], length[STORE_NCOL]; // bytes from the start of the file
+} store_header_t;
+
+typedef struct {
+    void *map;
+    size_t size;
+    const store_header_t *header;
+    const int32_t *tid, *pos, *ref_end, *end, *s_clip, *e_clip, *lqseq, *qlen, *n_cigar, *nh, *splice;
+    const uint16_t *flag;
+    const uint8_t *mapq, *seq, *qual;
+    const uint64_t *seq_off, *qual_off, *name_off, *cigar_off, *xa_off, *rg_off, *splice_off, *target_off, *tid_first, *win_off, *win;
+    const char *str;
+    void *name_hash; // contig name to tid
+} store_t;
+
+store_t *store_open(const char *store_file, const char *bam_file);
+void store_close(store_t *s);
+
+int store_name2id(const store_t *s, const char *chr);
+const char *store_target_name(const store_t *s, int tid);
+const char *store_str(const store_t *s, uint64_t offset);
+size_t store_query(const store_t *s, int tid, int beg, size_t *first);
+int store_filter(const store_t *s, size_t i, int pao, int nodup, int min_mapq);
+void store_span(const store_t *s, size_t i, int isc, int *pos, int *end);
+read_t *store_read(const store_t *s, size_t i, int isc, int splice, int phred64, int const_qual, int verbose);
+
+#endif
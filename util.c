@@ -275,3 +275,11 @@ u_int32_t fnv_32a_str(char *str) {
     //hash = (hash>>24) ^ (hash & MASK_24); /* xor-fold fold a 32 bit FNV-1 hash down to 24 bits */
     return hash;
 }
+
+/* From http://prng.di.unimi.it/splitmix64.c */
+u_int64_t splitmix64(u_int64_t *state) {
+    u_int64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
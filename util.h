@@ -31,6 +31,8 @@ This program is distributed under the terms of the GNU General Public License
 #define MASK_16 (((u_int32_t)1<<16)-1) /* i.e., (u_int32_t)0xffff */
 #define MASK_24 (((u_int32_t)1<<24)-1) /* i.e., (u_int32_t)0xffff */
 
+#define READINFO_MAGIC "EAGLERI\1" // 8 bytes opening the binary read info stream of eagle --readinfo
+
 char *strdup1(const char *src);
 void str_resize(char **str, int size);
 
@@ -53,5 +55,6 @@ vector_t *all_and_singletons(int n);
 int is_subset (int arr1[], int arr2[], int m, int n);
 
 u_int32_t fnv_32a_str(char *str);
+u_int64_t splitmix64(u_int64_t *state);
 
 #endif
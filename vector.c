@@ -10,6 +10,8 @@ This program is distributed under the terms of the GNU General Public License
 #include <stdlib.h>
 #include <ctype.h>
 #include <float.h>
+#include "htslib/cram.h"
+#include "htslib/kstring.h"
 #include "util.h"
 #include "vector.h"
 
@@ -185,6 +187,7 @@ variant_t *variant_create(char *chr, int pos, char *ref, char *alt) {
     variant_t *v = malloc(sizeof (variant_t));
     v->chr = strdup(chr);
     v->pos = pos;
+    v->index = 0;
     v->ref = strdup(ref);
     v->alt = strdup(alt);
     return v;
@@ -201,50 +204,67 @@ void variant_destroy(variant_t *v) {
 
 read_t *read_create(char *name, int tid, char *chr, int pos) {
     read_t *r = malloc(sizeof (read_t));
-    r->name = strdup(name);
+    r->name = (name != NULL) ? strdup(name) : NULL;
     r->tid = tid;
-    r->chr = strdup(chr);
+    r->chr = chr; // interned by the caller
     r->pos = pos;
     r->end = pos;
     r->prgu = -DBL_MAX;
     r->prgv = -DBL_MAX;
     r->pout = -DBL_MAX;
     r->index = 0;
-    r->var_list = vector_create(1, VOID_T);
+    r->var_list = NULL;
 
     r->length = r->n_cigar = r->inferred_length = r->multimapNH = r->n_splice = 0;
+    r->sam_flag = 0;
     r->qseq = NULL;
     r->qual = NULL;
     r->flag = NULL;
-    r->cigar_opchr = NULL;
-    r->cigar_oplen = NULL;
+    r->cigar = NULL;
     r->splice_pos = NULL;
     r->splice_offset = NULL;
     r->multimapXA = NULL;
-    r->is_dup = 0;
-    r->is_reverse = 0;
-    r->is_secondary = 0;
-    r->is_read2 = 0;
     return r;
 }
 
+static void *memdup(const void *src, size_t n) {
+    if (src == NULL) return NULL;
+    void *dst = malloc(n);
+    memcpy(dst, src, n);
+    return dst;
+}
+
+read_t *read_dup(const read_t *r) { // deep copy of a fetched read, the variant list is not copied
+    read_t *d = malloc(sizeof (read_t));
+    memcpy(d, r, sizeof (read_t));
+    d->var_list = NULL;
+    d->name = (r->name != NULL) ? strdup(r->name) : NULL;
+    d->flag = (r->flag != NULL) ? strdup(r->flag) : NULL;
+    d->cigar = (r->cigar != NULL) ? strdup(r->cigar) : NULL;
+    d->multimapXA = (r->multimapXA != NULL) ? strdup(r->multimapXA) : NULL;
+    d->qseq = memdup(r->qseq, (r->length + 1) / 2);
+    d->qual = memdup(r->qual, r->length);
+    d->splice_pos = memdup(r->splice_pos, r->n_splice * sizeof (*r->splice_pos));
+    d->splice_offset = memdup(r->splice_offset, r->n_splice * sizeof (*r->splice_offset));
+    return d;
+}
+
 void read_destroy(read_t *r) {
     if (r != NULL) {
         r->tid = r->pos = r->end = r->length = r->n_cigar = r->inferred_length = r->multimapNH = r->n_splice = 0;
-        r->is_dup = r->is_reverse = r->is_secondary = r->is_read2 = 0;
+        r->sam_flag = 0;
         r->prgu = r->prgv = r->pout = 0;
         r->index = 0;
+        r->chr = NULL;
         free(r->name); r->name = NULL;
-        free(r->chr); r->chr = NULL;
         free(r->qseq); r->qseq = NULL;
         free(r->qual); r->qual = NULL;
         free(r->flag); r->flag = NULL;
-        free(r->cigar_opchr); r->cigar_opchr = NULL;
-        free(r->cigar_oplen); r->cigar_oplen = NULL;
+        free(r->cigar); r->cigar = NULL;
         free(r->splice_pos); r->splice_pos = NULL;
         free(r->splice_offset); r->splice_offset = NULL;
         free(r->multimapXA); r->multimapXA = NULL;
-        vector_destroy(r->var_list); free(r->var_list); r->var_list = NULL;
+        if (r->var_list != NULL) { vector_destroy(r->var_list); free(r->var_list); r->var_list = NULL; }
     }
 }
 
@@ -300,35 +320,32 @@ void stats_destroy(stats_t *s) {
 }
 
 int nat_sort_cmp(const void *a, const void *b, enum type var_type) {
-    char *str1, *str2;
+    /* Natural order, compared in place without copies */
+    const char *str1, *str2;
     switch (var_type) {
         case VARIANT_T: {
             variant_t *c1 = *(variant_t **)a;
             variant_t *c2 = *(variant_t **)b;
             if (strcasecmp(c1->chr, c2->chr) == 0) return (c1->pos > c2->pos) - (c1->pos < c2->pos);
-            str1 = strdup(c1->chr);
-            str2 = strdup(c2->chr);
-            c1 = NULL;
-            c2 = NULL;
+            str1 = c1->chr;
+            str2 = c2->chr;
             break;
         }
         case REGION_T: {
             region_t *c1 = *(region_t **)a;
             region_t *c2 = *(region_t **)b;
             if (strcasecmp(c1->chr, c2->chr) == 0) return ((c1->pos1 > c2->pos1) - (c1->pos1 < c2->pos1)) + ((c1->pos2 > c2->pos2) - (c1->pos2 < c2->pos2));
-            str1 = strdup(c1->chr);
-            str2 = strdup(c2->chr);
-            c1 = NULL;
-            c2 = NULL;
+            str1 = c1->chr;
+            str2 = c2->chr;
             break;
         }
         default:
-            str1 = strdup(*(char **)a);
-            str2 = strdup(*(char **)b);
+            str1 = *(char **)a;
+            str2 = *(char **)b;
             break;
     }
-    char *s1 = str1;
-    char *s2 = str2;
+    const char *s1 = str1;
+    const char *s2 = str2;
     int cmp = 0;
     while (cmp == 0 && *s1 != '\0' && *s2 != '\0') {
         if (isspace(*s1) && isspace(*s2)) { // ignore whitespace
@@ -336,9 +353,9 @@ int nat_sort_cmp(const void *a, const void *b, enum type var_type) {
             s2 += 1;
         }
         else if ((isalpha(*s1) && isalpha(*s2)) || (ispunct(*s1) && ispunct(*s2))) { // compare alphabet and punctuation
-            *s1 = tolower(*s1);
-            *s2 = tolower(*s2);
-            cmp = (*s1 > *s2) - (*s1 < *s2);
+            int c1 = tolower(*s1);
+            int c2 = tolower(*s2);
+            cmp = (c1 > c2) - (c1 < c2);
             s1 += 1;
             s2 += 1;
         }
@@ -361,8 +378,6 @@ int nat_sort_cmp(const void *a, const void *b, enum type var_type) {
             }
         }
     }
-    free(str1); str1 = NULL;
-    free(str2); str2 = NULL;
     return cmp;
 }
 
@@ -378,68 +393,133 @@ int nat_sort_region(const void *a, const void *b) {
     return nat_sort_cmp(a, b, REGION_T);
 }
 
-read_t *read_fetch(bam_hdr_t *bam_header, bam1_t *aln, int pao, int isc, int nodup, int splice, int phred64, int const_qual) {
-    int i, j;
-    if (aln->core.tid < 0) return NULL; // not mapped
-    read_t *read = read_create((char *)aln->data, aln->core.tid, bam_header->target_name[aln->core.tid], aln->core.pos);
-
-    char *flag = bam_flag2str(aln->core.flag);
-    if (flag != NULL) read->flag = strdup(flag);
-    else read->flag = NULL;
-    free(flag); flag = NULL;
-
-    int n;
-    char *s, token[strlen(read->flag) + 1];
-    for (s = read->flag; sscanf(s, "%[^,]%n", token, &n) == 1; s += n + 1) {
-        if (strcmp("DUP", token) == 0) read->is_dup = 1;
-        else if (strcmp("REVERSE", token) == 0) read->is_reverse = 1;
-        else if (strcmp("SECONDARY", token) == 0 || strcmp("SUPPLEMENTARY", token) == 0) read->is_secondary = 1;
-        else if (strcmp("READ2", token) == 0) read->is_read2 = 1;
-        if (*(s + n) != ',') break;
+bam_hts_t *bam_hts_create(const char *bam_file, const char *fa_file, htsThreadPool *tpool, const bam_hts_t *shared) {
+    /* Open bam or cram, header and index once, to be reused for every region query by the owning thread */
+    bam_hts_t *h = malloc(sizeof (bam_hts_t));
+    h->sam_in = sam_open(bam_file, "r"); // open bam file
+    if (h->sam_in == NULL) { exit_err("failed to open BAM file %s\n", bam_file); }
+    if (tpool != NULL && tpool->pool != NULL) hts_set_thread_pool(h->sam_in, tpool); // shared bgzf decompression threads
+    if (h->sam_in->format.format == cram) {
+        if (shared != NULL && shared->sam_in->format.format == cram) { // decode against the reference sequences already loaded by the shared handle
+            if (hts_set_opt(h->sam_in, CRAM_OPT_SHARED_REF, cram_get_refs(shared->sam_in)) != 0) { exit_err("failed to share CRAM reference %s\n", bam_file); }
+        }
+        else if (fa_file != NULL && hts_set_fai_filename(h->sam_in, fa_file) != 0) { exit_err("failed to set CRAM reference %s\n", fa_file); }
+        hts_set_opt(h->sam_in, CRAM_OPT_REQUIRED_FIELDS, SAM_QNAME | SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_SEQ | SAM_QUAL | SAM_AUX); // skip mate fields
     }
-    if ((nodup && read->is_dup) || (pao && read->is_secondary)) {
-        read_destroy(read);
-        return NULL;
+    h->bam_header = sam_hdr_read(h->sam_in); // bam header
+    if (h->bam_header == 0) { exit_err("bad header %s\n", bam_file); }
+    h->bam_idx = sam_index_load(h->sam_in, bam_file); // bam index
+    if (h->bam_idx == NULL) { exit_err("failed to open BAM index %s\n", bam_file); }
+    h->aln = bam_init1(); // initialize an alignment
+    return h;
+}
+
+void bam_hts_destroy(bam_hts_t *h) {
+    if (h != NULL) {
+        bam_destroy1(h->aln); h->aln = NULL;
+        hts_idx_destroy(h->bam_idx); h->bam_idx = NULL;
+        bam_hdr_destroy(h->bam_header); h->bam_header = NULL;
+        sam_close(h->sam_in); h->sam_in = NULL;
     }
+}
+
+int read_filter(const bam1_t *aln, int pao, int nodup, int min_mapq) {
+    /* Reads rejected from flag bits and mapping quality alone, before anything is decoded */
+    if (aln->core.tid < 0) return 1; // not mapped
+    if (nodup && (aln->core.flag & BAM_FDUP)) return 1;
+    if (pao && (aln->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY))) return 1;
+    if (aln->core.qual < min_mapq) return 1;
+    return 0;
+}
+
+void read_span(const bam1_t *aln, int isc, int *pos, int *end) {
+    /* Same pos and end as read_fetch, from the cigar without building the read */
+    int i;
+    int start_align = 0;
+    int s_offset = 0;
+    int e_offset = 0;
+    uint32_t *cigar = bam_get_cigar(aln);
+    *pos = *end = aln->core.pos;
+    for (i = 0; i < aln->core.n_cigar; i++) {
+        int op = bam_cigar_op(cigar[i]);
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) start_align = 1;
+        else if (start_align == 0 && op == BAM_CSOFT_CLIP) s_offset = bam_cigar_oplen(cigar[i]);
+        else if (start_align == 1 && op == BAM_CSOFT_CLIP) e_offset = bam_cigar_oplen(cigar[i]);
+        if (op != BAM_CINS) *end += bam_cigar_oplen(cigar[i]);
+    }
+    if (!isc) *pos -= s_offset;
+    else *end -= e_offset;
+}
+
+void read_set_qual(read_t *read, const uint8_t *qual, int phred64, int const_qual) {
+    /* Qualities of the read->length bases from qual, clamped to the probability tables as they are used to index them */
+    int i;
+    read->qual = malloc(read->length + 1);
+    for (i = 0; i < read->length; i++) {
+        int q = (const_qual > 0) ? const_qual : (phred64) ? qual[i] - 31 : qual[i]; // account for phred64
+        if (q < 0) q = 0;
+        else if (q >= NQUAL) q = NQUAL - 1;
+        read->qual[i] = q;
+    }
+}
+
+read_t *read_fetch(bam_hdr_t *bam_header, bam1_t *aln, int pao, int isc, int nodup, int splice, int phred64, int const_qual, int verbose) {
+    /* Compact read built directly from the bam record: packed bases, byte qualities and flag bits, name, flag and cigar strings only when verbose */
+    int i, j;
+    if (read_filter(aln, pao, nodup, 0)) return NULL;
+
+    read_t *read = read_create((verbose) ? bam_get_qname(aln) : NULL, aln->core.tid, bam_header->target_name[aln->core.tid], aln->core.pos);
+    read->sam_flag = aln->core.flag;
+    if (verbose) read->flag = bam_flag2str(aln->core.flag);
 
     int start_align = 0;
     int s_offset = 0; // offset for softclip at start
     int e_offset = 0; // offset for softclip at end
 
-    u_int32_t *cigar = bam_get_cigar(aln);
+    uint32_t *cigar = bam_get_cigar(aln);
     read->n_cigar = aln->core.n_cigar;
-    read->cigar_oplen = malloc(read->n_cigar * sizeof (read->cigar_oplen));
-    read->cigar_opchr = malloc((read->n_cigar + 1) * sizeof (read->cigar_opchr));
-    read->splice_pos = malloc(read->n_cigar * sizeof (read->splice_pos));
-    read->splice_offset = malloc(read->n_cigar * sizeof (read->splice_offset));
+
+    int n_skip = 0;
+    if (splice) {
+        for (i = 0; i < read->n_cigar; i++) {
+            if (bam_cigar_op(cigar[i]) == BAM_CREF_SKIP) n_skip++;
+        }
+    }
+    if (n_skip > 0) {
+        read->splice_pos = malloc(n_skip * sizeof (*read->splice_pos));
+        read->splice_offset = malloc(n_skip * sizeof (*read->splice_offset));
+    }
 
     j = 0;
     int splice_pos = 0; // track splice position in reads
     for (i = 0; i < read->n_cigar; i++) {
-        read->cigar_oplen[i] = bam_cigar_oplen(cigar[i]);
-        read->cigar_opchr[i] = bam_cigar_opchr(cigar[i]);
-        read->splice_pos[i] = 0;
-        read->splice_offset[i] = 0;
+        int op = bam_cigar_op(cigar[i]);
+        int oplen = bam_cigar_oplen(cigar[i]);
 
-        if (read->cigar_opchr[i] == 'M' || read->cigar_opchr[i] == '=' || read->cigar_opchr[i] == 'X') start_align = 1;
-        else if (start_align == 0 && read->cigar_opchr[i] == 'S') s_offset = read->cigar_oplen[i];
-        else if (start_align == 1 && read->cigar_opchr[i] == 'S') e_offset = read->cigar_oplen[i];
+        if (op == BAM_CMATCH || op == BAM_CEQUAL || op == BAM_CDIFF) start_align = 1;
+        else if (start_align == 0 && op == BAM_CSOFT_CLIP) s_offset = oplen;
+        else if (start_align == 1 && op == BAM_CSOFT_CLIP) e_offset = oplen;
 
-        if (splice && read->cigar_opchr[i] == 'N') {
+        if (n_skip > 0 && op == BAM_CREF_SKIP) {
             read->splice_pos[j] = (isc) ? splice_pos - s_offset : splice_pos;
-            read->splice_offset[j] = read->cigar_oplen[i];
+            read->splice_offset[j] = oplen;
             j++;
         }
-        else if (splice && read->cigar_opchr[i] != 'D') {
-            splice_pos += read->cigar_oplen[i];
+        else if (n_skip > 0 && op != BAM_CDEL) {
+            splice_pos += oplen;
         }
 
-        if (read->cigar_opchr[i] != 'I') read->end += read->cigar_oplen[i];
+        if (op != BAM_CINS) read->end += oplen;
     }
-    read->cigar_opchr[read->n_cigar] = '\0';
     read->inferred_length = bam_cigar2qlen(read->n_cigar, cigar);
     read->n_splice = j;
 
+    if (verbose) {
+        kstring_t str = {0, 0, NULL};
+        for (i = 0; i < read->n_cigar; i++) ksprintf(&str, "%d%c", bam_cigar_oplen(cigar[i]), bam_cigar_opchr(cigar[i]));
+        read->cigar = (str.s != NULL) ? ks_release(&str) : strdup("*");
+    }
+
     if (!isc) {
         read->pos -= s_offset; // compensate for soft clip in mapped position
         s_offset = 0;
@@ -449,20 +529,24 @@ read_t *read_fetch(bam_hdr_t *bam_header, bam1_t *aln, int pao, int isc, int nod
         read->end -= e_offset; // compensate for soft clip in mapped position
     }
     read->length = aln->core.l_qseq - (s_offset + e_offset);
-    read->qseq = malloc((read->length + 1) * sizeof (read->qseq));
-    read->qual = malloc(read->length  * sizeof (read->qual));
-    uint8_t *qual = bam_get_qual(aln);
-    for (i = 0; i < read->length; i++) {
-        read->qseq[i] = toupper(seq_nt16_str[bam_seqi(bam_get_seq(aln), i + s_offset)]); // get nucleotide id and convert into IUPAC id.
-        if (const_qual > 0) read->qual[i] = const_qual;
-        else read->qual[i] = (phred64) ? qual[i] - 31 : qual[i]; // account for phred64
+    if (read->length < 0) read->length = 0;
+
+    uint8_t *seq = bam_get_seq(aln);
+    read->qseq = calloc((read->length + 1) / 2 + 1, 1);
+    if (s_offset % 2 == 0) { // byte aligned, copy the packed bases as is
+        memcpy(read->qseq, seq + s_offset / 2, (read->length + 1) / 2);
     }
-    read->qseq[read->length] = '\0';
+    else {
+        for (i = 0; i < read->length; i++) bam_set_seqi(read->qseq, i, bam_seqi(seq, i + s_offset));
+    }
+
+    read_set_qual(read, bam_get_qual(aln) + s_offset, phred64, const_qual); // qualities of the kept bases, earlier versions took those from the start of the record with --isc
 
-    read->multimapXA = NULL;
-    if (bam_aux_get(aln, "XA")) read->multimapXA = strdup(bam_aux2Z(bam_aux_get(aln, "XA")));
+    uint8_t *xa = bam_aux_get(aln, "XA");
+    if (xa != NULL) read->multimapXA = strdup(bam_aux2Z(xa));
 
     read->multimapNH = 1;
-    if (bam_aux_get(aln, "NH")) read->multimapNH = bam_aux2i(bam_aux_get(aln, "NH"));
+    uint8_t *nh = bam_aux_get(aln, "NH");
+    if (nh != NULL) read->multimapNH = bam_aux2i(nh);
     return read;
 }
@@ -56,6 +56,7 @@ vector_double_t *vector_double_dup(vector_double_t *a);
 
 typedef struct {
     int pos;
+    size_t index; // position in the sorted variant list
     char *chr, *ref, *alt;
 } variant_t;
 
@@ -63,16 +64,28 @@ variant_t *variant_create(char *chr, int pos, char *ref, char *alt);
 void variant_destroy(variant_t *v);
 
 typedef struct {
-    vector_t *var_list;
+    vector_t *var_list; // NULL until used
     float prgu, prgv, pout;
-    int32_t *qual, *cigar_oplen, *splice_pos, *splice_offset;
+    int32_t *splice_pos, *splice_offset; // NULL unless spliced
     int32_t tid, pos, end, length, inferred_length, n_cigar, n_splice, multimapNH;
     int16_t index;
-    int8_t is_dup, is_reverse, is_secondary, is_read2;
-    char *qseq, *chr, *name, *flag, *cigar_opchr, *multimapXA;
+    uint16_t sam_flag; // BAM_F* bits
+    uint8_t *qseq, *qual; // qseq packed as 4-bit nt16 codes, two bases per byte
+    char *chr; // interned, not owned by the read
+    char *name, *flag, *cigar, *multimapXA; // name, flag and cigar strings only rendered when asked for
 } read_t;
 
+#define read_is_dup(r) (((r)->sam_flag & BAM_FDUP) != 0)
+#define read_is_reverse(r) (((r)->sam_flag & BAM_FREVERSE) != 0)
+#define read_is_secondary(r) (((r)->sam_flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) != 0)
+#define read_is_read2(r) (((r)->sam_flag & BAM_FREAD2) != 0)
+#define read_base(r, i) (seq_nt16_str[bam_seqi((r)->qseq, (i))]) // IUPAC base at read position i
+
+#define NQUAL 50 // phred scores 0 to 49 of the p_match and p_mismatch tables that read qualities index
+
 read_t *read_create(char *name, int tid, char *chr, int pos);
+read_t *read_dup(const read_t *r);
+void read_set_qual(read_t *read, const uint8_t *qual, int phred64, int const_qual);
 void read_destroy(read_t *r);
 
 typedef struct {
@@ -106,6 +119,18 @@ int nat_sort_vector(const void *a, const void *b);
 int nat_sort_variant(const void *a, const void *b);
 int nat_sort_region(const void *a, const void *b);
 
-read_t *read_fetch(bam_hdr_t *bam_header, bam1_t *aln, int pao, int isc, int nodup, int splice, int phred64, int const_qual);
+typedef struct {
+    samFile *sam_in;
+    bam_hdr_t *bam_header;
+    hts_idx_t *bam_idx;
+    bam1_t *aln;
+} bam_hts_t;
+
+bam_hts_t *bam_hts_create(const char *bam_file, const char *fa_file, htsThreadPool *tpool, const bam_hts_t *shared);
+void bam_hts_destroy(bam_hts_t *h);
+
+int read_filter(const bam1_t *aln, int pao, int nodup, int min_mapq);
+void read_span(const bam1_t *aln, int isc, int *pos, int *end);
+read_t *read_fetch(bam_hdr_t *bam_header, bam1_t *aln, int pao, int isc, int nodup, int splice, int phred64, int const_qual, int verbose);
 
 #endif